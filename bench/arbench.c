@@ -0,0 +1,334 @@
+/*
+ * Copyright (c) 2015, Quentin Schwerkolt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * arbench: extract an archive into a scratch directory, once through
+ * the mapping and once through a pipe, and report the throughput and
+ * the read and write system calls of each reader.  A pipe cannot be
+ * mapped, so it takes the read(2) path, which every archive went
+ * through before the mapped reader.  System calls are counted from
+ * /proc/self/io, which only Linux has; elsewhere they print as "-".
+ *
+ * With -j, the archive is extracted instead as mpkg installs it, with
+ * ar_extract_all, by 1, 2, 4, ... and at last the given number of jobs,
+ * and the time each took is reported along with the speedup over one
+ * job.  smallfiles.sh builds the archive of many small files that shows
+ * it best.
+ *
+ * With -u, each reader also extracts the archive with the hashes of its
+ * members ignored, and the share of the extraction time that goes into
+ * verifying them is reported.  Members split into blocks carry their
+ * hashes in the block index and are verified either way.
+ */
+
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif	/* HAVE_CONFIG_H */
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ar.h"
+
+struct run {
+	double		seconds;
+	long long	reads;		/* -1 when unknown */
+	long long	writes;
+};
+
+static void	counters(long long *reads, long long *writes);
+static void	extract(const char *archive, int piped, int jobs,
+			int unhashed, struct run *run);
+static void	feed(const char *archive, const char *fifo);
+static int	rm_entry(const char *path, const struct stat *sb, int flag,
+			 struct FTW *ftw);
+static void	usage(char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+int
+main(int argc, char **argv)
+{
+	double single, verified;
+	int ch, compare, idx, jobs, maxjobs, piped, runs, unhashed;
+	struct run best, run;
+	struct stat sb;
+
+	compare = 0;
+	maxjobs = 0;
+	runs = 5;
+	while ((ch = getopt(argc, argv, "j:n:u")) != -1) {
+		switch (ch) {
+		case 'j':
+			maxjobs = (int)strtol(optarg, (char **)NULL, 10);
+			if (maxjobs < 1)
+				usage("%s -- invalid number of jobs", optarg);
+			break;
+
+		case 'n':
+			runs = (int)strtol(optarg, (char **)NULL, 10);
+			if (runs < 1)
+				usage("%s -- invalid number of runs", optarg);
+			break;
+
+		case 'u':
+			compare = 1;
+			break;
+
+		default:
+			usage("%c -- unknown option", (char)ch);
+			break;
+		}
+	}
+	if ((argc - optind) != 1)
+		usage(NULL);
+	if (stat(argv[optind], &sb) == -1)
+		err(1, "stat: %s", argv[optind]);
+
+	if (maxjobs) {
+		printf("%-8s %10s %10s\n", "jobs", "ms", "speedup");
+		single = 0;
+		for (jobs = 1; /* void */; jobs *= 2) {
+			/* the last step is the number asked for */
+			if (jobs > maxjobs)
+				jobs = maxjobs;
+			best.seconds = -1;
+			for (idx = 0; idx < runs; ++idx) {
+				extract(argv[optind], 0, jobs, 0, &run);
+				if (best.seconds < 0 ||
+				    run.seconds < best.seconds)
+					best = run;
+			}
+			if (jobs == 1)
+				single = best.seconds;
+			printf("%-8d %10.1f %10.2f\n", jobs,
+			       best.seconds * 1e3, single / best.seconds);
+			if (jobs == maxjobs)
+				break;
+		}
+		return (0);
+	}
+
+	printf("%-8s %-9s %10s %10s %10s %8s\n", "reader", "hashes",
+	       "MB/s", "reads", "writes", "verify");
+	for (piped = 0; piped < 2; ++piped) {
+		verified = 0;
+		for (unhashed = 0; unhashed <= compare; ++unhashed) {
+			/* the fastest run is the least disturbed by the host */
+			best.seconds = -1;
+			for (idx = 0; idx < runs; ++idx) {
+				extract(argv[optind], piped, 0, unhashed,
+					&run);
+				if (best.seconds < 0 ||
+				    run.seconds < best.seconds)
+					best = run;
+			}
+
+			printf("%-8s %-9s %10.1f", piped ? "pipe" : "mapped",
+			       unhashed ? "ignored" : "verified",
+			       (double)sb.st_size / 1e6 / best.seconds);
+			if (best.reads < 0)
+				printf(" %10s %10s", "-", "-");
+			else
+				printf(" %10lld %10lld", best.reads,
+				       best.writes);
+			if (!unhashed) {
+				verified = best.seconds;
+				printf(" %8s\n", "-");
+			} else
+				printf(" %7.1f%%\n", (verified - best.seconds) /
+				       verified * 100);
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * Read the number of read-like and write-like system calls made so far
+ * by this process.
+ */
+static void
+counters(long long *reads, long long *writes)
+{
+	FILE *fp;
+	char line[128];
+
+	*reads = *writes = -1;
+	if (!(fp = fopen("/proc/self/io", "r")))
+		return;
+	while (fgets(line, sizeof(line), fp)) {
+		if (!strncmp(line, "syscr:", 6))
+			*reads = strtoll(line + 6, (char **)NULL, 10);
+		else if (!strncmp(line, "syscw:", 6))
+			*writes = strtoll(line + 6, (char **)NULL, 10);
+	}
+	fclose(fp);
+}
+
+/*
+ * Extract archive into a fresh scratch directory and time it.  When
+ * piped, the archive is fed through a FIFO by a child process, whose
+ * own system calls are not counted.  With jobs, it goes through
+ * ar_extract_all with that many jobs.  When unhashed, the members are
+ * extracted as if they had no hash, except those split into blocks.
+ */
+static void
+extract(const char *archive, int piped, int jobs, int unhashed,
+	struct run *run)
+{
+	ar_info_t *info;
+	ar_t *ar;
+	char fifo[PATH_MAX], root[PATH_MAX], scratch[PATH_MAX];
+	const char *tmpdir;
+	long long reads, writes;
+	pid_t pid;
+	int status;
+	struct timespec end, start;
+
+	if (!(tmpdir = getenv("TMPDIR")))
+		tmpdir = "/tmp";
+	snprintf(scratch, PATH_MAX, "%s/arbench.XXXXXX", tmpdir);
+	if (!mkdtemp(scratch))
+		err(1, "mkdtemp: %s", scratch);
+	snprintf(root, PATH_MAX, "%s/root", scratch);
+	if (mkdir(root, 0755) == -1)
+		err(1, "mkdir: %s", root);
+
+	pid = -1;
+	if (piped) {
+		snprintf(fifo, PATH_MAX, "%s/fifo", scratch);
+		if (mkfifo(fifo, 0600) == -1)
+			err(1, "mkfifo: %s", fifo);
+		if ((pid = fork()) == -1)
+			err(1, "fork");
+		if (pid == 0)
+			feed(archive, fifo);
+	}
+
+	counters(&reads, &writes);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	ar = ar_open_read(piped ? fifo : archive);
+	ar_set_wrkdir(ar, root);
+	if (jobs) {
+		ar_set_jobs(ar, jobs);
+		ar_extract_all(ar);
+	} else {
+		while ((info = ar_next(ar))) {
+			if (unhashed && !info->blocksize)
+				info->hashed = 0;
+			ar_extract(ar, info);
+			free(info);
+		}
+	}
+	ar_close(ar);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	counters(&run->reads, &run->writes);
+	run->seconds = (double)(end.tv_sec - start.tv_sec) +
+		(double)(end.tv_nsec - start.tv_nsec) / 1e9;
+	if (reads < 0 || run->reads < 0)
+		run->reads = run->writes = -1;
+	else {
+		run->reads -= reads;
+		run->writes -= writes;
+	}
+
+	if (pid != -1) {
+		if (waitpid(pid, &status, 0) == -1)
+			err(1, "waitpid");
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			errx(1, "%s: could not feed the pipe", archive);
+	}
+	if (nftw(scratch, rm_entry, 16, FTW_DEPTH|FTW_PHYS) == -1)
+		err(1, "cannot remove %s", scratch);
+}
+
+/*
+ * Copy archive into fifo, in the child.
+ */
+static void
+feed(const char *archive, const char *fifo)
+{
+	char buf[65536];
+	char *p;
+	int ifd, ofd;
+	ssize_t nbytes, written;
+
+	if ((ifd = open(archive, O_RDONLY)) == -1)
+		err(1, "cannot open file: %s", archive);
+	if ((ofd = open(fifo, O_WRONLY)) == -1)
+		err(1, "cannot open file: %s", fifo);
+
+	while ((nbytes = read(ifd, buf, sizeof(buf))) > 0) {
+		for (p = buf; nbytes > 0; nbytes -= written, p += written) {
+			if ((written = write(ofd, p, (size_t)nbytes)) == -1)
+				err(1, "write: %s", fifo);
+		}
+	}
+	if (nbytes == -1)
+		err(1, "read: %s", archive);
+
+	_exit(0);
+}
+
+static int
+rm_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftw)
+{
+	(void)sb;
+	(void)flag;
+	(void)ftw;
+
+	return (remove(path));
+}
+
+static void
+usage(char *fmt, ...)
+{
+	va_list ap;
+
+	if (fmt) {
+		va_start(ap, fmt);
+		vwarnx(fmt, ap);
+		va_end(ap);
+	}
+
+	fprintf(stdout, "usage: %s [-u] [-j jobs] [-n runs] archive\n",
+		getprogname());
+	exit(2);
+}
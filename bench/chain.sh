@@ -0,0 +1,123 @@
+#!/bin/sh
+#
+# Copyright (c) 2015, Quentin Schwerkolt
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# * Redistributions of source code must retain the above copyright notice, this
+#   list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright notice,
+#   this list of conditions and the following disclaimer in the documentation
+#   and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+# SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+# CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+# OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+# chain.sh: for each depth, install the head of a chain of that many
+# dependencies, c<depth>_0 -> c<depth>_1 -> ..., into a root that
+# already holds the unrelated packages b0, b1, ..., and print the time
+# it took and the time per package.  The time per package stays flat
+# when installing a dependency costs the same at any depth; it grew
+# with the depth and the size of the database when each one reloaded
+# it.
+#
+# usage: chain.sh [-b packages] [depth ...]
+#
+# Run it from the top of the build directory, or set BUILDDIR.  Only
+# the install of each chain is timed.
+#
+
+B=${BUILDDIR:-.}/src
+base=1000
+while getopts b: ch; do
+	case $ch in
+	b)	base=$OPTARG ;;
+	*)	echo "usage: chain.sh [-b packages] [depth ...]" >&2; exit 2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+[ $# -gt 0 ] || set -- 50 100 200 400 800
+
+# mpkg expects its options before its operands
+POSIXLY_CORRECT=1
+export POSIXLY_CORRECT
+
+now() {
+	date +%s%N 2>/dev/null | grep -v N || echo "$(date +%s)000000000"
+}
+
+# package name [dependency]
+package() {
+	mkdir -p $T/proto/$1/usr/share/$1
+	echo $1 > $T/proto/$1/usr/share/$1/file
+	{
+		echo "package $1"
+		echo "release 1"
+		[ -n "$2" ] && echo "depend $2"
+		echo "dir usr"
+		echo "dir usr/share"
+		echo "dir usr/share/$1"
+		echo "file usr/share/$1/file"
+	} > $T/manifest
+	$B/mpkg-create -p $T/proto/$1 -r $T/repo $T/manifest >/dev/null ||
+	    exit 1
+}
+
+T=$(mktemp -d "${TMPDIR:-/tmp}/chain.XXXXXX") || exit 1
+trap 'rm -rf $T' EXIT
+mkdir -p $T/repo $T/base
+
+i=0
+while [ $i -lt $base ]; do
+	package b$i
+	i=$((i + 1))
+done
+for depth; do
+	i=0
+	while [ $i -lt $((depth - 1)) ]; do
+		package c${depth}_$i c${depth}_$((i + 1))
+		i=$((i + 1))
+	done
+	package c${depth}_$i
+done
+$B/mpkg-repo $T/repo || exit 1
+
+if [ $base -gt 0 ]; then
+	i=0
+	while [ $i -lt $base ]; do
+		echo b$i
+		i=$((i + 1))
+	done | xargs env PKG_REPO=$T/repo $B/mpkg -R $T/base -y install \
+	    >/dev/null 2>&1
+fi
+
+printf '%8s %10s %12s\n' depth ms ms/package
+for depth; do
+	rm -rf $T/root
+	cp -R $T/base $T/root
+
+	start=$(now)
+	PKG_REPO=$T/repo $B/mpkg -R $T/root -y install c${depth}_0 \
+	    >/dev/null 2>&1
+	end=$(now)
+
+	n=$(PKG_REPO=$T/repo $B/mpkg -R $T/root list | grep -c '^[bc]')
+	if [ "$n" -ne $((base + depth)) ]; then
+		echo "chain.sh: $n of $((base + depth)) packages installed" >&2
+		exit 1
+	fi
+	ms=$(((end - start) / 1000000))
+	printf '%8d %10d %12.2f\n' $depth $ms \
+	    $(echo "$ms $depth" | awk '{ print $1 / $2 }')
+done
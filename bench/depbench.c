@@ -0,0 +1,264 @@
+/*
+ * Copyright (c) 2015, Quentin Schwerkolt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+/*
+ * depbench: time what mpkg does before installing a package deep in a
+ * dependency chain: parse the catalog, load the database, and walk the
+ * depends the way worker_depends() does, looking each of them up in
+ * the catalog and in the database.
+ *
+ * The catalog holds a chain c0 -> c1 -> ... of -d packages, and as
+ * many more packages b0, b1, ... as it takes to reach -p.  Every link
+ * of the chain also depends on one of the b packages, which are all
+ * installed; the walk from c0 thus finds every link missing and every
+ * b package installed.  Only the catalog text is written, so that the
+ * index built by catalog_parse() is what gets measured rather than
+ * catalog.bin.  The database starts as per-package directories; the
+ * first load imports them and is not timed.
+ */
+
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif	/* HAVE_CONFIG_H */
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <err.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "catalog.h"
+#include "db.h"
+
+static double	elapsed(const struct timespec *start);
+static void	generate(const char *scratch, long packages, long depth);
+static int	rm_entry(const char *path, const struct stat *sb, int flag,
+			 struct FTW *ftw);
+static void	usage(char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static long	walk(catalog_t *catalog, db_t *db, const char *package);
+
+int
+main(int argc, char **argv)
+{
+	catalog_t *catalog;
+	char dbpath[PATH_MAX], scratch[PATH_MAX];
+	const char *tmpdir;
+	db_t *db;
+	double best[3], seconds[3];
+	int ch, idx, runs, step;
+	long depth, missing, packages;
+	struct timespec start;
+
+	depth = 1000;
+	packages = 40000;
+	runs = 5;
+	while ((ch = getopt(argc, argv, "d:n:p:")) != -1) {
+		switch (ch) {
+		case 'd':
+			depth = strtol(optarg, (char **)NULL, 10);
+			if (depth < 1)
+				usage("%s -- invalid depth", optarg);
+			break;
+
+		case 'n':
+			runs = (int)strtol(optarg, (char **)NULL, 10);
+			if (runs < 1)
+				usage("%s -- invalid number of runs", optarg);
+			break;
+
+		case 'p':
+			packages = strtol(optarg, (char **)NULL, 10);
+			if (packages < 1)
+				usage("%s -- invalid number of packages",
+				      optarg);
+			break;
+
+		default:
+			usage("%c -- unknown option", (char)ch);
+			break;
+		}
+	}
+	if (optind != argc)
+		usage(NULL);
+	if (packages <= depth)
+		usage("-p must be more than -d");
+
+	if (!(tmpdir = getenv("TMPDIR")))
+		tmpdir = "/tmp";
+	snprintf(scratch, PATH_MAX, "%s/depbench.XXXXXX", tmpdir);
+	if (!mkdtemp(scratch))
+		err(1, "mkdtemp: %s", scratch);
+	snprintf(dbpath, PATH_MAX, "%s/db", scratch);
+	generate(scratch, packages, depth);
+
+	db = db_init(dbpath);
+	db_load(db);
+	db_free(db);
+
+	for (idx = 0; idx < runs; ++idx) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		catalog = catalog_parse(scratch);
+		seconds[0] = elapsed(&start);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		db = db_init(dbpath);
+		db_load(db);
+		seconds[1] = elapsed(&start);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if ((missing = walk(catalog, db, "c0")) != depth)
+			errx(1, "%ld of %ld packages missing", missing, depth);
+		seconds[2] = elapsed(&start);
+
+		db_free(db);
+		catalog_free(catalog);
+
+		/* the fastest run is the one least disturbed by the host */
+		for (step = 0; step < 3; ++step)
+			if (idx == 0 || seconds[step] < best[step])
+				best[step] = seconds[step];
+	}
+
+	printf("%ld packages, %ld installed, depth %ld\n",
+	       packages, packages - depth, depth);
+	printf("%-14s %10.1f ms\n", "catalog_parse", best[0] * 1e3);
+	printf("%-14s %10.1f ms\n", "db_load", best[1] * 1e3);
+	printf("%-14s %10.1f ms\n", "closure", best[2] * 1e3);
+
+	if (nftw(scratch, rm_entry, 16, FTW_DEPTH|FTW_PHYS) == -1)
+		err(1, "cannot remove %s", scratch);
+	return (0);
+}
+
+static double
+elapsed(const struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return ((double)(end.tv_sec - start->tv_sec) +
+		(double)(end.tv_nsec - start->tv_nsec) / 1e9);
+}
+
+/*
+ * Write the catalog to scratch/catalog, and install the b packages in
+ * scratch/db, one directory each as mpkg used to keep them.
+ */
+static void
+generate(const char *scratch, long packages, long depth)
+{
+	FILE *cfp, *mfp;
+	char path[PATH_MAX];
+	long idx, nbase;
+
+	snprintf(path, PATH_MAX, "%s/catalog", scratch);
+	if (!(cfp = fopen(path, "w")))
+		err(1, "%s", path);
+	snprintf(path, PATH_MAX, "%s/db", scratch);
+	if (mkdir(path, 0755) == -1)
+		err(1, "mkdir: %s", path);
+
+	nbase = packages - depth;
+	for (idx = 0; idx < depth; ++idx) {
+		fprintf(cfp, "c%ld|1|", idx);
+		if (idx + 1 < depth)
+			fprintf(cfp, "c%ld,", idx + 1);
+		fprintf(cfp, "b%ld\n", idx % nbase);
+	}
+	for (idx = 0; idx < nbase; ++idx) {
+		fprintf(cfp, "b%ld|1|\n", idx);
+
+		snprintf(path, PATH_MAX, "%s/db/b%ld", scratch, idx);
+		if (mkdir(path, 0755) == -1)
+			err(1, "mkdir: %s", path);
+		snprintf(path, PATH_MAX, "%s/db/b%ld/manifest", scratch, idx);
+		if (!(mfp = fopen(path, "w")))
+			err(1, "%s", path);
+		fprintf(mfp, "package b%ld\nrelease 1\n", idx);
+		if (fclose(mfp) == EOF)
+			err(1, "write: %s", path);
+	}
+	if (fclose(cfp) == EOF)
+		err(1, "write: %s/catalog", scratch);
+}
+
+static int
+rm_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftw)
+{
+	(void)sb;
+	(void)flag;
+	(void)ftw;
+
+	return (remove(path));
+}
+
+static void
+usage(char *fmt, ...)
+{
+	va_list ap;
+
+	if (fmt) {
+		va_start(ap, fmt);
+		vwarnx(fmt, ap);
+		va_end(ap);
+	}
+
+	fprintf(stdout, "usage: %s [-d depth] [-n runs] [-p packages]\n",
+		getprogname());
+	exit(2);
+}
+
+/*
+ * Look up the depends of package as worker_depends() does, and walk the
+ * ones that are not installed.  Returns how many packages were missing,
+ * package included.
+ */
+static long
+walk(catalog_t *catalog, db_t *db, const char *package)
+{
+	catalog_t *dep, *obj;
+	dbnode_t *node;
+	int idx;
+	long missing = 1;
+
+	if (!(obj = catalog_find(catalog, package)))
+		errx(1, "%s: not found in catalog", package);
+	for (idx = 0; obj->depends && obj->depends[idx]; ++idx) {
+		if (!(dep = catalog_find(catalog, obj->depends[idx])))
+			errx(1, "%s: not found in catalog", package);
+		node = db_find(db, obj->depends[idx]);
+		if (!node || node->release < dep->release)
+			missing += walk(catalog, db, obj->depends[idx]);
+	}
+	return (missing);
+}
@@ -0,0 +1,314 @@
+/*
+ * Copyright (c) 2015, Quentin Schwerkolt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+/*
+ * membench: install -p packages of -f files each in a scratch database,
+ * load them all, walk every node, and report how much the resident size
+ * of the process grew.  Each way of loading runs in a child of its own:
+ *
+ *	text		every manifest parsed from its text
+ *	manifest.bin	every manifest loaded from its compiled form
+ *	db.bin		db_load() and db_manifest() on every package
+ *
+ * The first two are what db_load() did before the database was kept in
+ * db.bin.  The resident size is read from /proc/self/status, which only
+ * Linux has; elsewhere it prints as "-".  It counts the pages of mapped
+ * manifests the walk touched along with the heap, so compiled manifests
+ * only save what parsing would have allocated on top of the nodes.
+ */
+
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif	/* HAVE_CONFIG_H */
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "db.h"
+#include "manifest.h"
+
+#define LOAD_TEXT	0
+#define LOAD_BIN	1
+#define LOAD_DB		2
+
+static const char *loads[] = { "text", "manifest.bin", "db.bin" };
+
+static void	generate(const char *dbpath, long packages, long files);
+static void	load(const char *dbpath, long packages, int how);
+static long	resident(void);
+static int	rm_entry(const char *path, const struct stat *sb, int flag,
+			 struct FTW *ftw);
+static void	run(const char *dbpath, long packages, int how);
+static void	usage(char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static size_t	walk(manifest_t *mf);
+
+int
+main(int argc, char **argv)
+{
+	char dbpath[PATH_MAX], scratch[PATH_MAX];
+	const char *tmpdir;
+	int ch, how;
+	long files, packages;
+
+	files = 10000;
+	packages = 100;
+	while ((ch = getopt(argc, argv, "f:p:")) != -1) {
+		switch (ch) {
+		case 'f':
+			files = strtol(optarg, (char **)NULL, 10);
+			if (files < 1)
+				usage("%s -- invalid number of files", optarg);
+			break;
+
+		case 'p':
+			packages = strtol(optarg, (char **)NULL, 10);
+			if (packages < 1)
+				usage("%s -- invalid number of packages",
+				      optarg);
+			break;
+
+		default:
+			usage("%c -- unknown option", (char)ch);
+			break;
+		}
+	}
+	if (optind != argc)
+		usage(NULL);
+
+	if (!(tmpdir = getenv("TMPDIR")))
+		tmpdir = "/tmp";
+	snprintf(scratch, PATH_MAX, "%s/membench.XXXXXX", tmpdir);
+	if (!mkdtemp(scratch))
+		err(1, "mkdtemp: %s", scratch);
+	snprintf(dbpath, PATH_MAX, "%s/db", scratch);
+	generate(dbpath, packages, files);
+
+	printf("%ld packages, %ld files\n", packages, packages * files);
+	printf("%-14s %10s %10s\n", "load", "MB", "bytes/file");
+	for (how = LOAD_TEXT; how <= LOAD_DB; ++how)
+		run(dbpath, packages, how);
+
+	if (nftw(scratch, rm_entry, 16, FTW_DEPTH|FTW_PHYS) == -1)
+		err(1, "cannot remove %s", scratch);
+	return (0);
+}
+
+/*
+ * Write the manifest of each package in its directory of dbpath, as mpkg
+ * used to keep them.  A directory comes first in every 100 nodes.
+ */
+static void
+generate(const char *dbpath, long packages, long files)
+{
+	FILE *fp;
+	char path[PATH_MAX];
+	long dir, idx, pkg;
+
+	if (mkdir(dbpath, 0755) == -1)
+		err(1, "mkdir: %s", dbpath);
+	for (pkg = 0; pkg < packages; ++pkg) {
+		snprintf(path, PATH_MAX, "%s/p%ld", dbpath, pkg);
+		if (mkdir(path, 0755) == -1)
+			err(1, "mkdir: %s", path);
+		snprintf(path, PATH_MAX, "%s/p%ld/manifest", dbpath, pkg);
+		if (!(fp = fopen(path, "w")))
+			err(1, "%s", path);
+
+		fprintf(fp, "package p%ld\nrelease 1\n", pkg);
+		for (dir = -1, idx = 0; idx < files; ++idx) {
+			if (idx % 100 == 0)
+				fprintf(fp, "dir usr/share/membench/p%ld/d%ld\n",
+					pkg, ++dir);
+			else
+				fprintf(fp, "file usr/share/membench/p%ld/"
+					"d%ld/file%ld\n", pkg, dir, idx);
+		}
+		if (fclose(fp) == EOF)
+			err(1, "write: %s", path);
+	}
+}
+
+/*
+ * Load every package of dbpath the way how says, walk its nodes, and
+ * print how much the resident size grew.  Runs in a child, which exits.
+ */
+static void
+load(const char *dbpath, long packages, int how)
+{
+	char path[PATH_MAX];
+	db_t *db;
+	dbnode_t *node;
+	long base, pkg, rss;
+	manifest_t **mfs;
+	size_t nodes;
+
+	base = resident();
+	nodes = 0;
+	if (how == LOAD_DB) {
+		db = db_init(dbpath);
+		db_load(db);
+		for (node = db->nodes; node; node = node->next)
+			nodes += walk(db_manifest(db, node));
+	} else {
+		/* kept until the size is read, as the database kept them */
+		mfs = calloc((size_t)packages, sizeof(manifest_t *));
+		if (!mfs)
+			err(1, "calloc");
+		for (pkg = 0; pkg < packages; ++pkg) {
+			snprintf(path, PATH_MAX, "%s/p%ld/manifest",
+				 dbpath, pkg);
+			mfs[pkg] = manifest_parse(path);
+			nodes += walk(mfs[pkg]);
+		}
+	}
+
+	printf("%-14s", loads[how]);
+	if (base < 0 || (rss = resident()) < 0)
+		printf(" %10s %10s\n", "-", "-");
+	else
+		printf(" %10.1f %10.1f\n", (double)(rss - base) / 1e6,
+		       (double)(rss - base) / (double)nodes);
+	fflush(stdout);
+	_exit(0);
+}
+
+/*
+ * Resident size of this process in bytes, -1 when unknown.
+ */
+static long
+resident(void)
+{
+	FILE *fp;
+	char line[128];
+	long rss = -1;
+
+	if (!(fp = fopen("/proc/self/status", "r")))
+		return (-1);
+	while (fgets(line, sizeof(line), fp)) {
+		if (!strncmp(line, "VmRSS:", 6)) {
+			rss = strtol(line + 6, (char **)NULL, 10) * 1024;
+			break;
+		}
+	}
+	fclose(fp);
+	return (rss);
+}
+
+static int
+rm_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftw)
+{
+	(void)sb;
+	(void)flag;
+	(void)ftw;
+
+	return (remove(path));
+}
+
+/*
+ * Prepare dbpath for how, then measure it in a fresh child, so that what
+ * the preparation allocated is not counted.
+ */
+static void
+run(const char *dbpath, long packages, int how)
+{
+	char path[PATH_MAX];
+	db_t *db;
+	long pkg;
+	manifest_t *mf;
+	pid_t pid;
+	int status, step;
+
+	for (step = 0; step < 2; ++step) {
+		fflush(stdout);
+		if ((pid = fork()) == -1)
+			err(1, "fork");
+		if (pid == 0 && step == 1)
+			load(dbpath, packages, how);
+		if (pid == 0) {
+			if (how == LOAD_BIN) {
+				for (pkg = 0; pkg < packages; ++pkg) {
+					snprintf(path, PATH_MAX,
+						 "%s/p%ld/manifest",
+						 dbpath, pkg);
+					mf = manifest_parse(path);
+					manifest_compile(mf, path);
+					manifest_free(mf);
+				}
+			} else if (how == LOAD_DB) {
+				/* the first load imports the directories */
+				db = db_init(dbpath);
+				db_load(db);
+				db_free(db);
+			}
+			_exit(0);
+		}
+		if (waitpid(pid, &status, 0) == -1)
+			err(1, "waitpid");
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			errx(1, "%s: load failed", loads[how]);
+	}
+}
+
+static void
+usage(char *fmt, ...)
+{
+	va_list ap;
+
+	if (fmt) {
+		va_start(ap, fmt);
+		vwarnx(fmt, ap);
+		va_end(ap);
+	}
+
+	fprintf(stdout, "usage: %s [-f files] [-p packages]\n",
+		getprogname());
+	exit(2);
+}
+
+/*
+ * Walk the nodes of mf, as listing its files does, and count them.
+ */
+static size_t
+walk(manifest_t *mf)
+{
+	manifest_iter_t iter;
+	size_t nodes = 0;
+
+	manifest_iter_init(&iter, mf);
+	while (manifest_iter_next(&iter))
+		++nodes;
+	return (nodes);
+}
@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) 2015, Quentin Schwerkolt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+/*
+ * mfbench: write text manifests of 1k, 100k and 1M lines, or of the
+ * numbers of lines given, and time manifest_parse() and manifest_free()
+ * on each.  The manifests list a directory for every 99 files, as
+ * packages usually do, with neither hashes nor metadata so that
+ * parsers that predate them read the same input.
+ */
+
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif	/* HAVE_CONFIG_H */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "manifest.h"
+
+static void	generate(const char *path, long lines);
+static double	parse(const char *path);
+static void	usage(char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+int
+main(int argc, char **argv)
+{
+	static char *defaults[] = { "1000", "100000", "1000000", NULL };
+	char **args, path[PATH_MAX], scratch[PATH_MAX];
+	const char *tmpdir;
+	double best, seconds;
+	int ch, idx, runs;
+	long lines;
+
+	runs = 5;
+	while ((ch = getopt(argc, argv, "n:")) != -1) {
+		switch (ch) {
+		case 'n':
+			runs = (int)strtol(optarg, (char **)NULL, 10);
+			if (runs < 1)
+				usage("%s -- invalid number of runs", optarg);
+			break;
+
+		default:
+			usage("%c -- unknown option", (char)ch);
+			break;
+		}
+	}
+	args = optind < argc ? argv + optind : defaults;
+
+	if (!(tmpdir = getenv("TMPDIR")))
+		tmpdir = "/tmp";
+	snprintf(scratch, PATH_MAX, "%s/mfbench.XXXXXX", tmpdir);
+	if (!mkdtemp(scratch))
+		err(1, "mkdtemp: %s", scratch);
+	snprintf(path, PATH_MAX, "%s/manifest", scratch);
+
+	printf("%10s %10s %10s %12s\n", "lines", "ms", "ns/line", "lines/s");
+	for (; *args; ++args) {
+		if ((lines = strtol(*args, (char **)NULL, 10)) < 3)
+			usage("%s -- invalid number of lines", *args);
+		generate(path, lines);
+
+		/* the fastest run is the one least disturbed by the host */
+		best = -1;
+		for (idx = 0; idx < runs; ++idx) {
+			seconds = parse(path);
+			if (best < 0 || seconds < best)
+				best = seconds;
+		}
+		printf("%10ld %10.1f %10.1f %12.0f\n", lines, best * 1e3,
+		       best * 1e9 / (double)lines, (double)lines / best);
+	}
+
+	if (unlink(path) == -1)
+		err(1, "unlink: %s", path);
+	if (rmdir(scratch) == -1)
+		err(1, "rmdir: %s", scratch);
+	return (0);
+}
+
+/*
+ * Write a manifest of exactly lines lines to path.
+ */
+static void
+generate(const char *path, long lines)
+{
+	FILE *fp;
+	long dir, idx;
+
+	if (!(fp = fopen(path, "w")))
+		err(1, "%s", path);
+	fprintf(fp, "package mfbench\nrelease 1\n");
+	for (dir = -1, idx = 2; idx < lines; ++idx) {
+		if (idx % 100 == 2)
+			fprintf(fp, "dir usr/share/mfbench/d%ld\n", ++dir);
+		else
+			fprintf(fp, "file usr/share/mfbench/d%ld/file%ld\n",
+				dir, idx);
+	}
+	if (fclose(fp) == EOF)
+		err(1, "write: %s", path);
+}
+
+/*
+ * Time parsing path and freeing the result.
+ */
+static double
+parse(const char *path)
+{
+	manifest_t *mf;
+	struct timespec end, start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	mf = manifest_parse(path);
+	manifest_free(mf);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return ((double)(end.tv_sec - start.tv_sec) +
+		(double)(end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+static void
+usage(char *fmt, ...)
+{
+	va_list ap;
+
+	if (fmt) {
+		va_start(ap, fmt);
+		vwarnx(fmt, ap);
+		va_end(ap);
+	}
+
+	fprintf(stdout, "usage: %s [-n runs] [lines ...]\n", getprogname());
+	exit(2);
+}
@@ -0,0 +1,80 @@
+#!/bin/sh
+#
+# Copyright (c) 2015, Quentin Schwerkolt
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# * Redistributions of source code must retain the above copyright notice, this
+#   list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright notice,
+#   this list of conditions and the following disclaimer in the documentation
+#   and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+# SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+# CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+# OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+# smallfiles.sh: build a package of many small files, 100 to a
+# directory, and time its extraction by 1, 2, 4, ... jobs with arbench.
+#
+# usage: smallfiles.sh [-f files] [-j jobs] [-n runs]
+#
+# Run it from the top of the build directory, or set BUILDDIR.  The
+# files are extracted under TMPDIR; a tmpfs keeps the disk out of it.
+#
+
+B=${BUILDDIR:-.}
+files=50000
+jobs=$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 4)
+runs=3
+while getopts f:j:n: ch; do
+	case $ch in
+	f)	files=$OPTARG ;;
+	j)	jobs=$OPTARG ;;
+	n)	runs=$OPTARG ;;
+	*)	echo "usage: smallfiles.sh [-f files] [-j jobs] [-n runs]" >&2
+		exit 2 ;;
+	esac
+done
+
+# mpkg expects its options before its operands
+POSIXLY_CORRECT=1
+export POSIXLY_CORRECT
+
+T=$(mktemp -d "${TMPDIR:-/tmp}/smallfiles.XXXXXX") || exit 1
+trap 'rm -rf $T' EXIT
+mkdir -p $T/proto/usr/share/small $T/repo
+
+{
+	echo "package small"
+	echo "release 1"
+	echo "dir usr"
+	echo "dir usr/share"
+	echo "dir usr/share/small"
+	i=0
+	while [ $i -lt $files ]; do
+		d=usr/share/small/d$((i / 100))
+		if [ $((i % 100)) -eq 0 ]; then
+			mkdir $T/proto/$d
+			echo "dir $d"
+		fi
+		echo "small file $i" > $T/proto/$d/f$i
+		echo "file $d/f$i"
+		i=$((i + 1))
+	done
+} > $T/manifest
+$B/src/mpkg-create -p $T/proto -r $T/repo $T/manifest >/dev/null || exit 1
+rm -rf $T/proto
+
+echo "$files files, $(wc -c < $T/repo/small/data.a) bytes"
+$B/bench/arbench -j $jobs -n $runs $T/repo/small/data.a
@@ -29,6 +29,7 @@
 #include "config.h"
 #endif	/* HAVE_CONFIG_H */
 
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -37,6 +38,7 @@
 #include <err.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -45,22 +47,118 @@
 #include <errno.h>
 
 #include "ar.h"
+#include "codec.h"
+#include "hash.h"
+#include "utils.h"
 #include "xalloc.h"
 
+#define AR_BUFSIZ	(256 * 1024)
+
 struct ar {
 	const char *filename;
 	const char *wrkdir;
 
 	int	fd;
 	uint8_t	mode;
-	int	offset;
+	int	format;		/* 1 or 2, see ar.h */
+	off_t	offset;		/* payload bytes left before the next header */
+
+	char	*map;		/* read-only mapping, NULL when streaming */
+	size_t	maplen;
+	size_t	pos;		/* current position in the mapping */
 
 	char	**strtab;
+
+	int	codec;		/* codec for new members */
+	off_t	hdroff;		/* header offset of the member being written */
+	off_t	hashoff;	/* offset of its hash attribute value */
+
+	int	jobs;		/* compression and extraction threads */
+	ar_info_t **toextract;	/* members queued for the extraction jobs */
+	int	withtoc;	/* emit a table of contents on close */
+	struct ar_toc *toc;
+	size_t	ntoc;
+
+	struct ar_extent *extents; /* data extents of the member being written */
+};
+
+struct ar_extent {
+	off_t	offset;
+	off_t	length;
+};
+
+/*
+ * State shared by the threads (de)compressing the blocks of a member.
+ */
+struct ar_blocks {
+	ar_info_t *info;
+	int	fd;		/* member file, when extracting */
+	const char *data;	/* raw member, or stored payload */
+	size_t	nblocks;
+	size_t	first;		/* first block of the current batch */
+	char	**bufs;		/* compressed blocks of the current batch */
+	size_t	bufsiz;
+	size_t	*sizes;		/* stored size of each block */
+	off_t	*offsets;	/* payload offset of each block */
+	uint64_t *hashes;	/* hash of each block, or NULL */
+};
+
+union ar_hdrs {
+	struct ar_hdr	v1;
+	struct ar_hdr2	v2;
+};
+
+struct ar_toc {
+	const char *name;	/* not NUL terminated when read from a map */
+	size_t	namelen;
+	off_t	offset;		/* member header offset */
+	off_t	size;
+	mode_t	mode;
 };
 
 static ar_t	*ar_open(const char *filename, int flags);
+static size_t	ar_decode_header(ar_t *ar, const char *buf, ar_info_t *info,
+				 size_t *pad);
+static long long ar_decode(const char *field, size_t len);
+static uint64_t	ar_decode_hash(const char *field);
+static size_t	ar_blklen(ar_info_t *info);
+static void	ar_compress_job(void *arg, size_t idx);
+static void	ar_copy_hashed(ar_t *ar, const char *data, int fd,
+			       const char *name, off_t length, hash_t *hash);
+static void	ar_copy_member(ar_t *ar, off_t offset, int fd,
+			       const char *name, off_t length, hash_t *hash);
+static void	ar_decompress_job(void *arg, size_t idx);
+static void	ar_extract_blocks(ar_t *ar, ar_info_t *info, int fd);
+static void	ar_extract_job(void *arg, size_t idx);
+static void	ar_extract_sparse(ar_t *ar, ar_info_t *info, int fd,
+				  hash_t *hash);
+static uint32_t	ar_get32(const uint8_t *p);
+static uint64_t	ar_get64(const uint8_t *p);
+static void	ar_hash_zeros(hash_t *hash, off_t length);
+static size_t	ar_hdrlen(ar_t *ar);
+static void	ar_holes(ar_t *ar, ar_info_t *info);
+static void	ar_map(ar_t *ar);
+static void	ar_parse_name(ar_t *ar, ar_info_t *info,
+			      const char *buf, size_t nsize);
+static void	ar_put32(uint8_t *p, uint32_t val);
+static void	ar_put64(uint8_t *p, uint64_t val);
+static void	ar_read(ar_t *ar, void *buf, size_t nbytes);
+static void	ar_skip(ar_t *ar);
+static int	ar_toc_cmp(const void *a, const void *b);
+static void	ar_toc_load(ar_t *ar);
+static int	ar_toc_search(const void *key, const void *entry);
+static void	ar_toc_write(ar_t *ar);
+static void	ar_verify(ar_t *ar, ar_info_t *info, hash_t *hash);
+static void	ar_write_block(struct ar_blocks *bl, size_t idx,
+			       const char *buf, size_t length);
+static off_t	ar_write_blocks(ar_t *ar, ar_info_t *info, const char *data,
+				hash_t *hash);
 static void	ar_write_data(ar_t *ar, ar_info_t *info);
+static void	ar_write_extents(ar_t *ar, ar_info_t *info, const char *data,
+				 hash_t *hash);
+static void	ar_write_hash(ar_t *ar, ar_info_t *info);
 static void	ar_write_header(ar_t *ar, ar_info_t *info);
+static void	ar_write_size(ar_t *ar, ar_info_t *info);
 
 ar_t *
 ar_open_read(const char *filename)
@@ -70,25 +168,44 @@ ar_open_read(const char *filename)
 
 	bzero(buf, sizeof(buf));
 	ar = ar_open(filename, O_RDONLY|O_CLOEXEC);
+	ar_map(ar);
 
-	if (read(ar->fd, buf, SARMAG) < SARMAG)
+	if (ar->map) {
+		if (ar->maplen < SARMAG)
+			errx(1, "%s: invalid magic", ar->filename);
+		(void)memcpy(buf, ar->map, SARMAG);
+		ar->pos = SARMAG;
+	}
+	else if (read(ar->fd, buf, SARMAG) < SARMAG)
 		errx(1, "%s: invalid magic", ar->filename);
-	if (strcmp(buf, ARMAG))
+	if (!strcmp(buf, ARMAG))
+		ar->format = 1;
+	else if (!strcmp(buf, ARMAG2))
+		ar->format = 2;
+	else
 		errx(1, "%s: invalid magic", ar->filename);
 
+	if (ar->map)
+		ar_toc_load(ar);
+
 	return (ar);
 }
 
 ar_t *
-ar_open_write(const char *filename)
+ar_open_write(const char *filename, int format)
 {
 	ar_t *ar;
 	ssize_t written;
 
+	if (format != 1 && format != 2)
+		errx(1, "%s: unknown archive format %d", filename, format);
+
 	ar = ar_open(filename, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC);
 	ar->mode = 1;
+	ar->format = format;
 
-	if ((written = write(ar->fd, ARMAG, SARMAG)) == -1)
+	if ((written = write(ar->fd, format == 2 ? ARMAG2 : ARMAG,
+			     SARMAG)) == -1)
 		err(1, "write: %s", ar->filename);
 	if (written < SARMAG)
 		errx(1, "write: %s: truncated write", ar->filename);
@@ -99,23 +216,35 @@ ar_open_write(const char *filename)
 void
 ar_close(ar_t *ar)
 {
-	int idx;
+	size_t idx;
+
+	if (ar->mode && ar->withtoc)
+		ar_toc_write(ar);
 
 	for (idx = 0; ar->strtab[idx]; ++idx)
 		free(ar->strtab[idx]);
 	free(ar->strtab);
+	if (ar->mode) {
+		for (idx = 0; idx < ar->ntoc; ++idx)
+			free((char *)ar->toc[idx].name);
+	}
+	free(ar->toc);
+	free(ar->extents);
+	if (ar->map)
+		(void)munmap(ar->map, ar->maplen);
 	close(ar->fd);
 	free(ar);
 }
 
 void
-ar_append(ar_t *ar, const char *filename)
+ar_append(ar_t *ar, const char *filename, ar_info_t *info)
 {
-	ar_info_t *info, _info;
+	ar_info_t _info;
 	char outfile[PATH_MAX];
 	struct stat sb;
 
-	info = &_info;
+	if (!info)
+		info = &_info;
 	bzero(info, sizeof(ar_info_t));
 	bzero(outfile, PATH_MAX);
 
@@ -129,56 +258,134 @@ ar_append(ar_t *ar, const char *filename)
 	info->gid = sb.st_gid;
 	info->mode = sb.st_mode;
 	if (S_ISLNK(info->mode) || S_ISREG(info->mode))
-		info->size = sb.st_size;
-
+		info->size = info->rawsize = sb.st_size;
+	if (S_ISREG(info->mode)) {
+		info->hashed = 1;	/* filled in by ar_write_data */
+		ar_holes(ar, info);
+	}
+	if (S_ISREG(info->mode) && !info->sparse &&
+	    info->size >= CODEC_MINSIZE)
+		info->codec = ar->codec;
+	if (info->codec != CODEC_NONE && info->size > CODEC_BLOCKSIZE)
+		info->blocksize = CODEC_BLOCKSIZE;
+
+	if ((ar->hdroff = lseek(ar->fd, 0, SEEK_CUR)) == -1)
+		err(1, "lseek: %s", ar->filename);
 	ar_write_header(ar, info);
 	ar_write_data(ar, info);
+
+	if (ar->withtoc) {
+		ar->toc = xrealloc(ar->toc, (ar->ntoc+1) * sizeof(struct ar_toc));
+		ar->toc[ar->ntoc].name = xstrdup(info->name);
+		ar->toc[ar->ntoc].namelen = strlen(info->name);
+		ar->toc[ar->ntoc].offset = ar->hdroff;
+		ar->toc[ar->ntoc].size = info->size;
+		ar->toc[ar->ntoc].mode = info->mode;
+		++ar->ntoc;
+	}
+}
+
+const char *
+ar_data(ar_t *ar, ar_info_t *info)
+{
+	if (info->offset == -1 || info->codec != CODEC_NONE || info->sparse)
+		return (NULL);
+	return (ar->map + info->offset);
 }
 
 ar_info_t *
-ar_next(ar_t *ar)
+ar_find(ar_t *ar, const char *name)
 {
 	ar_info_t *info;
-	char buf[PATH_MAX+1];
-	ssize_t nsize, nbytes;
-	struct ar_hdr *hdr, _hdr;
-
-	hdr = &_hdr;
-
-	if (ar->offset) {
-		if (lseek(ar->fd, SEEK_CUR, ar->offset) == -1)
-			err(1, "lseek: %s", ar->filename);
+	struct ar_toc *entry;
+
+	if (ar->toc) {
+		entry = bsearch(name, ar->toc, ar->ntoc,
+				sizeof(struct ar_toc), ar_toc_search);
+		if (!entry)
+			return (NULL);
+		ar->pos = (size_t)entry->offset;
 		ar->offset = 0;
+		return (ar_next(ar));
 	}
 
-	if ((nbytes = read(ar->fd, hdr, sizeof(struct ar_hdr))) == -1)
-		err(1, "read: %s", ar->filename);
-	if (nbytes == 0)
-		return (NULL);
-	if (nbytes < (ssize_t)sizeof(struct ar_hdr))
-		errx(1, "read: %s: truncated entry header", ar->filename);
+	/*
+	 * Without a table of contents, walk the archive; a mapped archive
+	 * is rewound first, a streamed one can only be searched forward.
+	 */
+	if (ar->map) {
+		ar->pos = SARMAG;
+		ar->offset = 0;
+	}
+	while ((info = ar_next(ar))) {
+		if (!strcmp(info->name, name))
+			return (info);
+		free(info);
+	}
+	return (NULL);
+}
 
-	if (strncmp(hdr->ar_fmag, ARFMAG, 2))
-		errx(1, "%s: invalid archive entry", ar->filename);
+ar_info_t *
+ar_next(ar_t *ar)
+{
+	ar_info_t *info;
+	char *buf;
+	const char *hdr;
+	size_t hdrlen, nsize, pad;
+	ssize_t nbytes;
+	union ar_hdrs _hdr;
+
+	hdr = (const char *)&_hdr;
+	hdrlen = ar_hdrlen(ar);
+	ar_skip(ar);
+
+	if (ar->map) {
+		if (ar->pos == ar->maplen)
+			return (NULL);
+		if (ar->maplen - ar->pos < hdrlen)
+			errx(1, "read: %s: truncated entry header",
+			     ar->filename);
+		hdr = ar->map + ar->pos;
+		ar->pos += hdrlen;
+	}
+	else {
+		if ((nbytes = read(ar->fd, &_hdr, hdrlen)) == -1)
+			err(1, "read: %s", ar->filename);
+		if (nbytes == 0)
+			return (NULL);
+		if ((size_t)nbytes < hdrlen)
+			ar_read(ar, (char *)&_hdr + nbytes, hdrlen - nbytes);
+	}
 
 	info = xcalloc(1, sizeof(ar_info_t));
+	nsize = ar_decode_header(ar, hdr, info, &pad);
+
+	if (ar->map) {
+		if (ar->maplen - ar->pos < nsize ||
+		    ar->maplen - ar->pos - nsize < pad ||
+		    ar->maplen - ar->pos - nsize - pad < (size_t)info->size)
+			errx(1, "read: %s: truncated read", ar->filename);
+		ar_parse_name(ar, info, ar->map + ar->pos, nsize);
+		ar->pos += nsize + pad;
+		info->offset = (off_t)ar->pos;
+	}
+	else {
+		info->offset = -1;
+		buf = xmalloc(nsize);
+		ar_read(ar, buf, nsize);
+		ar_parse_name(ar, info, buf, nsize);
+		free(buf);
+		ar->offset = (off_t)pad;
+		ar_skip(ar);
+	}
 
-	nsize = (size_t)strtol(hdr->ar_name, (char **)NULL, 10);
-	info->date = (time_t)strtol(hdr->ar_date, (char **)NULL, 10);
-	info->uid = (uid_t)strtol(hdr->ar_uid, (char **)NULL, 10);
-	info->gid = (gid_t)strtol(hdr->ar_gid, (char **)NULL, 10);
-	info->mode = (mode_t)strtol(hdr->ar_mode, (char **)NULL, 10);
-	info->size = strtol(hdr->ar_size, (char **)NULL, 10);
-
-	bzero(buf, sizeof(buf));
-	if ((nbytes = read(ar->fd, buf, nsize)) == -1)
-		err(1, "read: %s", ar->filename);
-	if (nbytes < nsize)
-		errx(1, "read: %s: tuncated read", ar->filename);
-
-	(void)strncpy(info->name, buf, nsize-1);
 	snprintf(info->path, PATH_MAX, "%s/%s", ar->wrkdir, info->name);
-	ar->offset = (int)info->size;
+	ar->offset = info->size;
+
+	if (!strcmp(info->name, ARTOCNAME)) {
+		free(info);
+		return (NULL);
+	}
 
 	return (info);
 }
@@ -186,14 +393,13 @@ ar_next(ar_t *ar)
 void
 ar_extract(ar_t *ar, ar_info_t *info)
 {
-	char buf[512], target[PATH_MAX];
+	char target[PATH_MAX];
 	int fd;
-	size_t ebytes, nbytes;
-	ssize_t length, written;
+	hash_t hash;
+	ssize_t length;
+	struct stat sb;
 	struct timeval times;
 
-	ar->offset = 0;
-
 	switch (((info->mode) & S_IFMT)) {
 	case S_IFIFO:
 		if (mkfifo(info->path, info->mode & 0007777) == -1)
@@ -201,32 +407,76 @@ ar_extract(ar_t *ar, ar_info_t *info)
 		break;
 
 	case S_IFDIR:
-		if (mkdir(info->path, info->mode & 0007777) == -1)
+		/* directories are usually shared with other packages */
+		if (mkdir(info->path, info->mode & 0007777) == -1 &&
+		    (errno != EEXIST || stat(info->path, &sb) == -1 ||
+		     !S_ISDIR(sb.st_mode)))
 			err(1, "mkdir: '%s'", info->path);
 		break;
 
 	case S_IFREG:
-		if ((fd = open(info->path, O_WRONLY|O_CREAT|O_TRUNC)) == -1)
+		if ((fd = open(info->path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,
+			       info->mode & 0007777)) == -1)
 			err(1, "cannot open file: '%s'", info->path);
-
-		for (ebytes = 0; ebytes < info->size; /* void */) {
-			nbytes = (info->size - ebytes) % 512;
-			if ((length = read(ar->fd, buf, nbytes+1)) == -1)
-				err(1, "read: %s", ar->filename);
-			if ((written = write(fd, buf, length)) == -1)
-				err(1, "write: %s", info->path);
-			if (written < length)
-				errx(1, "write: %s: truncated write", info->path);
-			ebytes += written;
-		}
+		/* the mode is the package's, not what the umask leaves */
+		if (fchmod(fd, info->mode & 0007777) == -1)
+			err(1, "fchmod: '%s'", info->path);
+
+		/*
+		 * Mapped archives are seekable, so the payload is copied by
+		 * offset and the kernel gets a chance to clone or splice it;
+		 * streamed archives copy from the current position.  Copying
+		 * by offset leaves the archive untouched, which is what lets
+		 * ar_extract_all run several extractions at once.
+		 *
+		 * Members with a hash are verified as they are written, and
+		 * nothing is read back.  Raw ones are only handed to the
+		 * kernel when it can clone them; otherwise they are written
+		 * through the hash, like codec output, since a kernel copy
+		 * followed by a pass over the mapping is slower.  Blocks are
+		 * checked one by one.
+		 */
+		hash_init(&hash);
+		if (info->sparse)
+			ar_extract_sparse(ar, info, fd, &hash);
+		else if (info->blocksize)
+			ar_extract_blocks(ar, info, fd);
+		else if (info->codec != CODEC_NONE)
+			codec_decompress(info->codec,
+					 info->offset != -1 ?
+					 ar->map + info->offset : NULL,
+					 ar->fd, ar->filename, info->size,
+					 fd, info->path,
+					 info->hashed ? &hash : NULL);
+		else if (info->hashed)
+			ar_copy_member(ar, info->offset, fd, info->path,
+				       info->size, &hash);
+		else
+			mpkg_copy_data(ar->fd, ar->filename, info->offset,
+				       fd, info->path, info->size);
+		if (info->hashed && !info->blocksize)
+			ar_verify(ar, info, &hash);
 
 		close(fd);
+		if (info->offset == -1)
+			ar->offset = 0;
 		break;
 
 	case S_IFLNK:
+		if (info->size >= PATH_MAX)
+			errx(1, "%s: %s: symlink target too long",
+			     ar->filename, info->name);
 		bzero(target, PATH_MAX);
-		if (read(ar->fd, target, info->size) == -1)
-			err(1, "read: %s", ar->filename);
+		if (info->offset != -1)
+			(void)memcpy(target, ar->map + info->offset, info->size);
+		else {
+			if ((length = read(ar->fd, target, info->size)) == -1)
+				err(1, "read: %s", ar->filename);
+			if (length < info->size)
+				errx(1, "read: %s: truncated read",
+				     ar->filename);
+			ar->offset = 0;
+		}
 		if (symlink(target, info->path) == -1)
 			err(1, "symlink: %s", info->path);
 		break;
@@ -247,17 +497,39 @@ ar_extract(ar_t *ar, ar_info_t *info)
 void
 ar_extract_all(ar_t *ar)
 {
-	ar_info_t *info, **dirs;
+	ar_info_t *info, **dirs, **jobs;
 	int idx;
+	size_t njobs;
 	struct timeval times;
 
+	/*
+	 * With several jobs, directories are created in archive order as
+	 * the headers are walked, and everything else is queued and
+	 * extracted by offset from the mapping once the tree exists.
+	 * Members split into blocks are left out of the queue and
+	 * extracted afterwards, one at a time, with their blocks spread
+	 * over the jobs instead.  Streamed archives can only be extracted
+	 * in order.
+	 */
+	if (ar->jobs < 2 || !ar->map)
+		jobs = NULL;
+	else
+		jobs = xcalloc(1, sizeof(ar_info_t *));
+	njobs = 0;
+
 	dirs = xcalloc(1, sizeof(ar_info_t *));
 	while ((info = ar_next(ar))) {
+		if (jobs && !S_ISDIR(info->mode)) {
+			jobs = xrealloc(jobs, (njobs+1) * sizeof(ar_info_t *));
+			jobs[njobs++] = info;
+			continue;
+		}
+
 		ar_extract(ar, info);
 
 		if (S_ISDIR(info->mode)) {
 			for (idx = 0; dirs[idx]; ++idx);
-			dirs = xrealloc(dirs, idx+1);
+			dirs = xrealloc(dirs, (idx+2) * sizeof(ar_info_t *));
 			dirs[idx+1] = NULL;
 			dirs[idx] = info;;
 
@@ -267,6 +539,19 @@ ar_extract_all(ar_t *ar)
 		free(info);
 	}
 
+	if (jobs) {
+		ar->toextract = jobs;
+		mpkg_parallel(ar->jobs, njobs, ar_extract_job, ar);
+		ar->toextract = NULL;
+
+		while (njobs > 0) {
+			if (jobs[--njobs]->blocksize)
+				ar_extract(ar, jobs[njobs]);
+			free(jobs[njobs]);
+		}
+		free(jobs);
+	}
+
 	for (idx = 0; dirs[idx]; ++idx);
 	while (idx > 0) {
 		--idx;
@@ -280,6 +565,24 @@ ar_extract_all(ar_t *ar)
 	free(dirs);
 }
 
+void
+ar_set_codec(ar_t *ar, int codec)
+{
+	ar->codec = codec;
+}
+
+void
+ar_set_jobs(ar_t *ar, int jobs)
+{
+	ar->jobs = jobs;
+}
+
+void
+ar_set_toc(ar_t *ar, int enable)
+{
+	ar->withtoc = enable;
+}
+
 void
 ar_set_wrkdir(ar_t *ar, const char *wrkdir)
 {
@@ -304,11 +607,811 @@ ar_open(const char *filename, int flags)
 	return (ar);
 }
 
+/*
+ * Decode a member header of either format into info, and return the
+ * size of the name area; pad is set to the bytes between the name area
+ * and the data.
+ */
+static size_t
+ar_decode_header(ar_t *ar, const char *buf, ar_info_t *info, size_t *pad)
+{
+	const struct ar_hdr *hdr;
+	const struct ar_hdr2 *hdr2;
+	long long nsize;
+
+	if (ar->format == 1) {
+		hdr = (const struct ar_hdr *)buf;
+		if (strncmp(hdr->ar_fmag, ARFMAG, 2))
+			errx(1, "%s: invalid archive entry", ar->filename);
+
+		nsize = ar_decode(hdr->ar_name, sizeof(hdr->ar_name));
+		info->date = (time_t)ar_decode(hdr->ar_date, sizeof(hdr->ar_date));
+		info->uid = (uid_t)ar_decode(hdr->ar_uid, sizeof(hdr->ar_uid));
+		info->gid = (gid_t)ar_decode(hdr->ar_gid, sizeof(hdr->ar_gid));
+		info->mode = (mode_t)ar_decode(hdr->ar_mode, sizeof(hdr->ar_mode));
+		info->size = (off_t)ar_decode(hdr->ar_size, sizeof(hdr->ar_size));
+		*pad = 0;
+	}
+	else {
+		hdr2 = (const struct ar_hdr2 *)buf;
+		if (memcmp(hdr2->h_fmag, ARFMAG2, sizeof(hdr2->h_fmag)))
+			errx(1, "%s: invalid archive entry", ar->filename);
+
+		nsize = (long long)ar_get32(hdr2->h_namelen);
+		info->date = (time_t)ar_get64(hdr2->h_date);
+		info->uid = (uid_t)ar_get32(hdr2->h_uid);
+		info->gid = (gid_t)ar_get32(hdr2->h_gid);
+		info->mode = (mode_t)ar_get32(hdr2->h_mode);
+		info->size = (off_t)ar_get64(hdr2->h_size);
+		*pad = (size_t)ar_get32(hdr2->h_pad);
+	}
+
+	if (nsize < 1 || nsize > PATH_MAX+ARATTRMAX || info->size < 0 ||
+	    *pad >= ARALIGN)
+		errx(1, "%s: invalid archive entry", ar->filename);
+	return ((size_t)nsize);
+}
+
+static long long
+ar_decode(const char *field, size_t len)
+{
+	char buf[24];
+
+	/* header fields are space padded, not NUL terminated */
+	bzero(buf, sizeof(buf));
+	(void)memcpy(buf, field, len < sizeof(buf) ? len : sizeof(buf) - 1);
+	return (strtoll(buf, (char **)NULL, 10));
+}
+
+static uint64_t
+ar_decode_hash(const char *field)
+{
+	char buf[HASH_LEN+1];
+
+	(void)memcpy(buf, field, HASH_LEN);
+	buf[HASH_LEN] = '\0';
+	return ((uint64_t)strtoull(buf, (char **)NULL, 16));
+}
+
+static size_t
+ar_blklen(ar_info_t *info)
+{
+	return (info->hashed ? ARBLKLEN + HASH_LEN : ARBLKLEN);
+}
+
+static void
+ar_compress_job(void *arg, size_t idx)
+{
+	struct ar_blocks *bl = arg;
+	off_t offset;
+	size_t block, length;
+
+	block = bl->first + idx;
+	offset = (off_t)block * bl->info->blocksize;
+	length = bl->info->rawsize - offset < (off_t)bl->info->blocksize ?
+		(size_t)(bl->info->rawsize - offset) : bl->info->blocksize;
+
+	bl->sizes[block] = codec_compress_block(bl->info->codec,
+						bl->data + offset, length,
+						bl->bufs[idx], bl->bufsiz,
+						bl->info->path);
+	if (bl->hashes)
+		bl->hashes[block] = hash_data(bl->data + offset, length);
+}
+
+/*
+ * Copy length bytes to fd, hashing them in the same pass; they come
+ * from data when mapped, and from the archive stream otherwise.
+ */
+static void
+ar_copy_hashed(ar_t *ar, const char *data, int fd, const char *name,
+	       off_t length, hash_t *hash)
+{
+	char *buf;
+	const char *p;
+	size_t chunk, nbytes;
+	ssize_t written;
+
+	buf = data ? NULL : xmalloc(AR_BUFSIZ);
+	while (length > 0) {
+		chunk = length < AR_BUFSIZ ? (size_t)length : AR_BUFSIZ;
+		if (data) {
+			p = data;
+			data += chunk;
+		}
+		else {
+			ar_read(ar, buf, chunk);
+			p = buf;
+		}
+		hash_update(hash, p, chunk);
+
+		for (nbytes = chunk; nbytes > 0; nbytes -= written) {
+			if ((written = write(fd, p, nbytes)) == -1)
+				err(1, "write: %s", name);
+			if (written == 0)
+				errx(1, "write: %s: truncated write", name);
+			p += written;
+		}
+		length -= chunk;
+	}
+	free(buf);
+}
+
+/*
+ * Copy a hashed payload of length bytes, at offset in the archive or at
+ * its current position when offset is -1, to fd.  A clone costs no I/O,
+ * so the hash is then taken from the mapping; anything else is copied
+ * through the hash in one pass, which beats a kernel copy followed by
+ * a second pass over the mapping.
+ */
+static void
+ar_copy_member(ar_t *ar, off_t offset, int fd, const char *name,
+	       off_t length, hash_t *hash)
+{
+	if (offset != -1 && mpkg_clone_range(ar->fd, offset, fd, length) == 0)
+		hash_update(hash, ar->map + offset, (size_t)length);
+	else
+		ar_copy_hashed(ar, offset != -1 ? ar->map + offset : NULL,
+			       fd, name, length, hash);
+}
+
+static void
+ar_decompress_job(void *arg, size_t idx)
+{
+	struct ar_blocks *bl = arg;
+	char *buf;
+	off_t offset;
+	size_t length;
+
+	offset = (off_t)idx * bl->info->blocksize;
+	length = bl->info->rawsize - offset < (off_t)bl->info->blocksize ?
+		(size_t)(bl->info->rawsize - offset) : bl->info->blocksize;
+
+	buf = xmalloc(length);
+	codec_decompress_block(bl->info->codec, bl->data + bl->offsets[idx],
+			       bl->sizes[idx], buf, length, bl->info->path);
+	ar_write_block(bl, idx, buf, length);
+	free(buf);
+}
+
+static void
+ar_extract_blocks(ar_t *ar, ar_info_t *info, int fd)
+{
+	char *buf, *entry, *index, *stored;
+	off_t offset;
+	size_t blklen, idx, idxlen, length;
+	struct ar_blocks bl;
+
+	if (info->rawsize < 0 || info->blocksize > ARBLKMAX)
+		errx(1, "%s: %s: invalid block size", ar->filename, info->name);
+
+	bzero(&bl, sizeof(bl));
+	bl.info = info;
+	bl.fd = fd;
+	bl.nblocks = (size_t)((info->rawsize + info->blocksize - 1) /
+			      info->blocksize);
+	blklen = ar_blklen(info);
+	idxlen = bl.nblocks * blklen;
+	if (info->size < (off_t)idxlen)
+		errx(1, "%s: %s: truncated block index",
+		     ar->filename, info->name);
+
+	if (info->offset != -1)
+		index = ar->map + info->offset;
+	else {
+		index = xmalloc(idxlen);
+		ar_read(ar, index, idxlen);
+	}
+
+	bl.sizes = xcalloc(bl.nblocks, sizeof(size_t));
+	bl.offsets = xcalloc(bl.nblocks, sizeof(off_t));
+	if (info->hashed)
+		bl.hashes = xcalloc(bl.nblocks, sizeof(uint64_t));
+	offset = (off_t)idxlen;
+	for (idx = 0; idx < bl.nblocks; ++idx) {
+		entry = index + idx * blklen;
+		bl.sizes[idx] = (size_t)ar_decode(entry, ARBLKLEN);
+		if (bl.hashes)
+			bl.hashes[idx] = ar_decode_hash(entry + ARBLKLEN);
+		bl.offsets[idx] = offset;
+		offset += bl.sizes[idx];
+		if (bl.sizes[idx] == 0 || offset > info->size)
+			errx(1, "%s: %s: invalid block index",
+			     ar->filename, info->name);
+	}
+	if (offset != info->size)
+		errx(1, "%s: %s: invalid block index", ar->filename, info->name);
+
+	if (ftruncate(fd, info->rawsize) == -1)
+		err(1, "ftruncate: %s", info->path);
+
+	/*
+	 * Blocks of a mapped archive are independent of each other and
+	 * decompressed by the extraction jobs, unless the member is
+	 * itself being extracted by one of them.  Streamed archives are
+	 * decompressed block by block, in order.
+	 */
+	if (info->offset != -1) {
+		bl.data = ar->map + info->offset;
+		mpkg_parallel(ar->toextract ? 1 : ar->jobs, bl.nblocks,
+			      ar_decompress_job, &bl);
+	}
+	else {
+		stored = xmalloc(codec_bound(info->codec, info->blocksize));
+		buf = xmalloc(info->blocksize);
+		for (idx = 0; idx < bl.nblocks; ++idx) {
+			if (bl.sizes[idx] > codec_bound(info->codec,
+							info->blocksize))
+				errx(1, "%s: %s: invalid block index",
+				     ar->filename, info->name);
+			ar_read(ar, stored, bl.sizes[idx]);
+
+			offset = (off_t)idx * info->blocksize;
+			length = info->rawsize - offset <
+				(off_t)info->blocksize ?
+				(size_t)(info->rawsize - offset) :
+				info->blocksize;
+			codec_decompress_block(info->codec, stored,
+					       bl.sizes[idx], buf, length,
+					       info->path);
+			ar_write_block(&bl, idx, buf, length);
+		}
+		free(buf);
+		free(stored);
+		free(index);
+	}
+
+	free(bl.hashes);
+	free(bl.offsets);
+	free(bl.sizes);
+}
+
+static void
+ar_extract_job(void *arg, size_t idx)
+{
+	ar_t *ar = arg;
+
+	/* left to ar_extract_all, once the queue is done */
+	if (ar->toextract[idx]->blocksize)
+		return;
+	ar_extract(ar, ar->toextract[idx]);
+}
+
+static void
+ar_extract_sparse(ar_t *ar, ar_info_t *info, int fd, hash_t *hash)
+{
+	char *map;
+	off_t end, length, offset, pos;
+	size_t idx, maplen;
+
+	maplen = info->extents * 2 * ARXTLEN;
+	if (info->rawsize < 0 || info->size < (off_t)maplen)
+		errx(1, "%s: %s: invalid extent map", ar->filename, info->name);
+
+	if (info->offset != -1)
+		map = ar->map + info->offset;
+	else {
+		map = xmalloc(maplen);
+		ar_read(ar, map, maplen);
+	}
+
+	/* holes are whatever the extents leave out */
+	if (ftruncate(fd, info->rawsize) == -1)
+		err(1, "ftruncate: %s", info->path);
+
+	pos = (off_t)maplen;
+	end = 0;
+	for (idx = 0; idx < info->extents; ++idx) {
+		offset = (off_t)ar_decode(map + 2 * idx * ARXTLEN, ARXTLEN);
+		length = (off_t)ar_decode(map + (2 * idx + 1) * ARXTLEN,
+					  ARXTLEN);
+		if (offset < end || length < 0 ||
+		    length > info->rawsize - offset ||
+		    length > info->size - pos)
+			errx(1, "%s: %s: invalid extent map",
+			     ar->filename, info->name);
+
+		if (lseek(fd, offset, SEEK_SET) == -1)
+			err(1, "lseek: %s", info->path);
+		if (info->hashed) {
+			/* holes read back as zeros, and are hashed as such */
+			ar_hash_zeros(hash, offset - end);
+			ar_copy_member(ar, info->offset != -1 ?
+				       info->offset + pos : -1,
+				       fd, info->path, length, hash);
+		}
+		else
+			mpkg_copy_data(ar->fd, ar->filename,
+				       info->offset != -1 ?
+				       info->offset + pos : -1,
+				       fd, info->path, length);
+		pos += length;
+		end = offset + length;
+	}
+	if (pos != info->size)
+		errx(1, "%s: %s: invalid extent map", ar->filename, info->name);
+	if (info->hashed)
+		ar_hash_zeros(hash, info->rawsize - end);
+
+	if (info->offset == -1)
+		free(map);
+}
+
+static uint32_t
+ar_get32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+		(uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+}
+
+static uint64_t
+ar_get64(const uint8_t *p)
+{
+	return ((uint64_t)ar_get32(p) | (uint64_t)ar_get32(p + 4) << 32);
+}
+
+static void
+ar_hash_zeros(hash_t *hash, off_t length)
+{
+	static const char zeros[65536];
+	size_t chunk;
+
+	for (; length > 0; length -= chunk) {
+		chunk = length < (off_t)sizeof(zeros) ?
+			(size_t)length : sizeof(zeros);
+		hash_update(hash, zeros, chunk);
+	}
+}
+
+static size_t
+ar_hdrlen(ar_t *ar)
+{
+	return (ar->format == 1 ? sizeof(struct ar_hdr) :
+		sizeof(struct ar_hdr2));
+}
+
+/*
+ * Find the data extents of a regular file; a file with holes is
+ * archived as an extent map followed by the data of each extent.
+ */
+static void
+ar_holes(ar_t *ar, ar_info_t *info)
+{
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+	int fd;
+	off_t data, hole, total;
+	size_t count;
+
+	if ((fd = open(info->path, O_RDONLY|O_CLOEXEC)) == -1)
+		err(1, "cannot open file: '%s'", info->path);
+
+	/* filesystems without hole tracking report one at the end */
+	if ((hole = lseek(fd, 0, SEEK_HOLE)) == -1 || hole >= info->size) {
+		close(fd);
+		return;
+	}
+
+	count = 0;
+	total = 0;
+	for (data = 0; data < info->size; data = hole) {
+		if ((data = lseek(fd, data, SEEK_DATA)) == -1) {
+			if (errno == ENXIO)
+				break;
+			err(1, "lseek: %s", info->path);
+		}
+		if ((hole = lseek(fd, data, SEEK_HOLE)) == -1)
+			err(1, "lseek: %s", info->path);
+		if (hole > info->size)
+			hole = info->size;
+
+		ar->extents = xrealloc(ar->extents,
+				       (count+1) * sizeof(struct ar_extent));
+		ar->extents[count].offset = data;
+		ar->extents[count].length = hole - data;
+		total += hole - data;
+		++count;
+	}
+	close(fd);
+
+	info->sparse = 1;
+	info->extents = count;
+	info->rawsize = info->size;
+	info->size = (off_t)(count * 2 * ARXTLEN) + total;
+#else
+	(void)ar;
+	(void)info;
+#endif
+}
+
+static void
+ar_map(ar_t *ar)
+{
+	struct stat sb;
+	void *map;
+
+	/*
+	 * Regular files are read through a private mapping; pipes and
+	 * other non-seekable inputs keep using read(2).
+	 */
+	if (fstat(ar->fd, &sb) == -1)
+		err(1, "fstat: %s", ar->filename);
+	if (!S_ISREG(sb.st_mode) || sb.st_size < SARMAG)
+		return;
+
+	map = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, ar->fd, 0);
+	if (map == MAP_FAILED)
+		return;
+	(void)posix_madvise(map, (size_t)sb.st_size, POSIX_MADV_SEQUENTIAL);
+
+	ar->map = map;
+	ar->maplen = (size_t)sb.st_size;
+}
+
+static void
+ar_parse_name(ar_t *ar, ar_info_t *info, const char *buf, size_t nsize)
+{
+	char value[32];
+	const char *end, *eol, *p, *sep;
+	size_t len;
+
+	end = buf + nsize;
+	if (!(eol = memchr(buf, '\n', nsize)))
+		eol = end;
+	if ((len = eol - buf) >= PATH_MAX)
+		errx(1, "%s: invalid archive entry", ar->filename);
+	(void)memcpy(info->name, buf, len);
+	info->name[len] = '\0';
+	info->rawsize = info->size;
+
+	for (p = eol + 1; p < end; p = eol + 1) {
+		if (!(eol = memchr(p, '\n', end - p)))
+			eol = end;
+		if (!(sep = memchr(p, '=', eol - p)))
+			continue;
+		len = eol - sep - 1;
+		if (len >= sizeof(value))
+			len = sizeof(value) - 1;
+		(void)memcpy(value, sep + 1, len);
+		value[len] = '\0';
+
+		if (sep - p == 5 && !strncmp(p, "codec", 5)) {
+			if ((info->codec = codec_lookup(value)) == -1)
+				errx(1, "%s: %s: unknown codec '%s'",
+				     ar->filename, info->name, value);
+		}
+		else if (sep - p == 9 && !strncmp(p, "blocksize", 9))
+			info->blocksize = (size_t)strtoull(value, NULL, 10);
+		else if (sep - p == 7 && !strncmp(p, "rawsize", 7))
+			info->rawsize = (off_t)strtoll(value, NULL, 10);
+		else if (sep - p == 6 && !strncmp(p, "sparse", 6)) {
+			info->sparse = 1;
+			info->extents = (size_t)strtoull(value, NULL, 10);
+		}
+		else if (sep - p == 4 && !strncmp(p, "hash", 4)) {
+			if (len != HASH_LEN)
+				errx(1, "%s: %s: invalid hash",
+				     ar->filename, info->name);
+			info->hashed = 1;
+			info->hash = ar_decode_hash(value);
+		}
+	}
+	if ((info->blocksize && info->codec == CODEC_NONE) ||
+	    (info->sparse && (info->codec != CODEC_NONE ||
+			      info->extents > (size_t)info->size /
+			      (2 * ARXTLEN))))
+		errx(1, "%s: %s: invalid archive entry",
+		     ar->filename, info->name);
+}
+
+static void
+ar_put32(uint8_t *p, uint32_t val)
+{
+	p[0] = val & 0xff;
+	p[1] = (val >> 8) & 0xff;
+	p[2] = (val >> 16) & 0xff;
+	p[3] = (val >> 24) & 0xff;
+}
+
+static void
+ar_put64(uint8_t *p, uint64_t val)
+{
+	ar_put32(p, (uint32_t)val);
+	ar_put32(p + 4, (uint32_t)(val >> 32));
+}
+
+static void
+ar_read(ar_t *ar, void *buf, size_t nbytes)
+{
+	ssize_t length;
+
+	while (nbytes > 0) {
+		if ((length = read(ar->fd, buf, nbytes)) == -1)
+			err(1, "read: %s", ar->filename);
+		if (length == 0)
+			errx(1, "read: %s: truncated read", ar->filename);
+		buf = (char *)buf + length;
+		nbytes -= length;
+	}
+}
+
+static void
+ar_skip(ar_t *ar)
+{
+	char buf[65536];
+	ssize_t nbytes;
+
+	if (!ar->offset)
+		return;
+
+	if (ar->map) {
+		ar->pos += (size_t)ar->offset;
+		ar->offset = 0;
+		return;
+	}
+
+	if (lseek(ar->fd, ar->offset, SEEK_CUR) != -1) {
+		ar->offset = 0;
+		return;
+	}
+	if (errno != ESPIPE)
+		err(1, "lseek: %s", ar->filename);
+
+	while (ar->offset > 0) {
+		nbytes = ar->offset < (off_t)sizeof(buf) ?
+			(ssize_t)ar->offset : (ssize_t)sizeof(buf);
+		if ((nbytes = read(ar->fd, buf, nbytes)) == -1)
+			err(1, "read: %s", ar->filename);
+		if (nbytes == 0)
+			errx(1, "read: %s: truncated read", ar->filename);
+		ar->offset -= nbytes;
+	}
+}
+
+static int
+ar_toc_cmp(const void *a, const void *b)
+{
+	const struct ar_toc *ta = a, *tb = b;
+
+	return (strcmp(ta->name, tb->name));
+}
+
+static void
+ar_toc_load(ar_t *ar)
+{
+	const char *p, *end, *eol;
+	char *s;
+	off_t offset;
+	ar_info_t info;
+	struct ar_toc *entry;
+	struct ar_toc_tail *tail;
+	size_t nsize, pad;
+
+	if (ar->maplen < SARMAG + sizeof(struct ar_toc_tail))
+		return;
+	tail = (struct ar_toc_tail *)(ar->map + ar->maplen -
+				      sizeof(struct ar_toc_tail));
+	if (memcmp(tail->tt_magic, ARTOCMAG, sizeof(tail->tt_magic)))
+		return;
+
+	offset = (off_t)ar_decode(tail->tt_offset, sizeof(tail->tt_offset));
+	if (offset < SARMAG ||
+	    (size_t)offset + ar_hdrlen(ar) > ar->maplen)
+		errx(1, "%s: invalid table of contents", ar->filename);
+
+	p = ar->map + offset;
+	nsize = ar_decode_header(ar, p, &info, &pad);
+	p += ar_hdrlen(ar);
+	if (nsize != sizeof(ARTOCNAME) || pad != 0 ||
+	    (size_t)(p - ar->map) + nsize > ar->maplen ||
+	    memcmp(p, ARTOCNAME, nsize - 1))
+		errx(1, "%s: invalid table of contents", ar->filename);
+
+	p += nsize;
+	end = ar->map + ar->maplen - sizeof(struct ar_toc_tail);
+	while (p < end) {
+		if (!(eol = memchr(p, '\n', end - p)))
+			errx(1, "%s: invalid table of contents", ar->filename);
+
+		ar->toc = xrealloc(ar->toc,
+				   (ar->ntoc+1) * sizeof(struct ar_toc));
+		entry = &ar->toc[ar->ntoc];
+		entry->offset = (off_t)strtoll(p, &s, 10);
+		entry->size = (off_t)strtoll(s, &s, 10);
+		entry->mode = (mode_t)strtol(s, &s, 10);
+		if (s >= eol || *s != ' ' || entry->offset < SARMAG ||
+		    entry->offset >= offset)
+			errx(1, "%s: invalid table of contents", ar->filename);
+		entry->name = s + 1;
+		entry->namelen = eol - entry->name;
+		++ar->ntoc;
+
+		p = eol + 1;
+	}
+}
+
+static int
+ar_toc_search(const void *key, const void *entry)
+{
+	const struct ar_toc *toc = entry;
+	size_t len;
+	int rv;
+
+	len = strlen(key);
+	if ((rv = memcmp(key, toc->name,
+			 len < toc->namelen ? len : toc->namelen)))
+		return (rv);
+	if (len == toc->namelen)
+		return (0);
+	return (len < toc->namelen ? -1 : 1);
+}
+
+static void
+ar_toc_write(ar_t *ar)
+{
+	FILE *fp;
+	ar_info_t *info, _info;
+	char *buf, offset[20+1];
+	off_t hdroff;
+	size_t bufsize, idx;
+	ssize_t written;
+	struct ar_toc_tail tail;
+
+	if ((hdroff = lseek(ar->fd, 0, SEEK_CUR)) == -1)
+		err(1, "lseek: %s", ar->filename);
+
+	if (!(fp = open_memstream(&buf, &bufsize)))
+		err(1, "open_memstream");
+	qsort(ar->toc, ar->ntoc, sizeof(struct ar_toc), ar_toc_cmp);
+	for (idx = 0; idx < ar->ntoc; ++idx) {
+		fprintf(fp, "%lld %lld %d %s\n",
+			(long long)ar->toc[idx].offset,
+			(long long)ar->toc[idx].size,
+			(int)ar->toc[idx].mode, ar->toc[idx].name);
+	}
+	fclose(fp);
+
+	snprintf(offset, sizeof(offset), "%-20lld", (long long)hdroff);
+	(void)memcpy(tail.tt_offset, offset, sizeof(tail.tt_offset));
+	(void)memcpy(tail.tt_magic, ARTOCMAG, sizeof(tail.tt_magic));
+
+	info = &_info;
+	bzero(info, sizeof(ar_info_t));
+	snprintf(info->name, PATH_MAX, "%s", ARTOCNAME);
+	info->size = bufsize + sizeof(struct ar_toc_tail);
+	ar_write_header(ar, info);
+
+	if ((written = write(ar->fd, buf, bufsize)) == -1)
+		err(1, "write: %s", ar->filename);
+	if ((size_t)written < bufsize)
+		errx(1, "write: %s: truncated write", ar->filename);
+	if ((written = write(ar->fd, &tail, sizeof(tail))) == -1)
+		err(1, "write: %s", ar->filename);
+	if (written < (ssize_t)sizeof(tail))
+		errx(1, "write: %s: truncated write", ar->filename);
+	free(buf);
+}
+
+static void
+ar_verify(ar_t *ar, ar_info_t *info, hash_t *hash)
+{
+	if (hash_final(hash) != info->hash)
+		errx(1, "%s: %s: checksum mismatch", ar->filename, info->name);
+}
+
+/*
+ * Write a decompressed block in place, checking its hash a slice at a
+ * time so that every slice is still cached when it is written out.
+ */
+static void
+ar_write_block(struct ar_blocks *bl, size_t idx, const char *buf,
+	       size_t length)
+{
+	hash_t hash;
+	off_t offset;
+	size_t chunk;
+	ssize_t written;
+
+	hash_init(&hash);
+	offset = (off_t)idx * bl->info->blocksize;
+	for (; length > 0; length -= chunk) {
+		chunk = length < AR_BUFSIZ ? length : AR_BUFSIZ;
+		if (bl->hashes)
+			hash_update(&hash, buf, chunk);
+		if ((written = pwrite(bl->fd, buf, chunk, offset)) == -1)
+			err(1, "write: %s", bl->info->path);
+		if ((size_t)written < chunk)
+			errx(1, "write: %s: truncated write", bl->info->path);
+		buf += chunk;
+		offset += chunk;
+	}
+	if (bl->hashes && hash_final(&hash) != bl->hashes[idx])
+		errx(1, "%s: block %zu: checksum mismatch", bl->info->path, idx);
+}
+
+static off_t
+ar_write_blocks(ar_t *ar, ar_info_t *info, const char *data, hash_t *hash)
+{
+	char *index;
+	off_t idxoff, offset, total;
+	size_t batch, blklen, count, idx, idxlen;
+	ssize_t written;
+	struct ar_blocks bl;
+
+	bzero(&bl, sizeof(bl));
+	bl.info = info;
+	bl.nblocks = (size_t)((info->rawsize + info->blocksize - 1) /
+			      info->blocksize);
+	bl.data = data;
+	bl.hashes = xcalloc(bl.nblocks, sizeof(uint64_t));
+
+	/* the index is written once every block size is known */
+	blklen = ar_blklen(info);
+	idxlen = bl.nblocks * blklen;
+	if ((idxoff = lseek(ar->fd, (off_t)idxlen, SEEK_CUR)) == -1)
+		err(1, "lseek: %s", ar->filename);
+	idxoff -= (off_t)idxlen;
+
+	/*
+	 * Blocks are compressed and hashed a batch at a time, a couple per
+	 * job, and written in order once the whole batch is done; the
+	 * member hash is fed the same batch while it is still warm.
+	 */
+	batch = 2 * (ar->jobs > 1 ? (size_t)ar->jobs : 1);
+	bl.bufsiz = codec_bound(info->codec, info->blocksize);
+	bl.bufs = xcalloc(batch, sizeof(char *));
+	for (idx = 0; idx < batch; ++idx)
+		bl.bufs[idx] = xmalloc(bl.bufsiz);
+	bl.sizes = xcalloc(bl.nblocks, sizeof(size_t));
+
+	total = (off_t)idxlen;
+	for (bl.first = 0; bl.first < bl.nblocks; bl.first += count) {
+		count = bl.nblocks - bl.first < batch ?
+			bl.nblocks - bl.first : batch;
+		mpkg_parallel(ar->jobs, count, ar_compress_job, &bl);
+
+		offset = (off_t)bl.first * info->blocksize;
+		hash_update(hash, data + offset,
+			    (size_t)(info->rawsize - offset <
+				     (off_t)(count * info->blocksize) ?
+				     info->rawsize - offset :
+				     (off_t)(count * info->blocksize)));
+
+		for (idx = 0; idx < count; ++idx) {
+			written = write(ar->fd, bl.bufs[idx],
+					bl.sizes[bl.first + idx]);
+			if (written == -1)
+				err(1, "write: %s", ar->filename);
+			if ((size_t)written < bl.sizes[bl.first + idx])
+				errx(1, "write: %s: truncated write",
+				     ar->filename);
+			total += written;
+		}
+	}
+
+	index = xmalloc(idxlen + 1);
+	for (idx = 0; idx < bl.nblocks; ++idx)
+		snprintf(index + idx * blklen, blklen + 1, "%-10zu%0*llx",
+			 bl.sizes[idx], HASH_LEN,
+			 (unsigned long long)bl.hashes[idx]);
+	if (pwrite(ar->fd, index, idxlen, idxoff) != (ssize_t)idxlen)
+		err(1, "write: %s", ar->filename);
+
+	free(index);
+	free(bl.hashes);
+	free(bl.sizes);
+	for (idx = 0; idx < batch; ++idx)
+		free(bl.bufs[idx]);
+	free(bl.bufs);
+	return (total);
+}
+
 static void
 ar_write_data(ar_t *ar, ar_info_t *info)
 {
-	char buf[512], target[PATH_MAX];
+	char *map, target[PATH_MAX];
 	int fd, nbytes;
+	hash_t hash;
+	off_t csize;
 	ssize_t written;
 
 	if (S_ISLNK(info->mode)) {
@@ -327,45 +1430,211 @@ ar_write_data(ar_t *ar, ar_info_t *info)
 		if ((fd = open(info->path, O_RDONLY|O_CLOEXEC)) == -1)
 			err(1, "cannot open file: '%s'", info->path);
 
-		while ((nbytes = read(fd, buf, 512)) > 0) {
-			if ((written = write(ar->fd, buf, nbytes)) == -1)
-				err(1, "write: %s", ar->filename);
-			if (written < nbytes)
-				errx(1, "written: %s: truncated write", ar->filename);
+		map = NULL;
+		if (info->rawsize > 0) {
+			if ((map = mmap(NULL, (size_t)info->rawsize, PROT_READ,
+					MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+				err(1, "mmap: %s", info->path);
+			(void)posix_madvise(map, (size_t)info->rawsize,
+					    POSIX_MADV_SEQUENTIAL);
 		}
-		if (nbytes == -1)
-			err(1, "read: %s", info->path);
 
+		/* the contents are hashed in the same pass that stores them */
+		hash_init(&hash);
+		if (info->sparse)
+			ar_write_extents(ar, info, map, &hash);
+		else {
+			csize = info->size;
+			if (info->blocksize)
+				csize = ar_write_blocks(ar, info, map, &hash);
+			else if (info->codec != CODEC_NONE)
+				csize = codec_compress(info->codec, fd,
+						       info->path, ar->fd,
+						       ar->filename, &hash);
+
+			if (csize < info->size) {
+				/* the header has the original size */
+				info->size = csize;
+				ar_write_size(ar, info);
+			}
+			else {
+				if (info->codec != CODEC_NONE) {
+					/* did not shrink: store it */
+					if (ftruncate(ar->fd, ar->hdroff) == -1)
+						err(1, "ftruncate: %s",
+						    ar->filename);
+					if (lseek(ar->fd, ar->hdroff,
+						  SEEK_SET) == -1)
+						err(1, "lseek: %s",
+						    ar->filename);
+					info->codec = CODEC_NONE;
+					info->blocksize = 0;
+					ar_write_header(ar, info);
+					hash_init(&hash);
+				}
+				ar_copy_hashed(ar, map, ar->fd, ar->filename,
+					       info->size, &hash);
+			}
+		}
+		info->hash = hash_final(&hash);
+		ar_write_hash(ar, info);
+
+		if (map)
+			(void)munmap(map, (size_t)info->rawsize);
 		close(fd);
 	}
 }
 
+static void
+ar_write_extents(ar_t *ar, ar_info_t *info, const char *data, hash_t *hash)
+{
+	char *map;
+	off_t end;
+	size_t idx, maplen;
+	ssize_t written;
+
+	maplen = info->extents * 2 * ARXTLEN;
+	map = xmalloc(maplen + 1);
+	for (idx = 0; idx < info->extents; ++idx) {
+		snprintf(map + 2 * idx * ARXTLEN, 2 * ARXTLEN + 1,
+			 "%-20lld%-20lld",
+			 (long long)ar->extents[idx].offset,
+			 (long long)ar->extents[idx].length);
+	}
+	if ((written = write(ar->fd, map, maplen)) == -1)
+		err(1, "write: %s", ar->filename);
+	if ((size_t)written < maplen)
+		errx(1, "write: %s: truncated write", ar->filename);
+	free(map);
+
+	/* holes read back as zeros, and are hashed as such */
+	end = 0;
+	for (idx = 0; idx < info->extents; ++idx) {
+		ar_hash_zeros(hash, ar->extents[idx].offset - end);
+		ar_copy_hashed(ar, data + ar->extents[idx].offset,
+			       ar->fd, ar->filename,
+			       ar->extents[idx].length, hash);
+		end = ar->extents[idx].offset + ar->extents[idx].length;
+	}
+	ar_hash_zeros(hash, info->rawsize - end);
+}
+
+static void
+ar_write_hash(ar_t *ar, ar_info_t *info)
+{
+	char hash[HASH_LEN+1];
+
+	snprintf(hash, sizeof(hash), "%0*llx", HASH_LEN,
+		 (unsigned long long)info->hash);
+	if (pwrite(ar->fd, hash, HASH_LEN, ar->hashoff) != HASH_LEN)
+		err(1, "write: %s", ar->filename);
+}
+
 static void
 ar_write_header(ar_t *ar, ar_info_t *info)
 {
-	char buf[PATH_MAX+1];
-	ssize_t nsize, written;
-	struct ar_hdr *hdr, _hdr;
-
-	hdr = &_hdr;
-	hdr = memset(hdr, ' ', sizeof(struct ar_hdr));
-	nsize = strlen(info->name) + 1;
-	snprintf(hdr->ar_name, 6+1, "%-6d", nsize);
-	snprintf(hdr->ar_date, 12+1, "%-12d", info->date);
-	snprintf(hdr->ar_uid, 6+1, "%-6d", info->uid);
-	snprintf(hdr->ar_gid, 6+1, "%-6d", info->gid);
-	snprintf(hdr->ar_mode, 8+1, "%-8d", info->mode);
-	snprintf(hdr->ar_size, 10+1, "%-10lld", info->size);
-	(void)memcpy(hdr->ar_fmag, ARFMAG, 2);
-
-	if ((written = write(ar->fd, hdr, sizeof(struct ar_hdr))) == -1)
+	FILE *fp;
+	char *buf;
+	long hashpos;
+	off_t offset;
+	size_t hdrlen, nsize, pad;
+	ssize_t written;
+	struct ar_hdr *hdr;
+	struct ar_hdr2 *hdr2;
+	union ar_hdrs _hdr;
+
+	if (!(fp = open_memstream(&buf, &nsize)))
+		err(1, "open_memstream");
+	fprintf(fp, "%s\n", info->name);
+	if (info->codec != CODEC_NONE)
+		fprintf(fp, "codec=%s\n", codec_name(info->codec));
+	if (info->blocksize)
+		fprintf(fp, "blocksize=%zu\n", info->blocksize);
+	if (info->sparse)
+		fprintf(fp, "sparse=%zu\n", info->extents);
+	if (info->codec != CODEC_NONE || info->sparse)
+		fprintf(fp, "rawsize=%lld\n", (long long)info->rawsize);
+	hashpos = -1;
+	if (info->hashed) {
+		/* patched by ar_write_hash once the data is written */
+		fprintf(fp, "hash=");
+		hashpos = ftell(fp);
+		fprintf(fp, "%0*llx\n", HASH_LEN,
+			(unsigned long long)info->hash);
+	}
+	fclose(fp);
+
+	pad = 0;
+	hdrlen = ar_hdrlen(ar);
+	if (hashpos != -1)
+		ar->hashoff = ar->hdroff + (off_t)(hdrlen + hashpos);
+	if (ar->format == 1) {
+		if (nsize > 999999 || info->size > 9999999999LL)
+			errx(1, "%s: %s: too large for archive format 1",
+			     ar->filename, info->name);
+
+		hdr = memset(&_hdr.v1, ' ', sizeof(struct ar_hdr));
+		snprintf(hdr->ar_name, 6+1, "%-6zu", nsize);
+		snprintf(hdr->ar_date, 12+1, "%-12d", info->date);
+		snprintf(hdr->ar_uid, 6+1, "%-6d", info->uid);
+		snprintf(hdr->ar_gid, 6+1, "%-6d", info->gid);
+		snprintf(hdr->ar_mode, 8+1, "%-8d", info->mode);
+		snprintf(hdr->ar_size, 10+1, "%-10lld", info->size);
+		(void)memcpy(hdr->ar_fmag, ARFMAG, 2);
+	}
+	else {
+		/* regular file data starts on an ARALIGN boundary */
+		if (S_ISREG(info->mode) && info->size > 0) {
+			if ((offset = lseek(ar->fd, 0, SEEK_CUR)) == -1)
+				err(1, "lseek: %s", ar->filename);
+			offset += hdrlen + nsize;
+			pad = (ARALIGN - offset % ARALIGN) % ARALIGN;
+		}
+
+		hdr2 = &_hdr.v2;
+		bzero(hdr2, sizeof(struct ar_hdr2));
+		(void)memcpy(hdr2->h_fmag, ARFMAG2, sizeof(hdr2->h_fmag));
+		ar_put32(hdr2->h_namelen, (uint32_t)nsize);
+		ar_put32(hdr2->h_pad, (uint32_t)pad);
+		ar_put32(hdr2->h_mode, (uint32_t)info->mode);
+		ar_put32(hdr2->h_uid, (uint32_t)info->uid);
+		ar_put32(hdr2->h_gid, (uint32_t)info->gid);
+		ar_put64(hdr2->h_date, (uint64_t)info->date);
+		ar_put64(hdr2->h_size, (uint64_t)info->size);
+	}
+
+	if ((written = write(ar->fd, &_hdr, hdrlen)) == -1)
 		err(1, "write: %s", ar->filename);
-	if (written < (ssize_t)sizeof(struct ar_hdr))
+	if ((size_t)written < hdrlen)
 		errx(1, "write: %s: truncted write", ar->filename);
 
-	snprintf(buf, sizeof(buf), "%s\n", info->name);
 	if ((written = write(ar->fd, buf, nsize)) == -1)
 		err(1, "write: %s", ar->filename);
-	if (written < nsize)
+	if ((size_t)written < nsize)
 		errx(1, "write: %s: truncated write", ar->filename);
+	free(buf);
+
+	/* the payload overwrites the hole, if any */
+	if (pad && lseek(ar->fd, (off_t)pad, SEEK_CUR) == -1)
+		err(1, "lseek: %s", ar->filename);
+}
+
+static void
+ar_write_size(ar_t *ar, ar_info_t *info)
+{
+	char size[10+1];
+	uint8_t size2[8];
+
+	if (ar->format == 1) {
+		snprintf(size, sizeof(size), "%-10lld", (long long)info->size);
+		if (pwrite(ar->fd, size, 10, ar->hdroff +
+			   offsetof(struct ar_hdr, ar_size)) != 10)
+			err(1, "write: %s", ar->filename);
+	}
+	else {
+		ar_put64(size2, (uint64_t)info->size);
+		if (pwrite(ar->fd, size2, 8, ar->hdroff +
+			   offsetof(struct ar_hdr2, h_size)) != 8)
+			err(1, "write: %s", ar->filename);
+	}
 }
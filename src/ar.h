@@ -28,12 +28,27 @@
 #ifndef __ARCHIVE_H
 #define __ARCHIVE_H
 
+#include <sys/types.h>
+
 #include <limits.h>
+#include <stdint.h>
 
 #define ARMAG	"!<arch>\n"	/* ar "magic number" */
 #define SARMAG	8		/* strlen(ARMAG) */
 #define ARFMAG	"`\n"		/* ar entry "magic number" */
 
+#define ARMAG2	"!<arv2>\n"	/* format 2 "magic number" */
+#define ARFMAG2	"mbr\n"		/* format 2 entry "magic number" */
+#define ARALIGN	4096		/* format 2 data alignment */
+
+#define ARATTRMAX 1024		/* room for member attributes */
+#define ARBLKLEN  10		/* width of a block index entry */
+#define ARBLKMAX  (64 * 1024 * 1024) /* largest block readers accept */
+#define ARXTLEN   20		/* width of an extent map field */
+
+#define ARTOCNAME "__.MPKGTOC"	/* table of contents member name */
+#define ARTOCMAG  "!<mtoc>\n"	/* table of contents "magic number" */
+
 typedef struct ar ar_t;
 typedef struct ar_info ar_info_t;
 
@@ -82,6 +97,77 @@ typedef struct ar_info ar_info_t;
  *   | data           |              | as defined in ar_size |
  *   |                |              |                       |
  *   |========================================================
+ *
+ *
+ * The file name field may be followed by member attributes, one
+ * "key=value\n" line each, all accounted for in ar_name:
+ *
+ *   codec=<name>	the payload is compressed with this codec
+ *   blocksize=<n>	the member was split into blocks of n bytes, each
+ *			compressed on its own
+ *   rawsize=<n>	uncompressed size of a compressed member, or
+ *			apparent size of a sparse file
+ *   sparse=<n>	the member is a sparse file with n data extents
+ *   hash=<x>	XXH3 of the member contents, HASH_LEN hex digits
+ *
+ * The payload of a member split into blocks starts with an index giving
+ * the stored size of every block, ARBLKLEN decimal digits each, followed
+ * by the blocks in order.  Blocks can be decompressed independently and
+ * written at their own offset.  When the member has a hash, each index
+ * entry is followed by the hash of the block contents, HASH_LEN hex
+ * digits, so that every block is verified by whoever decompresses it.
+ *
+ * The payload of a sparse file starts with its extent map: the offset
+ * and the length of every data extent, ARXTLEN decimal digits each,
+ * followed by the data of the extents in order.  Sparse files are never
+ * compressed.
+ *
+ * Readers ignore attributes they do not know about.
+ *
+ *
+ *
+ *******************************************************************************
+ *
+ * Format 2 starts with ARMAG2 and uses fixed-size binary headers, all
+ * integers little endian:
+ *
+ *   |=======================================================|
+ *   | Components     | Subcomponent |                  Size |
+ *   |=======================================================|
+ *   | magic number   |              |                     8 |
+ *   |=======================================================|
+ *   | file header    | h_fmag       |                     4 |
+ *   |                | h_namelen    |                     4 |
+ *   |                | h_pad        |                     4 |
+ *   |                | h_mode       |                     4 |
+ *   |                | h_uid        |                     4 |
+ *   |                | h_gid        |                     4 |
+ *   |                | h_date       |                     8 |
+ *   |                | h_size       |                     8 |
+ *   |================|======================================|
+ *   | file name      |              |       h_namelen bytes |
+ *   |================|======================================|
+ *   | padding        |              |           h_pad bytes |
+ *   |================|======================================|
+ *   | data           |              |          h_size bytes |
+ *   |========================================================
+ *
+ * The name area is the same as in the original format.  The padding
+ * puts the data of regular files on an ARALIGN boundary, so it can be
+ * mapped or cloned straight out of the archive; other members have
+ * none.
+ *
+ *
+ * An archive may end with a table of contents member named ARTOCNAME.
+ * Its payload holds one line per member, sorted by name:
+ *
+ *   <header offset> <size> <mode> <name>\n
+ *
+ * followed by a struct ar_toc_tail, so that readers can find the table
+ * from the end of the file without walking the archive.  Readers that
+ * do not know about the table treat it as an ordinary member and
+ * extract it, so archives written with -t need a reader that knows
+ * about the table of contents.
  */
 
 struct ar_hdr {
@@ -94,6 +180,22 @@ struct ar_hdr {
 	char ar_fmag[2];	/* consistency check */
 } __attribute__((packed));
 
+struct ar_hdr2 {
+	char	h_fmag[4];	/* ARFMAG2 */
+	uint8_t	h_namelen[4];	/* name and attributes size */
+	uint8_t	h_pad[4];	/* padding before the data */
+	uint8_t	h_mode[4];	/* file mode */
+	uint8_t	h_uid[4];	/* user id */
+	uint8_t	h_gid[4];	/* group id */
+	uint8_t	h_date[8];	/* last modification time */
+	uint8_t	h_size[8];	/* size in bytes */
+} __attribute__((packed));
+
+struct ar_toc_tail {
+	char tt_offset[20];	/* offset of the table member header */
+	char tt_magic[8];	/* ARTOCMAG */
+} __attribute__((packed));
+
 struct ar_info {
 	char	name[PATH_MAX];	/* name */
 	char	path[PATH_MAX];	/* full path */
@@ -102,18 +204,31 @@ struct ar_info {
 	gid_t	gid;		/* group id */
 	mode_t	mode;		/* octal file permissions */
 	off_t	size;		/* size in bytes */
+	off_t	offset;		/* payload offset, -1 when streaming */
+	int	codec;		/* payload codec, see codec.h */
+	size_t	blocksize;	/* block size, 0 when not split */
+	off_t	rawsize;	/* size of the contents once extracted */
+	int	sparse;		/* sparse file, see extents */
+	size_t	extents;	/* data extents of a sparse file */
+	int	hashed;		/* hash is set */
+	uint64_t hash;		/* XXH3 of the contents */
 };
 
 ar_t		*ar_open_read(const char *filename);
-ar_t		*ar_open_write(const char *filename);
+ar_t		*ar_open_write(const char *filename, int format);
 void		ar_close(ar_t *ar);
 
-void		ar_append(ar_t *ar, const char *filename);
+void		ar_append(ar_t *ar, const char *filename, ar_info_t *info);
 
+const char	*ar_data(ar_t *ar, ar_info_t *info);
+ar_info_t	*ar_find(ar_t *ar, const char *name);
 ar_info_t	*ar_next(ar_t *ar);
 void		ar_extract(ar_t *ar, ar_info_t *info);
 void		ar_extract_all(ar_t *ar);
 
+void		ar_set_codec(ar_t *ar, int codec);
+void		ar_set_jobs(ar_t *ar, int jobs);
+void		ar_set_toc(ar_t *ar, int enable);
 void		ar_set_wrkdir(ar_t *ar, const char *wrkdir);
 
 #endif	/* __ARCHIVE_H */
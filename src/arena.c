@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2015, Quentin Schwerkolt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif	/* HAVE_CONFIG_H */
+
+#include <sys/types.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "xalloc.h"
+
+#define ARENA_CHUNK	(64*1024)
+#define ARENA_ALIGN	(sizeof(void *))
+
+struct arena_chunk {
+	struct arena_chunk *next;
+};
+
+struct arena {
+	struct arena_chunk *chunks;
+	char	*ptr;			/* next free byte of the current chunk */
+	size_t	left;			/* free bytes left in the current chunk */
+};
+
+static void	*arena_chunk(arena_t *arena, size_t size);
+
+arena_t *
+arena_new(void)
+{
+	return (xcalloc(1, sizeof(arena_t)));
+}
+
+void
+arena_free(arena_t *arena)
+{
+	struct arena_chunk *chunk;
+
+	while ((chunk = arena->chunks)) {
+		arena->chunks = chunk->next;
+		free(chunk);
+	}
+	free(arena);
+}
+
+void *
+arena_alloc(arena_t *arena, size_t size)
+{
+	void *ptr;
+
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	if (size > arena->left)
+		return (arena_chunk(arena, size));
+
+	ptr = arena->ptr;
+	arena->ptr += size;
+	arena->left -= size;
+	return (ptr);
+}
+
+char *
+arena_strdup(arena_t *arena, const char *str)
+{
+	return (arena_strndup(arena, str, strlen(str)));
+}
+
+char *
+arena_strndup(arena_t *arena, const char *str, size_t len)
+{
+	char *ptr;
+
+	ptr = arena_alloc(arena, len + 1);
+	memcpy(ptr, str, len);
+	ptr[len] = '\0';
+	return (ptr);
+}
+
+/*
+ * Chunks come from calloc() so that the arena never has to clear memory
+ * itself.  Requests larger than a quarter chunk get a chunk of their own and
+ * leave the current one in place.
+ */
+static void *
+arena_chunk(arena_t *arena, size_t size)
+{
+	struct arena_chunk *chunk;
+	size_t hdrlen;
+
+	hdrlen = (sizeof(struct arena_chunk) + ARENA_ALIGN - 1) &
+		~(ARENA_ALIGN - 1);
+
+	if (size > ARENA_CHUNK / 4) {
+		chunk = xcalloc(1, hdrlen + size);
+		if (arena->chunks) {
+			chunk->next = arena->chunks->next;
+			arena->chunks->next = chunk;
+		}
+		else {
+			arena->chunks = chunk;
+		}
+		return ((char *)chunk + hdrlen);
+	}
+
+	chunk = xcalloc(1, ARENA_CHUNK);
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+	arena->ptr = (char *)chunk + hdrlen + size;
+	arena->left = ARENA_CHUNK - hdrlen - size;
+	return ((char *)chunk + hdrlen);
+}
@@ -33,16 +33,181 @@
 #define _WITH_GETLINE
 #endif
 
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include <ctype.h>
 #include <err.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "arena.h"
 #include "catalog.h"
+#include "hash.h"
+#include "htab.h"
 #include "xalloc.h"
 
+/*
+ * mpkg-repo compiles the catalog into catalog.bin, which mpkg maps and
+ * searches without parsing it.  Like a compiled manifest, it records the
+ * size and modification time of the text catalog and is ignored once they
+ * no longer match.  All integers are little endian:
+ *
+ *   |=======================================================|
+ *   | Components     | Subcomponent |                  Size |
+ *   |=======================================================|
+ *   | header         | ct_bin_hdr   |                    56 |
+ *   |================|======================================|
+ *   | displacements  |              |        4 * b_nbuckets |
+ *   |================|======================================|
+ *   | entries        | ct_bin_entry |       36 * b_nentries |
+ *   |================|======================================|
+ *   | install order  | entry        |        4 * b_nentries |
+ *   |================|======================================|
+ *   | depends        | name         |           4 * b_ndeps |
+ *   |================|======================================|
+ *   | reverse deps   | entry        |          4 * b_nrdeps |
+ *   |================|======================================|
+ *   | closures       |              |   b_closuresize bytes |
+ *   |================|======================================|
+ *   | string pool    |              |      b_poolsize bytes |
+ *   |========================================================
+ *
+ * Packages are found through a minimal perfect hash ("hash and displace"):
+ * the XXH3 of a name picks a bucket, and the displacement of the bucket,
+ * mixed with the same hash, picks the entry.  Every name maps to a distinct
+ * entry, so a lookup reads one displacement and one entry and compares one
+ * name.  Names and depends are offsets into the pool, where every string is
+ * stored once; an entry's depends are a range of the depends table, and
+ * packages with the same depends share it.
+ *
+ * mpkg-repo also resolves the dependency graph once for all.  Packages are
+ * ranked so that every package comes after its depends (packages depending
+ * on each other are ranked together), and the install order table gives
+ * the entry of each rank.  The closure of a package, every package it needs
+ * directly or not, is stored as runs of consecutive ranks, each encoded as
+ * two varints: the distance from the end of the previous run and the length
+ * minus one.  Ranks keep the closure of most packages in a few runs, and
+ * walking them in order gives the order to install them in.  The reverse
+ * depends of an entry are the entries that depend on it directly.
+ */
+#define CT_BIN_MAG	"!<ctbin>"
+#define CT_BIN_VERSION	2
+#define CT_BIN_BUCKET	4	/* average names per bucket */
+#define CT_BIN_TRIES	(1U << 24)	/* displacements tried per bucket */
+#define CT_BIN_NOCLOSURE UINT32_MAX	/* e_nclosure: a depend is missing */
+
+struct ct_bin_hdr {
+	char	b_magic[8];	/* CT_BIN_MAG */
+	uint8_t	b_version[4];	/* CT_BIN_VERSION */
+	uint8_t	b_nentries[4];
+	uint8_t	b_nbuckets[4];
+	uint8_t	b_ndeps[4];
+	uint8_t	b_poolsize[4];
+	uint8_t	b_srcnsec[4];
+	uint8_t	b_srcsize[8];	/* size of the text catalog */
+	uint8_t	b_srcsec[8];	/* modification time of the text catalog */
+	uint8_t	b_nrdeps[4];
+	uint8_t	b_closuresize[4];
+} __attribute__((packed));
+
+struct ct_bin_entry {
+	uint8_t	e_name[4];
+	uint8_t	e_release[4];
+	uint8_t	e_depends[4];	/* first depend in the depends table */
+	uint8_t	e_ndepends[4];
+	uint8_t	e_rank[4];
+	uint8_t	e_rdepends[4];	/* first entry in the reverse deps table */
+	uint8_t	e_nrdepends[4];
+	uint8_t	e_closure[4];	/* offset of the closure runs */
+	uint8_t	e_nclosure[4];	/* packages in the closure */
+} __attribute__((packed));
+
+/*
+ * A catalog loaded from catalog.bin.  Entries are decoded into the arena
+ * the first time they are found.
+ */
+struct catalog_bin {
+	char		*map;
+	size_t		maplen;
+	uint32_t	nentries;
+	uint32_t	nbuckets;
+	uint32_t	ndeps;
+	uint32_t	nrdeps;
+	uint32_t	closuresize;
+	uint32_t	poolsize;
+	const uint8_t	*disp;
+	const struct ct_bin_entry *entries;
+	const uint8_t	*order;
+	const uint8_t	*deps;
+	const uint8_t	*rdeps;
+	const uint8_t	*closures;
+	const char	*pool;
+	arena_t		*arena;
+	catalog_t	**cache;
+};
+
+struct ct_pool {
+	char	*buf;
+	size_t	len;
+	size_t	cap;
+	htab_t	*strings;	/* offsets + 1, by string */
+};
+
+struct ct_run {
+	uint32_t	start;
+	uint32_t	len;
+};
+
+/*
+ * The dependency graph of the packages being compiled, by their index in
+ * the objs array of catalog_compile.
+ */
+struct ct_graph {
+	uint32_t	n;
+	uint32_t	*adjstart;	/* depends of i: adj[adjstart[i]...] */
+	uint32_t	*adj;
+	uint32_t	*rdstart;	/* reverse deps of i: rdeps[rdstart[i]...] */
+	uint32_t	*rdeps;
+	uint8_t		*missing;	/* depends missing from the catalog */
+	uint32_t	*comp;		/* strongly connected component */
+	uint32_t	ncomp;
+	uint32_t	*cstart;	/* first rank of each component */
+	uint32_t	*rank;
+	uint32_t	*byrank;
+	uint32_t	*cloff;		/* closure runs, in clbuf */
+	uint32_t	*clcount;	/* or CT_BIN_NOCLOSURE */
+	uint8_t		*clbuf;
+	size_t		cllen;
+	size_t		clcap;
+};
+
+static uint32_t	ct_bin_entry(struct catalog_bin *bin, const char *package);
+static catalog_t *ct_bin_load(const char *path);
+static catalog_t *ct_bin_obj(struct catalog_bin *bin, uint32_t slot);
+static const char *ct_bin_str(struct catalog_bin *bin, uint32_t off);
+static uint32_t	ct_get32(const uint8_t *p);
+static uint64_t	ct_get64(const uint8_t *p);
+static uint32_t	ct_getvar(const uint8_t **p, const uint8_t *end);
+static void	ct_graph(struct ct_graph *g, catalog_t **objs, uint32_t n);
+static void	ct_graph_closures(struct ct_graph *g);
+static void	ct_graph_free(struct ct_graph *g);
+static void	ct_graph_run(struct ct_graph *g, uint32_t u, uint32_t *last,
+			     uint32_t start, uint32_t end);
+static void	ct_graph_ranks(struct ct_graph *g);
+static uint64_t	ct_mix(uint64_t hash, uint32_t disp);
+static uint32_t	ct_pool_add(struct ct_pool *pool, const char *str);
+static void	ct_put32(uint8_t *p, uint32_t val);
+static void	ct_put64(uint8_t *p, uint64_t val);
+static void	ct_putvar(struct ct_graph *g, uint32_t val);
+static int	ct_run_cmp(const void *a, const void *b);
+
 catalog_t *
 catalog_new(void)
 {
@@ -58,6 +223,14 @@ catalog_free(catalog_t *catalog)
 	catalog_t *obj;
 	int idx;
 
+	if (catalog && catalog->bin) {
+		munmap(catalog->bin->map, catalog->bin->maplen);
+		arena_free(catalog->bin->arena);
+		free(catalog->bin->cache);
+		free(catalog->bin);
+	}
+	if (catalog)
+		htab_free(catalog->index);
 	while (catalog) {
 		obj = catalog;
 
@@ -76,12 +249,18 @@ void
 catalog_emit(catalog_t *catalog, const char *path)
 {
 	FILE *fp;
-	char outfile[PATH_MAX];
-	int idx;
+	char outfile[PATH_MAX], tmp[PATH_MAX];
+	int fd, idx;
 
+	/* mpkg may be reading the catalog while it is replaced */
 	snprintf(outfile, PATH_MAX, "%s/catalog", path);
-	if (!(fp = fopen(outfile, "w")))
-		err(1, "fopen: %s", outfile);
+	snprintf(tmp, PATH_MAX, "%s/catalog.XXXXXX", path);
+	if ((fd = mkstemp(tmp)) == -1)
+		err(1, "mkstemp: %s", tmp);
+	if (fchmod(fd, 0644) == -1)
+		err(1, "fchmod: %s", tmp);
+	if (!(fp = fdopen(fd, "w")))
+		err(1, "fdopen: %s", tmp);
 
 	fprintf(fp,
 		"#\n"
@@ -106,24 +285,254 @@ catalog_emit(catalog_t *catalog, const char *path)
 		catalog = catalog->next;
 	}
 
-	fclose(fp);
+	if (fclose(fp) == EOF)
+		err(1, "write: %s", tmp);
+	if (rename(tmp, outfile) == -1)
+		err(1, "rename: %s", outfile);
 }
 
+/*
+ * Compile catalog, as emitted to <path>/catalog, into <path>/catalog.bin.
+ * The file is replaced atomically.  A package listed twice keeps its first
+ * entry, as catalog_find would.
+ */
+void
+catalog_compile(catalog_t *catalog, const char *path)
+{
+	arena_t *arena;
+	catalog_t *obj, **objs;
+	char bin[PATH_MAX], infile[PATH_MAX], tmp[PATH_MAX], *key;
+	int fd;
+	htab_t *lists, *names;
+	size_t keylen, len;
+	struct ct_bin_hdr *hdr;
+	struct ct_bin_entry *entry;
+	struct ct_graph g;
+	struct ct_pool pool;
+	struct stat sb;
+	uint32_t *bucket, *count, *disp, *order, *slot, *start;
+	uint32_t b, d, depidx, idx, idx1, maxlen, n, nbuckets, ndeps, nobjs;
+	uint64_t *hashes;
+	uint8_t *buf, *deps, *taken, *tables;
+	uintptr_t list;
+
+	snprintf(infile, PATH_MAX, "%s/catalog", path);
+	if (stat(infile, &sb) == -1)
+		err(1, "%s", infile);
+	if (catalog && catalog->bin)
+		errx(1, "%s: cannot compile a compiled catalog", infile);
+
+	/* the keys of the perfect hash must be unique */
+	names = htab_new();
+	objs = NULL;
+	nobjs = 0;
+	for (obj = catalog; obj; obj = obj->next) {
+		if (!obj->package || htab_find(names, obj->package))
+			continue;
+		htab_insert(names, obj->package, obj);
+		objs = xrealloc(objs, (nobjs + 1) * sizeof(catalog_t *));
+		objs[nobjs++] = obj;
+	}
+	htab_free(names);
+
+	n = nobjs;
+	nbuckets = n ? (n + CT_BIN_BUCKET - 1) / CT_BIN_BUCKET : 0;
+	hashes = xcalloc(n + 1, sizeof(uint64_t));
+	bucket = xcalloc(n + 1, sizeof(uint32_t));
+	count = xcalloc(nbuckets + 1, sizeof(uint32_t));
+	start = xcalloc(nbuckets + 1, sizeof(uint32_t));
+	order = xcalloc(n + 1, sizeof(uint32_t));
+	disp = xcalloc(nbuckets + 1, sizeof(uint32_t));
+	slot = xcalloc(n + 1, sizeof(uint32_t));
+	taken = xcalloc(n + 1, 1);
+
+	/* group the names by bucket */
+	for (idx = 0; idx < n; ++idx) {
+		hashes[idx] = hash_data(objs[idx]->package,
+					strlen(objs[idx]->package));
+		bucket[idx] = (uint32_t)(hashes[idx] >> 32) % nbuckets;
+		++count[bucket[idx]];
+	}
+	for (maxlen = 0, b = 0; b < nbuckets; ++b) {
+		if (b)
+			start[b] = start[b-1] + count[b-1];
+		if (count[b] > maxlen)
+			maxlen = count[b];
+	}
+	for (idx = 0; idx < n; ++idx)
+		order[start[bucket[idx]]++] = idx;
+	for (b = 0; b < nbuckets; ++b)
+		start[b] -= count[b];
+
+	/*
+	 * Place the largest buckets first, while the table is still mostly
+	 * empty; the many buckets of one name go last and always fit.
+	 */
+	for (len = maxlen; len > 0; --len) {
+		for (b = 0; b < nbuckets; ++b) {
+			if (count[b] != len)
+				continue;
+			for (d = 0; d < CT_BIN_TRIES; ++d) {
+				for (idx = 0; idx < len; ++idx) {
+					idx1 = order[start[b] + idx];
+					slot[idx1] = (uint32_t)
+						(ct_mix(hashes[idx1], d) % n);
+					if (taken[slot[idx1]])
+						break;
+					taken[slot[idx1]] = 1;
+				}
+				if (idx == len)
+					break;
+				while (idx-- > 0)
+					taken[slot[order[start[b] + idx]]] = 0;
+			}
+			if (d == CT_BIN_TRIES)
+				errx(1, "%s: cannot build the perfect hash",
+				     infile);
+			disp[b] = d;
+		}
+	}
+
+	ct_graph(&g, objs, n);
+
+	/* depends lists are interned by their joined names */
+	arena = arena_new();
+	lists = htab_new();
+	deps = NULL;
+	ndeps = 0;
+	memset(&pool, 0, sizeof(pool));
+	pool.strings = htab_new();
+
+	len = sizeof(*hdr) + 4 * (size_t)nbuckets +
+		sizeof(*entry) * (size_t)n;
+	buf = xcalloc(1, len);
+	for (idx = 0; idx < nbuckets; ++idx)
+		ct_put32(buf + sizeof(*hdr) + 4 * idx, disp[idx]);
+
+	for (idx = 0; idx < n; ++idx) {
+		obj = objs[idx];
+		entry = (struct ct_bin_entry *)(buf + sizeof(*hdr) +
+						4 * nbuckets) + slot[idx];
+		ct_put32(entry->e_name, ct_pool_add(&pool, obj->package));
+		ct_put32(entry->e_release, (uint32_t)obj->release);
+		ct_put32(entry->e_rank, g.rank[idx]);
+		ct_put32(entry->e_rdepends, g.rdstart[idx]);
+		ct_put32(entry->e_nrdepends, g.rdstart[idx+1] - g.rdstart[idx]);
+		ct_put32(entry->e_closure, g.cloff[idx]);
+		ct_put32(entry->e_nclosure, g.clcount[idx]);
+		if (!obj->depends || !*obj->depends)
+			continue;
+
+		for (keylen = 0, idx1 = 0; obj->depends[idx1]; ++idx1)
+			keylen += strlen(obj->depends[idx1]) + 1;
+		key = arena_alloc(arena, keylen);
+		for (keylen = 0, idx1 = 0; obj->depends[idx1]; ++idx1) {
+			strcpy(key + keylen, obj->depends[idx1]);
+			keylen += strlen(obj->depends[idx1]);
+			key[keylen++] = ',';
+		}
+		key[keylen-1] = '\0';
+
+		if ((list = (uintptr_t)htab_find(lists, key))) {
+			depidx = (uint32_t)(list - 1);
+		} else {
+			depidx = ndeps;
+			htab_insert(lists, key, (void *)(uintptr_t)(depidx + 1));
+			deps = xrealloc(deps, 4 * ((size_t)ndeps + idx1));
+			for (d = 0; d < idx1; ++d)
+				ct_put32(deps + 4 * ndeps++,
+					 ct_pool_add(&pool, obj->depends[d]));
+		}
+		ct_put32(entry->e_depends, depidx);
+		ct_put32(entry->e_ndepends, idx1);
+	}
+	if (pool.len > UINT32_MAX || g.cllen > UINT32_MAX)
+		errx(1, "%s: catalog too large", infile);
+
+	/* the tables of the graph refer to entries by slot */
+	tables = xcalloc((size_t)n + g.rdstart[n] + 1, 4);
+	for (idx = 0; idx < n; ++idx)
+		ct_put32(tables + 4 * (size_t)idx, slot[g.byrank[idx]]);
+	for (idx = 0; idx < g.rdstart[n]; ++idx)
+		ct_put32(tables + 4 * ((size_t)n + idx), slot[g.rdeps[idx]]);
+
+	hdr = (struct ct_bin_hdr *)buf;
+	memcpy(hdr->b_magic, CT_BIN_MAG, sizeof(hdr->b_magic));
+	ct_put32(hdr->b_version, CT_BIN_VERSION);
+	ct_put32(hdr->b_nentries, n);
+	ct_put32(hdr->b_nbuckets, nbuckets);
+	ct_put32(hdr->b_ndeps, ndeps);
+	ct_put32(hdr->b_poolsize, (uint32_t)pool.len);
+	ct_put32(hdr->b_srcnsec, (uint32_t)sb.st_mtim.tv_nsec);
+	ct_put64(hdr->b_srcsize, (uint64_t)sb.st_size);
+	ct_put64(hdr->b_srcsec, (uint64_t)sb.st_mtim.tv_sec);
+	ct_put32(hdr->b_nrdeps, g.rdstart[n]);
+	ct_put32(hdr->b_closuresize, (uint32_t)g.cllen);
+
+	snprintf(bin, PATH_MAX, "%s/catalog.bin", path);
+	snprintf(tmp, PATH_MAX, "%s/catalog.bin.XXXXXX", path);
+	if ((fd = mkstemp(tmp)) == -1)
+		err(1, "mkstemp: %s", tmp);
+	if (fchmod(fd, 0644) == -1)
+		err(1, "fchmod: %s", tmp);
+	if (write(fd, buf, len) != (ssize_t)len ||
+	    (n && write(fd, tables, 4 * (size_t)n) != (ssize_t)(4 * n)) ||
+	    (ndeps &&
+	     write(fd, deps, 4 * (size_t)ndeps) != (ssize_t)(4 * ndeps)) ||
+	    (g.rdstart[n] &&
+	     write(fd, tables + 4 * (size_t)n, 4 * (size_t)g.rdstart[n]) !=
+	     (ssize_t)(4 * (size_t)g.rdstart[n])) ||
+	    (g.cllen &&
+	     write(fd, g.clbuf, g.cllen) != (ssize_t)g.cllen) ||
+	    (pool.len &&
+	     write(fd, pool.buf, pool.len) != (ssize_t)pool.len))
+		err(1, "write: %s", tmp);
+	if (close(fd) == -1)
+		err(1, "close: %s", tmp);
+	if (rename(tmp, bin) == -1)
+		err(1, "rename: %s", bin);
+
+	ct_graph_free(&g);
+	free(tables);
+	htab_free(pool.strings);
+	free(pool.buf);
+	htab_free(lists);
+	arena_free(arena);
+	free(deps);
+	free(buf);
+	free(taken);
+	free(slot);
+	free(disp);
+	free(order);
+	free(start);
+	free(count);
+	free(bucket);
+	free(hashes);
+	free(objs);
+}
+
+/*
+ * A fresh catalog.bin is used when there is one.  The catalog then holds
+ * no package itself and can only be searched with catalog_find.
+ */
 catalog_t *
 catalog_parse(const char *path)
 {
 	FILE *fp;
-	catalog_t *catalog, *obj, *tmp;
-	char *line, *myline, *myline1, *s;
+	catalog_t *catalog, *last, *obj;
+	char *dep, *line, *myline, *myline1, *s;
 	char infile[PATH_MAX];
 	size_t idx, idx1, linecap, lineno;
 	ssize_t linelen;
 
+	if ((catalog = ct_bin_load(path)))
+		return (catalog);
+
 	snprintf(infile, PATH_MAX, "%s/catalog", path);
 	if (!(fp = fopen(infile, "r")))
 		err(1, "fopen: %s", infile);
 
-	catalog = NULL; line = NULL;
+	catalog = last = NULL; line = NULL;
 	linecap = lineno = 0;
 	while ((linelen = getline(&line, &linecap, fp)) > 0) {
 		++lineno;
@@ -146,27 +555,30 @@ catalog_parse(const char *path)
 				obj->release =
 					(int)strtol(s, (char **)NULL, 10);
 			if (idx == 2) {
+				s[strcspn(s, "\n")] = '\0';
 				obj->depends = xcalloc(1, sizeof(char *));
 				idx1 = 1;
-				while ((s = strsep(&s, ","))) {
+				while ((dep = strsep(&s, ","))) {
 					obj->depends =
 						xrealloc(obj->depends,
 							 (idx1 + 1) *
 							 sizeof(char *));
 					obj->depends[idx1] = NULL;
-					obj->depends[idx1 - 1] = xstrdup(s);
+					obj->depends[idx1 - 1] = xstrdup(dep);
 					++idx1;
 				}
 			}
 		}
 
-		if (!catalog)
+		if (!catalog) {
 			catalog = obj;
-		else {
-			for (tmp = catalog; tmp->next; /* void */)
-				tmp = tmp->next;
-			tmp->next = obj;
+			catalog->index = htab_new();
 		}
+		else
+			last->next = obj;
+		last = obj;
+		if (obj->package)
+			htab_insert(catalog->index, obj->package, obj);
 
 	next:
 		free(myline1);
@@ -176,11 +588,21 @@ catalog_parse(const char *path)
 	return (catalog);
 }
 
+/*
+ * Catalogs read by catalog_parse are indexed or compiled, those built by
+ * hand are scanned.
+ */
 catalog_t *
 catalog_find(catalog_t *catalog, const char *package)
 {
 	catalog_t *obj;
 
+	if (catalog && catalog->bin)
+		return (ct_bin_obj(catalog->bin,
+				   ct_bin_entry(catalog->bin, package)));
+	if (catalog && catalog->index)
+		return (htab_find(catalog->index, package));
+
 	for (obj = catalog; obj; /* void */) {
 		if (!strcmp(obj->package, package))
 			return (obj);
@@ -188,3 +610,628 @@ catalog_find(catalog_t *catalog, const char *package)
 	}
 	return (NULL);
 }
+
+/*
+ * The packages package needs, directly or not, in the order to install
+ * them, as a NULL terminated array to free.  NULL if the catalog was not
+ * compiled or one of them is missing from it.
+ */
+catalog_t **
+catalog_closure(catalog_t *catalog, const char *package)
+{
+	catalog_t **closure;
+	const struct ct_bin_entry *entry;
+	const uint8_t *end, *p;
+	struct catalog_bin *bin;
+	uint32_t count, idx, len, off, rank, slot;
+
+	if (!catalog || !(bin = catalog->bin) ||
+	    (slot = ct_bin_entry(bin, package)) == UINT32_MAX)
+		return (NULL);
+	entry = &bin->entries[slot];
+	if ((count = ct_get32(entry->e_nclosure)) == CT_BIN_NOCLOSURE)
+		return (NULL);
+	if (count >= bin->nentries ||
+	    (off = ct_get32(entry->e_closure)) > bin->closuresize)
+		errx(1, "catalog.bin: corrupt entry: %s", package);
+
+	closure = xcalloc((size_t)count + 1, sizeof(catalog_t *));
+	p = bin->closures + off;
+	end = bin->closures + bin->closuresize;
+	for (idx = 0, rank = 0; idx < count; /* void */) {
+		rank += ct_getvar(&p, end);
+		len = ct_getvar(&p, end) + 1;
+		if (len > count - idx || rank >= bin->nentries ||
+		    len > bin->nentries - rank)
+			errx(1, "catalog.bin: corrupt closure: %s", package);
+		while (len-- > 0)
+			closure[idx++] = ct_bin_obj(bin,
+			    ct_get32(bin->order + 4 * (size_t)rank++));
+	}
+	return (closure);
+}
+
+/*
+ * The packages that depend on package directly, as a NULL terminated array
+ * to free.  NULL if the catalog was not compiled or has no such package.
+ */
+catalog_t **
+catalog_rdepends(catalog_t *catalog, const char *package)
+{
+	catalog_t **rdepends;
+	const struct ct_bin_entry *entry;
+	struct catalog_bin *bin;
+	uint32_t count, first, idx, slot;
+
+	if (!catalog || !(bin = catalog->bin) ||
+	    (slot = ct_bin_entry(bin, package)) == UINT32_MAX)
+		return (NULL);
+	entry = &bin->entries[slot];
+	first = ct_get32(entry->e_rdepends);
+	count = ct_get32(entry->e_nrdepends);
+	if (first > bin->nrdeps || count > bin->nrdeps - first)
+		errx(1, "catalog.bin: corrupt entry: %s", package);
+
+	rdepends = xcalloc((size_t)count + 1, sizeof(catalog_t *));
+	for (idx = 0; idx < count; ++idx)
+		rdepends[idx] = ct_bin_obj(bin,
+		    ct_get32(bin->rdeps + 4 * ((size_t)first + idx)));
+	return (rdepends);
+}
+
+/*
+ * The slot of package in catalog.bin, or UINT32_MAX.
+ */
+static uint32_t
+ct_bin_entry(struct catalog_bin *bin, const char *package)
+{
+	const struct ct_bin_entry *entry;
+	uint32_t b, d, slot;
+	uint64_t hash;
+
+	if (!bin->nentries)
+		return (UINT32_MAX);
+
+	hash = hash_data(package, strlen(package));
+	b = (uint32_t)(hash >> 32) % bin->nbuckets;
+	d = ct_get32(bin->disp + 4 * (size_t)b);
+	slot = (uint32_t)(ct_mix(hash, d) % bin->nentries);
+	entry = &bin->entries[slot];
+
+	/* names missing from the catalog land on some other entry */
+	if (strcmp(ct_bin_str(bin, ct_get32(entry->e_name)), package))
+		return (UINT32_MAX);
+	return (slot);
+}
+
+/*
+ * Map <path>/catalog.bin if it was compiled from the text catalog as it is
+ * now, NULL otherwise.  Only the header and the sizes are checked here,
+ * entries are checked as they are found.
+ */
+static catalog_t *
+ct_bin_load(const char *path)
+{
+	catalog_t *catalog;
+	char bin[PATH_MAX], infile[PATH_MAX], *map;
+	int fd;
+	struct catalog_bin *cb;
+	const struct ct_bin_hdr *hdr;
+	struct stat bsb, sb;
+	uint32_t closuresize, nbuckets, ndeps, nentries, nrdeps, poolsize;
+	uint64_t len;
+
+	snprintf(infile, PATH_MAX, "%s/catalog", path);
+	snprintf(bin, PATH_MAX, "%s/catalog.bin", path);
+	if (stat(infile, &sb) == -1)
+		return (NULL);
+	if ((fd = open(bin, O_RDONLY|O_CLOEXEC)) == -1)
+		return (NULL);
+	if (fstat(fd, &bsb) == -1 || bsb.st_size < (off_t)sizeof(*hdr)) {
+		close(fd);
+		return (NULL);
+	}
+	map = mmap(NULL, (size_t)bsb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return (NULL);
+
+	hdr = (const struct ct_bin_hdr *)map;
+	nentries = ct_get32(hdr->b_nentries);
+	nbuckets = ct_get32(hdr->b_nbuckets);
+	ndeps = ct_get32(hdr->b_ndeps);
+	nrdeps = ct_get32(hdr->b_nrdeps);
+	closuresize = ct_get32(hdr->b_closuresize);
+	poolsize = ct_get32(hdr->b_poolsize);
+	len = sizeof(*hdr) + 4 * (uint64_t)nbuckets +
+		(sizeof(struct ct_bin_entry) + 4) * (uint64_t)nentries +
+		4 * (uint64_t)ndeps + 4 * (uint64_t)nrdeps + closuresize +
+		poolsize;
+
+	if (memcmp(hdr->b_magic, CT_BIN_MAG, sizeof(hdr->b_magic)) ||
+	    ct_get32(hdr->b_version) != CT_BIN_VERSION ||
+	    ct_get64(hdr->b_srcsize) != (uint64_t)sb.st_size ||
+	    ct_get64(hdr->b_srcsec) != (uint64_t)sb.st_mtim.tv_sec ||
+	    ct_get32(hdr->b_srcnsec) != (uint32_t)sb.st_mtim.tv_nsec ||
+	    len != (uint64_t)bsb.st_size ||
+	    (nentries && (!nbuckets || !poolsize)) ||
+	    (poolsize && map[len - 1] != '\0')) {
+		munmap(map, (size_t)bsb.st_size);
+		return (NULL);
+	}
+
+	cb = xcalloc(1, sizeof(struct catalog_bin));
+	cb->map = map;
+	cb->maplen = (size_t)bsb.st_size;
+	cb->nentries = nentries;
+	cb->nbuckets = nbuckets;
+	cb->ndeps = ndeps;
+	cb->nrdeps = nrdeps;
+	cb->closuresize = closuresize;
+	cb->poolsize = poolsize;
+	cb->disp = (const uint8_t *)map + sizeof(*hdr);
+	cb->entries = (const struct ct_bin_entry *)(cb->disp + 4 *
+						    (size_t)nbuckets);
+	cb->order = (const uint8_t *)(cb->entries + nentries);
+	cb->deps = cb->order + 4 * (size_t)nentries;
+	cb->rdeps = cb->deps + 4 * (size_t)ndeps;
+	cb->closures = cb->rdeps + 4 * (size_t)nrdeps;
+	cb->pool = (const char *)(cb->closures + closuresize);
+	cb->arena = arena_new();
+	/* untouched pages of a large calloc cost nothing */
+	cb->cache = xcalloc((size_t)nentries + 1, sizeof(catalog_t *));
+
+	catalog = xcalloc(1, sizeof(catalog_t));
+	catalog->bin = cb;
+	return (catalog);
+}
+
+/*
+ * Decode the entry in slot, NULL for UINT32_MAX.
+ */
+static catalog_t *
+ct_bin_obj(struct catalog_bin *bin, uint32_t slot)
+{
+	catalog_t *obj;
+	const struct ct_bin_entry *entry;
+	uint32_t depidx, idx, ndepends;
+
+	if (slot == UINT32_MAX)
+		return (NULL);
+	if (slot >= bin->nentries)
+		errx(1, "catalog.bin: corrupt entry number %u", slot);
+	if ((obj = bin->cache[slot]))
+		return (obj);
+
+	entry = &bin->entries[slot];
+	obj = arena_alloc(bin->arena, sizeof(catalog_t));
+	obj->package = (char *)ct_bin_str(bin, ct_get32(entry->e_name));
+	obj->release = (int)ct_get32(entry->e_release);
+	depidx = ct_get32(entry->e_depends);
+	ndepends = ct_get32(entry->e_ndepends);
+	if (ndepends) {
+		if (depidx > bin->ndeps || ndepends > bin->ndeps - depidx)
+			errx(1, "catalog.bin: corrupt entry: %s", obj->package);
+		obj->depends = arena_alloc(bin->arena,
+					   (ndepends + 1) * sizeof(char *));
+		for (idx = 0; idx < ndepends; ++idx)
+			obj->depends[idx] = (char *)ct_bin_str(bin,
+			    ct_get32(bin->deps + 4 * ((size_t)depidx + idx)));
+	}
+	bin->cache[slot] = obj;
+	return (obj);
+}
+
+static const char *
+ct_bin_str(struct catalog_bin *bin, uint32_t off)
+{
+	if (off >= bin->poolsize)
+		errx(1, "catalog.bin: corrupt string offset %u", off);
+	return (bin->pool + off);
+}
+
+static uint32_t
+ct_get32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+		(uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+}
+
+static uint64_t
+ct_get64(const uint8_t *p)
+{
+	return ((uint64_t)ct_get32(p) | (uint64_t)ct_get32(p + 4) << 32);
+}
+
+static uint32_t
+ct_getvar(const uint8_t **p, const uint8_t *end)
+{
+	int shift;
+	uint64_t val;
+
+	for (val = 0, shift = 0; *p < end && shift < 35; shift += 7) {
+		val |= (uint64_t)(**p & 0x7f) << shift;
+		if (!(*(*p)++ & 0x80)) {
+			if (val > UINT32_MAX)
+				break;
+			return ((uint32_t)val);
+		}
+	}
+	errx(1, "catalog.bin: corrupt closure");
+}
+
+/*
+ * Build the dependency graph of objs and resolve it.  Depends listed twice
+ * and packages depending on themselves count once and not at all.
+ */
+static void
+ct_graph(struct ct_graph *g, catalog_t **objs, uint32_t n)
+{
+	htab_t *names;
+	size_t adjcap;
+	uint32_t *cursor, *mark, dep, idx, idx1;
+	uintptr_t found;
+
+	memset(g, 0, sizeof(*g));
+	g->n = n;
+	g->adjstart = xcalloc((size_t)n + 1, sizeof(uint32_t));
+	g->rdstart = xcalloc((size_t)n + 1, sizeof(uint32_t));
+	g->missing = xcalloc((size_t)n + 1, 1);
+	mark = xcalloc((size_t)n + 1, sizeof(uint32_t));
+
+	names = htab_new();
+	for (idx = 0; idx < n; ++idx)
+		htab_insert(names, objs[idx]->package,
+			    (void *)(uintptr_t)(idx + 1));
+
+	adjcap = 0;
+	for (idx = 0; idx < n; ++idx) {
+		g->adjstart[idx] = g->adjstart[n];
+		for (idx1 = 0; objs[idx]->depends &&
+			     objs[idx]->depends[idx1]; ++idx1) {
+			found = (uintptr_t)htab_find(names,
+						     objs[idx]->depends[idx1]);
+			if (!found) {
+				g->missing[idx] = 1;
+				continue;
+			}
+			dep = (uint32_t)(found - 1);
+			if (dep == idx || mark[dep] == idx + 1)
+				continue;
+			mark[dep] = idx + 1;
+
+			if (g->adjstart[n] == adjcap) {
+				adjcap = adjcap ? adjcap * 2 : 1024;
+				g->adj = xrealloc(g->adj,
+						  adjcap * sizeof(uint32_t));
+			}
+			g->adj[g->adjstart[n]++] = dep;
+			++g->rdstart[dep];
+		}
+	}
+	htab_free(names);
+
+	/* count, then place the reverse deps */
+	for (idx = 0, idx1 = 0; idx < n; ++idx) {
+		dep = g->rdstart[idx];
+		g->rdstart[idx] = idx1;
+		idx1 += dep;
+	}
+	g->rdstart[n] = idx1;
+	g->rdeps = xcalloc((size_t)idx1 + 1, sizeof(uint32_t));
+	cursor = mark;
+	memcpy(cursor, g->rdstart, (size_t)n * sizeof(uint32_t));
+	for (idx = 0; idx < n; ++idx)
+		for (idx1 = g->adjstart[idx]; idx1 < g->adjstart[idx+1];
+		     ++idx1)
+			g->rdeps[cursor[g->adj[idx1]]++] = idx;
+	free(mark);
+
+	ct_graph_ranks(g);
+	ct_graph_closures(g);
+}
+
+/*
+ * Compute the closure of every component as runs of ranks, from the
+ * components every other one depends on up, and encode it for each of its
+ * packages, leaving the package itself out.
+ */
+static void
+ct_graph_closures(struct ct_graph *g)
+{
+	int missing;
+	size_t nruns, runcap, tmpcap;
+	struct ct_run *runs, *tmp;
+	uint32_t *mark, *roff, *rcount, c, count, edge, k, last, r, u;
+	uint32_t run, start, end;
+
+	g->cloff = xcalloc((size_t)g->n + 1, sizeof(uint32_t));
+	g->clcount = xcalloc((size_t)g->n + 1, sizeof(uint32_t));
+	roff = xcalloc((size_t)g->ncomp + 1, sizeof(uint32_t));
+	rcount = xcalloc((size_t)g->ncomp + 1, sizeof(uint32_t));
+	mark = xcalloc((size_t)g->ncomp + 1, sizeof(uint32_t));
+	runs = tmp = NULL;
+	nruns = runcap = tmpcap = 0;
+
+	for (c = 0; c < g->ncomp; ++c) {
+		/* the members of c, then the closures of what they need */
+		count = 0;
+		missing = 0;
+		if (!tmpcap) {
+			tmpcap = 1024;
+			tmp = xrealloc(tmp, tmpcap * sizeof(struct ct_run));
+		}
+		tmp[count].start = g->cstart[c];
+		tmp[count++].len = g->cstart[c+1] - g->cstart[c];
+		for (r = g->cstart[c]; r < g->cstart[c+1]; ++r) {
+			u = g->byrank[r];
+			missing |= g->missing[u];
+			for (edge = g->adjstart[u]; edge < g->adjstart[u+1];
+			     ++edge) {
+				k = g->comp[g->adj[edge]];
+				if (k == c || mark[k] == c + 1)
+					continue;
+				mark[k] = c + 1;
+				if (rcount[k] == CT_BIN_NOCLOSURE) {
+					missing = 1;
+					continue;
+				}
+				if (count + rcount[k] > tmpcap) {
+					tmpcap = (count + rcount[k]) * 2;
+					tmp = xrealloc(tmp, tmpcap *
+						       sizeof(struct ct_run));
+				}
+				memcpy(tmp + count, runs + roff[k],
+				       rcount[k] * sizeof(struct ct_run));
+				count += rcount[k];
+			}
+		}
+		if (missing) {
+			rcount[c] = CT_BIN_NOCLOSURE;
+			continue;
+		}
+
+		/* merge the runs */
+		qsort(tmp, count, sizeof(struct ct_run), ct_run_cmp);
+		if (nruns + count > runcap) {
+			runcap = (nruns + count) * 2;
+			runs = xrealloc(runs, runcap * sizeof(struct ct_run));
+		}
+		roff[c] = (uint32_t)nruns;
+		for (run = 0; run < count; ++run) {
+			end = tmp[run].start + tmp[run].len;
+			if (nruns > roff[c] && tmp[run].start <=
+			    runs[nruns-1].start + runs[nruns-1].len) {
+				start = runs[nruns-1].start;
+				if (end > start + runs[nruns-1].len)
+					runs[nruns-1].len = end - start;
+				continue;
+			}
+			runs[nruns++] = tmp[run];
+		}
+		rcount[c] = (uint32_t)(nruns - roff[c]);
+	}
+
+	for (u = 0; u < g->n; ++u) {
+		c = g->comp[u];
+		if (rcount[c] == CT_BIN_NOCLOSURE) {
+			g->clcount[u] = CT_BIN_NOCLOSURE;
+			continue;
+		}
+		g->cloff[u] = (uint32_t)g->cllen;
+		last = 0;
+		for (run = roff[c]; run < roff[c] + rcount[c]; ++run) {
+			start = runs[run].start;
+			end = start + runs[run].len;
+			/* u splits the run it falls in */
+			if (g->rank[u] >= start && g->rank[u] < end) {
+				if (g->rank[u] > start)
+					ct_graph_run(g, u, &last, start,
+						     g->rank[u]);
+				start = g->rank[u] + 1;
+			}
+			if (start < end)
+				ct_graph_run(g, u, &last, start, end);
+		}
+	}
+
+	free(tmp);
+	free(runs);
+	free(mark);
+	free(rcount);
+	free(roff);
+}
+
+static void
+ct_graph_free(struct ct_graph *g)
+{
+	free(g->adjstart);
+	free(g->adj);
+	free(g->rdstart);
+	free(g->rdeps);
+	free(g->missing);
+	free(g->comp);
+	free(g->cstart);
+	free(g->rank);
+	free(g->byrank);
+	free(g->cloff);
+	free(g->clcount);
+	free(g->clbuf);
+}
+
+/*
+ * Find the strongly connected components of the graph (Tarjan's algorithm,
+ * without recursion).  They are found depends first, and ranking their
+ * packages in that order puts every package after what it depends on.
+ */
+static void
+ct_graph_ranks(struct ct_graph *g)
+{
+	uint32_t *calls, *index, *low, *pos, *stack;
+	uint32_t counter, idx, ncalls, nstack, s, v, w;
+	uint8_t *onstack;
+
+	g->comp = xcalloc((size_t)g->n + 1, sizeof(uint32_t));
+	index = xcalloc((size_t)g->n + 1, sizeof(uint32_t));
+	low = xcalloc((size_t)g->n + 1, sizeof(uint32_t));
+	calls = xcalloc((size_t)g->n + 1, sizeof(uint32_t));
+	pos = xcalloc((size_t)g->n + 1, sizeof(uint32_t));
+	stack = xcalloc((size_t)g->n + 1, sizeof(uint32_t));
+	onstack = xcalloc((size_t)g->n + 1, 1);
+
+	counter = nstack = 0;
+	for (s = 0; s < g->n; ++s) {
+		if (index[s])
+			continue;
+
+		ncalls = 0;
+		w = s;
+		goto visit;
+		while (ncalls) {
+			v = calls[ncalls-1];
+			if (pos[ncalls-1] < g->adjstart[v+1]) {
+				w = g->adj[pos[ncalls-1]++];
+				if (!index[w])
+					goto visit;
+				if (onstack[w] && index[w] < low[v])
+					low[v] = index[w];
+				continue;
+			}
+
+			--ncalls;
+			if (low[v] == index[v]) {
+				do {
+					w = stack[--nstack];
+					onstack[w] = 0;
+					g->comp[w] = g->ncomp;
+				} while (w != v);
+				++g->ncomp;
+			}
+			if (ncalls && low[v] < low[calls[ncalls-1]])
+				low[calls[ncalls-1]] = low[v];
+			continue;
+visit:
+			index[w] = low[w] = ++counter;
+			stack[nstack++] = w;
+			onstack[w] = 1;
+			calls[ncalls] = w;
+			pos[ncalls++] = g->adjstart[w];
+		}
+	}
+
+	/* rank the packages component by component */
+	g->cstart = xcalloc((size_t)g->ncomp + 1, sizeof(uint32_t));
+	g->rank = xcalloc((size_t)g->n + 1, sizeof(uint32_t));
+	g->byrank = xcalloc((size_t)g->n + 1, sizeof(uint32_t));
+	for (idx = 0; idx < g->n; ++idx)
+		++g->cstart[g->comp[idx] + 1];
+	for (idx = 0; idx < g->ncomp; ++idx)
+		g->cstart[idx+1] += g->cstart[idx];
+	memcpy(pos, g->cstart, (size_t)g->ncomp * sizeof(uint32_t));
+	for (idx = 0; idx < g->n; ++idx) {
+		g->rank[idx] = pos[g->comp[idx]]++;
+		g->byrank[g->rank[idx]] = idx;
+	}
+
+	free(onstack);
+	free(stack);
+	free(pos);
+	free(calls);
+	free(low);
+	free(index);
+}
+
+/*
+ * Append the ranks [start, end) to the closure of u.
+ */
+static void
+ct_graph_run(struct ct_graph *g, uint32_t u, uint32_t *last, uint32_t start,
+	     uint32_t end)
+{
+	ct_putvar(g, start - *last);
+	ct_putvar(g, end - start - 1);
+	g->clcount[u] += end - start;
+	*last = end;
+}
+
+/*
+ * Spread a name hash and a displacement over 64 bits (the splitmix64
+ * finalizer), so that each displacement gives an unrelated slot.
+ */
+static uint64_t
+ct_mix(uint64_t hash, uint32_t disp)
+{
+	hash += (uint64_t)disp * 0x9e3779b97f4a7c15ULL;
+	hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+	return (hash ^ (hash >> 31));
+}
+
+/*
+ * Append str to the string pool unless it is already there, and return
+ * its offset.
+ */
+static uint32_t
+ct_pool_add(struct ct_pool *pool, const char *str)
+{
+	size_t len, off;
+	uintptr_t found;
+
+	if ((found = (uintptr_t)htab_find(pool->strings, str)))
+		return ((uint32_t)(found - 1));
+
+	len = strlen(str) + 1;
+	off = pool->len;
+	if (off + len > pool->cap) {
+		pool->cap = pool->cap ? pool->cap * 2 : 4096;
+		if (pool->cap < off + len)
+			pool->cap = off + len;
+		pool->buf = xrealloc(pool->buf, pool->cap);
+	}
+	memcpy(pool->buf + off, str, len);
+	pool->len += len;
+	/* the key must outlive the table, str does */
+	htab_insert(pool->strings, str, (void *)(uintptr_t)(off + 1));
+	/* offsets past UINT32_MAX are caught by catalog_compile */
+	return ((uint32_t)off);
+}
+
+static void
+ct_put32(uint8_t *p, uint32_t val)
+{
+	p[0] = val & 0xff;
+	p[1] = (val >> 8) & 0xff;
+	p[2] = (val >> 16) & 0xff;
+	p[3] = (val >> 24) & 0xff;
+}
+
+static void
+ct_put64(uint8_t *p, uint64_t val)
+{
+	ct_put32(p, (uint32_t)val);
+	ct_put32(p + 4, (uint32_t)(val >> 32));
+}
+
+static void
+ct_putvar(struct ct_graph *g, uint32_t val)
+{
+	if (g->cllen + 5 > g->clcap) {
+		g->clcap = g->clcap ? g->clcap * 2 : 4096;
+		g->clbuf = xrealloc(g->clbuf, g->clcap);
+	}
+	while (val >= 0x80) {
+		g->clbuf[g->cllen++] = (uint8_t)(val | 0x80);
+		val >>= 7;
+	}
+	g->clbuf[g->cllen++] = (uint8_t)val;
+}
+
+static int
+ct_run_cmp(const void *a, const void *b)
+{
+	const struct ct_run *ra = a, *rb = b;
+
+	if (ra->start != rb->start)
+		return (ra->start < rb->start ? -1 : 1);
+	return (0);
+}
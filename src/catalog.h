@@ -28,6 +28,8 @@
 #ifndef __CATALOG_H
 #define __CATALOG_H
 
+#include "htab.h"
+
 typedef struct catalog catalog_t;
 
 struct catalog {
@@ -36,14 +38,19 @@ struct catalog {
 	char	**depends;
 
 	catalog_t *next;
+	htab_t	*index;		/* packages by name, on the head only */
+	struct catalog_bin *bin; /* catalog.bin, on a head with no package */
 };
 
 catalog_t	*catalog_new(void);
 void		catalog_free(catalog_t *catalog);
 
+void		catalog_compile(catalog_t *catalog, const char *path);
 void		catalog_emit(catalog_t *catalog, const char *path);
 catalog_t	*catalog_parse(const char *path);
 
 catalog_t	*catalog_find(catalog_t *catalog, const char *package);
+catalog_t	**catalog_closure(catalog_t *catalog, const char *package);
+catalog_t	**catalog_rdepends(catalog_t *catalog, const char *package);
 
 #endif	/* __CATALOG_H */
@@ -0,0 +1,512 @@
+/*
+ * Copyright (c) 2015, Quentin Schwerkolt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif	/* HAVE_CONFIG_H */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(HAVE_LIBLZ4)
+#include <lz4frame.h>
+#endif	/* HAVE_LIBLZ4 */
+#if defined(HAVE_LIBZSTD)
+#include <zstd.h>
+#endif	/* HAVE_LIBZSTD */
+
+#include "codec.h"
+#include "hash.h"
+#include "xalloc.h"
+
+#define CODEC_BUFSIZ	(128 * 1024)
+
+/*
+ * Compressed input is consumed through a source: either straight from
+ * an archive mapping, or chunk by chunk from the descriptor, so that a
+ * member is never held in memory as a whole.
+ */
+struct source {
+	const char	*data;		/* mapped input, or NULL */
+	int		fd;
+	const char	*name;
+	off_t		length;		/* bytes left */
+	char		*buf;
+};
+
+#if defined(HAVE_LIBZSTD) || defined(HAVE_LIBLZ4)
+static ssize_t	codec_read(int fd, const char *name, void *buf, size_t nbytes,
+			   hash_t *hash);
+static void	codec_write(int fd, const char *name, const void *buf,
+			    size_t nbytes, hash_t *hash);
+static size_t	source_read(struct source *src, const void **chunk);
+#endif	/* HAVE_LIBZSTD || HAVE_LIBLZ4 */
+
+#if defined(HAVE_LIBLZ4)
+static size_t	lz4_bound(size_t length);
+static off_t	lz4_compress(int ifd, const char *src, int ofd, const char *dst,
+			      hash_t *hash);
+static size_t	lz4_compress_block(const void *src, size_t srclen,
+				   void *dst, size_t dstlen, const char *name);
+static void	lz4_decompress(struct source *src, int ofd, const char *dst,
+				 hash_t *hash);
+static size_t	lz4_decompress_block(const void *src, size_t srclen,
+				     void *dst, size_t dstlen,
+				     const char *name);
+#endif	/* HAVE_LIBLZ4 */
+#if defined(HAVE_LIBZSTD)
+static size_t	zstd_bound(size_t length);
+static off_t	zstd_compress(int ifd, const char *src, int ofd,
+			      const char *dst, hash_t *hash);
+static size_t	zstd_compress_block(const void *src, size_t srclen,
+				    void *dst, size_t dstlen, const char *name);
+static void	zstd_decompress(struct source *src, int ofd, const char *dst,
+				 hash_t *hash);
+static size_t	zstd_decompress_block(const void *src, size_t srclen,
+				      void *dst, size_t dstlen,
+				      const char *name);
+#endif	/* HAVE_LIBZSTD */
+
+/*
+ * Each codec can work on a stream, for members small enough to be
+ * compressed in one go, and on independent blocks held in memory, which
+ * is what lets large members be (de)compressed by several threads.
+ */
+static struct {
+	const char	*name;
+	off_t		(*compress)(int, const char *, int, const char *,
+				    hash_t *);
+	void		(*decompress)(struct source *, int, const char *,
+				      hash_t *);
+	size_t		(*bound)(size_t);
+	size_t		(*compress_block)(const void *, size_t,
+					  void *, size_t, const char *);
+	size_t		(*decompress_block)(const void *, size_t,
+					    void *, size_t, const char *);
+} codecs[] = {
+	[CODEC_NONE] =	{ "none", NULL, NULL, NULL, NULL, NULL },
+#if defined(HAVE_LIBZSTD)
+	[CODEC_ZSTD] =	{ "zstd", zstd_compress, zstd_decompress, zstd_bound,
+			  zstd_compress_block, zstd_decompress_block },
+#else
+	[CODEC_ZSTD] =	{ "zstd", NULL, NULL, NULL, NULL, NULL },
+#endif	/* HAVE_LIBZSTD */
+#if defined(HAVE_LIBLZ4)
+	[CODEC_LZ4] =	{ "lz4", lz4_compress, lz4_decompress, lz4_bound,
+			  lz4_compress_block, lz4_decompress_block },
+#else
+	[CODEC_LZ4] =	{ "lz4", NULL, NULL, NULL, NULL, NULL },
+#endif	/* HAVE_LIBLZ4 */
+	{ NULL, NULL, NULL, NULL, NULL, NULL }
+};
+
+int
+codec_lookup(const char *name)
+{
+	int idx;
+
+	for (idx = 0; codecs[idx].name; ++idx) {
+		if (!strcmp(codecs[idx].name, name))
+			return (idx);
+	}
+	return (-1);
+}
+
+const char *
+codec_name(int codec)
+{
+	return (codecs[codec].name);
+}
+
+off_t
+codec_compress(int codec, int ifd, const char *src, int ofd, const char *dst,
+	       hash_t *hash)
+{
+	if (!codecs[codec].compress)
+		errx(1, "%s: %s compression is not supported",
+		     src, codecs[codec].name);
+	return (codecs[codec].compress(ifd, src, ofd, dst, hash));
+}
+
+size_t
+codec_bound(int codec, size_t length)
+{
+	if (!codecs[codec].bound)
+		errx(1, "%s compression is not supported", codecs[codec].name);
+	return (codecs[codec].bound(length));
+}
+
+size_t
+codec_compress_block(int codec, const void *src, size_t srclen,
+		     void *dst, size_t dstlen, const char *name)
+{
+	if (!codecs[codec].compress_block)
+		errx(1, "%s: %s compression is not supported",
+		     name, codecs[codec].name);
+	return (codecs[codec].compress_block(src, srclen, dst, dstlen, name));
+}
+
+void
+codec_decompress(int codec, const char *data, int ifd, const char *src,
+		 off_t length, int ofd, const char *dst, hash_t *hash)
+{
+	struct source source;
+
+	if (!codecs[codec].decompress)
+		errx(1, "%s: %s compression is not supported",
+		     src, codecs[codec].name);
+
+	source.data = data;
+	source.fd = ifd;
+	source.name = src;
+	source.length = length;
+	source.buf = data ? NULL : xmalloc(CODEC_BUFSIZ);
+
+	codecs[codec].decompress(&source, ofd, dst, hash);
+	free(source.buf);
+}
+
+void
+codec_decompress_block(int codec, const void *src, size_t srclen,
+		       void *dst, size_t dstlen, const char *name)
+{
+	if (!codecs[codec].decompress_block)
+		errx(1, "%s: %s compression is not supported",
+		     name, codecs[codec].name);
+	if (codecs[codec].decompress_block(src, srclen,
+					   dst, dstlen, name) != dstlen)
+		errx(1, "%s: corrupted block", name);
+}
+
+#if defined(HAVE_LIBZSTD) || defined(HAVE_LIBLZ4)
+/*
+ * The uncompressed side of a member goes through codec_read and
+ * codec_write, which hash it on the way when asked to.
+ */
+static ssize_t
+codec_read(int fd, const char *name, void *buf, size_t nbytes, hash_t *hash)
+{
+	ssize_t length;
+
+	if ((length = read(fd, buf, nbytes)) == -1)
+		err(1, "read: %s", name);
+	if (hash)
+		hash_update(hash, buf, (size_t)length);
+	return (length);
+}
+
+static void
+codec_write(int fd, const char *name, const void *buf, size_t nbytes,
+	    hash_t *hash)
+{
+	ssize_t written;
+
+	if (hash)
+		hash_update(hash, buf, nbytes);
+
+	while (nbytes > 0) {
+		if ((written = write(fd, buf, nbytes)) == -1)
+			err(1, "write: %s", name);
+		if (written == 0)
+			errx(1, "write: %s: truncated write", name);
+		buf = (const char *)buf + written;
+		nbytes -= written;
+	}
+}
+
+static size_t
+source_read(struct source *src, const void **chunk)
+{
+	size_t nbytes;
+	ssize_t length;
+
+	if (src->length == 0)
+		return (0);
+
+	if (src->data) {
+		*chunk = src->data;
+		nbytes = (size_t)src->length;
+		src->data += nbytes;
+		src->length = 0;
+		return (nbytes);
+	}
+
+	nbytes = src->length < CODEC_BUFSIZ ?
+		(size_t)src->length : CODEC_BUFSIZ;
+	if ((length = read(src->fd, src->buf, nbytes)) == -1)
+		err(1, "read: %s", src->name);
+	if (length == 0)
+		errx(1, "read: %s: truncated read", src->name);
+	src->length -= length;
+	*chunk = src->buf;
+	return ((size_t)length);
+}
+#endif	/* HAVE_LIBZSTD || HAVE_LIBLZ4 */
+
+#if defined(HAVE_LIBLZ4)
+static size_t
+lz4_bound(size_t length)
+{
+	return (LZ4F_compressFrameBound(length, NULL));
+}
+
+static off_t
+lz4_compress(int ifd, const char *src, int ofd, const char *dst, hash_t *hash)
+{
+	LZ4F_cctx *cctx;
+	char *ibuf, *obuf;
+	off_t total;
+	size_t obufsiz, rv;
+	ssize_t nbytes;
+
+	rv = LZ4F_createCompressionContext(&cctx, LZ4F_VERSION);
+	if (LZ4F_isError(rv))
+		errx(1, "lz4: %s", LZ4F_getErrorName(rv));
+
+	obufsiz = LZ4F_compressBound(CODEC_BUFSIZ, NULL);
+	if (obufsiz < LZ4F_HEADER_SIZE_MAX)
+		obufsiz = LZ4F_HEADER_SIZE_MAX;
+	ibuf = xmalloc(CODEC_BUFSIZ);
+	obuf = xmalloc(obufsiz);
+
+	rv = LZ4F_compressBegin(cctx, obuf, obufsiz, NULL);
+	if (LZ4F_isError(rv))
+		errx(1, "lz4: %s: %s", src, LZ4F_getErrorName(rv));
+	codec_write(ofd, dst, obuf, rv, NULL);
+	total = (off_t)rv;
+
+	while ((nbytes = codec_read(ifd, src, ibuf, CODEC_BUFSIZ, hash)) > 0) {
+		rv = LZ4F_compressUpdate(cctx, obuf, obufsiz,
+					 ibuf, (size_t)nbytes, NULL);
+		if (LZ4F_isError(rv))
+			errx(1, "lz4: %s: %s", src, LZ4F_getErrorName(rv));
+		codec_write(ofd, dst, obuf, rv, NULL);
+		total += (off_t)rv;
+	}
+
+	rv = LZ4F_compressEnd(cctx, obuf, obufsiz, NULL);
+	if (LZ4F_isError(rv))
+		errx(1, "lz4: %s: %s", src, LZ4F_getErrorName(rv));
+	codec_write(ofd, dst, obuf, rv, NULL);
+	total += (off_t)rv;
+
+	free(obuf);
+	free(ibuf);
+	LZ4F_freeCompressionContext(cctx);
+	return (total);
+}
+
+static size_t
+lz4_compress_block(const void *src, size_t srclen,
+		   void *dst, size_t dstlen, const char *name)
+{
+	size_t rv;
+
+	rv = LZ4F_compressFrame(dst, dstlen, src, srclen, NULL);
+	if (LZ4F_isError(rv))
+		errx(1, "lz4: %s: %s", name, LZ4F_getErrorName(rv));
+	return (rv);
+}
+
+static void
+lz4_decompress(struct source *src, int ofd, const char *dst, hash_t *hash)
+{
+	LZ4F_dctx *dctx;
+	const void *chunk;
+	char *obuf;
+	size_t dsize, left, rv, ssize;
+
+	rv = LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION);
+	if (LZ4F_isError(rv))
+		errx(1, "lz4: %s", LZ4F_getErrorName(rv));
+	obuf = xmalloc(CODEC_BUFSIZ);
+
+	rv = 1;
+	while ((left = source_read(src, &chunk)) > 0) {
+		/* a full output buffer may leave decoded data behind */
+		do {
+			dsize = CODEC_BUFSIZ;
+			ssize = left;
+			rv = LZ4F_decompress(dctx, obuf, &dsize,
+					     chunk, &ssize, NULL);
+			if (LZ4F_isError(rv))
+				errx(1, "lz4: %s: %s", src->name,
+				     LZ4F_getErrorName(rv));
+			codec_write(ofd, dst, obuf, dsize, hash);
+			chunk = (const char *)chunk + ssize;
+			left -= ssize;
+		} while (left > 0 || dsize == CODEC_BUFSIZ);
+	}
+	if (rv != 0)
+		errx(1, "lz4: %s: truncated frame", src->name);
+
+	free(obuf);
+	LZ4F_freeDecompressionContext(dctx);
+}
+
+static size_t
+lz4_decompress_block(const void *src, size_t srclen,
+		     void *dst, size_t dstlen, const char *name)
+{
+	LZ4F_dctx *dctx;
+	size_t dsize, rv, ssize;
+
+	rv = LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION);
+	if (LZ4F_isError(rv))
+		errx(1, "lz4: %s", LZ4F_getErrorName(rv));
+
+	dsize = dstlen;
+	ssize = srclen;
+	rv = LZ4F_decompress(dctx, dst, &dsize, src, &ssize, NULL);
+	if (LZ4F_isError(rv))
+		errx(1, "lz4: %s: %s", name, LZ4F_getErrorName(rv));
+	if (rv != 0 || ssize != srclen)
+		errx(1, "lz4: %s: corrupted block", name);
+
+	LZ4F_freeDecompressionContext(dctx);
+	return (dsize);
+}
+#endif	/* HAVE_LIBLZ4 */
+
+#if defined(HAVE_LIBZSTD)
+static size_t
+zstd_bound(size_t length)
+{
+	return (ZSTD_compressBound(length));
+}
+
+static off_t
+zstd_compress(int ifd, const char *src, int ofd, const char *dst, hash_t *hash)
+{
+	ZSTD_CCtx *cctx;
+	ZSTD_inBuffer in;
+	ZSTD_outBuffer out;
+	char *ibuf, *obuf;
+	int last;
+	off_t total;
+	size_t ibufsiz, obufsiz, rv;
+	ssize_t nbytes;
+
+	if (!(cctx = ZSTD_createCCtx()))
+		errx(1, "Cannot allocate memory");
+	ibufsiz = ZSTD_CStreamInSize();
+	obufsiz = ZSTD_CStreamOutSize();
+	ibuf = xmalloc(ibufsiz);
+	obuf = xmalloc(obufsiz);
+
+	total = 0;
+	do {
+		nbytes = codec_read(ifd, src, ibuf, ibufsiz, hash);
+		last = (nbytes == 0);
+
+		in.src = ibuf;
+		in.size = (size_t)nbytes;
+		in.pos = 0;
+		do {
+			out.dst = obuf;
+			out.size = obufsiz;
+			out.pos = 0;
+			rv = ZSTD_compressStream2(cctx, &out, &in,
+				last ? ZSTD_e_end : ZSTD_e_continue);
+			if (ZSTD_isError(rv))
+				errx(1, "zstd: %s: %s", src,
+				     ZSTD_getErrorName(rv));
+			codec_write(ofd, dst, obuf, out.pos, NULL);
+			total += (off_t)out.pos;
+		} while (last ? rv != 0 : in.pos < in.size);
+	} while (!last);
+
+	free(obuf);
+	free(ibuf);
+	ZSTD_freeCCtx(cctx);
+	return (total);
+}
+
+static size_t
+zstd_compress_block(const void *src, size_t srclen,
+		    void *dst, size_t dstlen, const char *name)
+{
+	size_t rv;
+
+	rv = ZSTD_compress(dst, dstlen, src, srclen, ZSTD_CLEVEL_DEFAULT);
+	if (ZSTD_isError(rv))
+		errx(1, "zstd: %s: %s", name, ZSTD_getErrorName(rv));
+	return (rv);
+}
+
+static void
+zstd_decompress(struct source *src, int ofd, const char *dst, hash_t *hash)
+{
+	ZSTD_DCtx *dctx;
+	ZSTD_inBuffer in;
+	ZSTD_outBuffer out;
+	char *obuf;
+	size_t obufsiz, rv;
+
+	if (!(dctx = ZSTD_createDCtx()))
+		errx(1, "Cannot allocate memory");
+	obufsiz = ZSTD_DStreamOutSize();
+	obuf = xmalloc(obufsiz);
+
+	rv = 1;
+	while ((in.size = source_read(src, &in.src)) > 0) {
+		in.pos = 0;
+		/* a full output buffer may leave decoded data behind */
+		do {
+			out.dst = obuf;
+			out.size = obufsiz;
+			out.pos = 0;
+			rv = ZSTD_decompressStream(dctx, &out, &in);
+			if (ZSTD_isError(rv))
+				errx(1, "zstd: %s: %s", src->name,
+				     ZSTD_getErrorName(rv));
+			codec_write(ofd, dst, obuf, out.pos, hash);
+		} while (in.pos < in.size || out.pos == out.size);
+	}
+	if (rv != 0)
+		errx(1, "zstd: %s: truncated frame", src->name);
+
+	free(obuf);
+	ZSTD_freeDCtx(dctx);
+}
+
+static size_t
+zstd_decompress_block(const void *src, size_t srclen,
+		      void *dst, size_t dstlen, const char *name)
+{
+	size_t rv;
+
+	rv = ZSTD_decompress(dst, dstlen, src, srclen);
+	if (ZSTD_isError(rv))
+		errx(1, "zstd: %s: %s", name, ZSTD_getErrorName(rv));
+	return (rv);
+}
+#endif	/* HAVE_LIBZSTD */
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2015, Quentin Schwerkolt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __CODEC_H
+#define __CODEC_H
+
+#include <sys/types.h>
+
+#include "hash.h"
+
+#define CODEC_NONE	0
+#define CODEC_ZSTD	1
+#define CODEC_LZ4	2
+
+#define CODEC_MINSIZE	4096	/* smaller members are always stored */
+#define CODEC_BLOCKSIZE	(4 * 1024 * 1024) /* larger members are split */
+
+int		codec_lookup(const char *name);
+const char	*codec_name(int codec);
+
+off_t		codec_compress(int codec, int ifd, const char *src,
+			       int ofd, const char *dst, hash_t *hash);
+void		codec_decompress(int codec, const char *data,
+				 int ifd, const char *src, off_t length,
+				 int ofd, const char *dst, hash_t *hash);
+
+size_t		codec_bound(int codec, size_t length);
+size_t		codec_compress_block(int codec, const void *src, size_t srclen,
+				     void *dst, size_t dstlen,
+				     const char *name);
+void		codec_decompress_block(int codec, const void *src,
+				       size_t srclen, void *dst, size_t dstlen,
+				       const char *name);
+
+#endif	/* __CODEC_H */
@@ -40,6 +40,7 @@
 #include <unistd.h>
 
 #include "ar.h"
+#include "codec.h"
 #include "manifest.h"
 #include "utils.h"
 
@@ -49,15 +50,32 @@ int
 main(int argc, char **argv)
 {
 	ar_t *ar;
+	ar_info_t info;
 	char *protodir, *repodir;
 	char path[PATH_MAX];
-	int ch, idx;
+	int ch, codec, format, idx, jobs, withtoc;
+	manifest_iter_t iter;
 	manifest_node_t *node;
 	manifest_t *pkg;
 
 	protodir = repodir = NULL;
-	while ((ch = getopt(argc, argv, "p:r:")) != -1) {
+	format = 1;
+	jobs = 1;
+	withtoc = 0;
+	while ((ch = getopt(argc, argv, "f:j:p:r:t")) != -1) {
 		switch (ch) {
+		case 'f':
+			format = (int)strtol(optarg, (char **)NULL, 10);
+			if (format != 1 && format != 2)
+				usage("%s -- unknown archive format", optarg);
+			break;
+
+		case 'j':
+			jobs = (int)strtol(optarg, (char **)NULL, 10);
+			if (jobs < 1)
+				usage("%s -- invalid number of jobs", optarg);
+			break;
+
 		case 'p':
 			protodir = optarg;
 			break;
@@ -66,6 +84,10 @@ main(int argc, char **argv)
 			repodir = optarg;
 			break;
 
+		case 't':
+			withtoc = 1;
+			break;
+
 		default:
 			usage("%c -- unknown global option", (char)ch);
 			break;
@@ -80,23 +102,42 @@ main(int argc, char **argv)
 	for (idx = optind; idx < argc; ++idx) {
 		pkg = manifest_parse(argv[idx]);
 
+		codec = CODEC_NONE;
+		if (pkg->compress &&
+		    (codec = codec_lookup(pkg->compress)) == -1)
+			errx(1, "%s: %s: unknown codec",
+			     argv[idx], pkg->compress);
+
 		snprintf(path, PATH_MAX, "%s/%s", repodir, pkg->name);
 		mpkg_mkdirs(path);
 
-		if (pkg->nodes) {
+		if (pkg->nnodes) {
 			snprintf(path, PATH_MAX,
 				 "%s/%s/data.a", repodir, pkg->name);
-			ar = ar_open_write(path);
+			ar = ar_open_write(path, format);
 			ar_set_wrkdir(ar, protodir);
-			for (node = pkg->nodes; node; /* void */) {
-				ar_append(ar, node->path);
-				node = node->next;
+			ar_set_toc(ar, withtoc);
+			ar_set_codec(ar, codec);
+			ar_set_jobs(ar, jobs);
+			manifest_iter_rewrite(&iter, pkg);
+			while ((node = manifest_iter_next(&iter))) {
+				ar_append(ar, node->path, &info);
+				node->hashed = info.hashed;
+				node->hash = info.hash;
+				node->stated = 1;
+				node->mode = info.mode;
+				node->uid = info.uid;
+				node->gid = info.gid;
+				node->mtime = info.date;
+				node->size = info.rawsize;
+				manifest_add_node(pkg, node);
 			}
 			ar_close(ar);
 		}
 
 		snprintf(path, PATH_MAX, "%s/%s/manifest", repodir, pkg->name);
 		manifest_emit(pkg, path);
+		manifest_compile(pkg, path);
 
 		if (pkg->script) {
 			snprintf(path, PATH_MAX, "%s/%s/script", repodir, pkg->name);
@@ -122,7 +163,8 @@ usage(char *fmt, ...)
 
 	fprintf(stdout,
 		"usage:\n"
-		"\t%s -p protodir -r repodir manifest ...\n",
+		"\t%s [-f format] [-j jobs] [-t] -p protodir -r repodir "
+		"manifest ...\n",
 		getprogname());
 
 	exit(2);
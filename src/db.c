@@ -29,22 +29,222 @@
 #include "config.h"
 #endif	/* HAVE_CONFIG_H */
 
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include <dirent.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <unistd.h>
 
+#include "arena.h"
 #include "db.h"
+#include "hash.h"
+#include "htab.h"
 #include "manifest.h"
 #include "utils.h"
 #include "xalloc.h"
 
+/*
+ * The installed packages are recorded in two files of <dbpath>.  db.bin
+ * holds all of them, sorted by name, as of some point.  db.log holds what
+ * changed since, one record per package installed or removed, and is
+ * folded into a new db.bin once it has grown large enough.  All integers
+ * are little endian.
+ *
+ * db.bin:
+ *
+ *   |=======================================================|
+ *   | Components     | Subcomponent |                  Size |
+ *   |=======================================================|
+ *   | header         | db_bin_hdr   |                    40 |
+ *   |================|======================================|
+ *   | packages       | db_bin_pkg   |         24 * b_npkgs |
+ *   |================|======================================|
+ *   | string pool    |              |      b_poolsize bytes |
+ *   |================|======================================|
+ *   | manifests      |              |      b_datasize bytes |
+ *   |================|======================================|
+ *   | files          | db_bin_file  |        12 * b_nslots |
+ *   |================|======================================|
+ *   | paths          |              |      b_pathsize bytes |
+ *   |========================================================
+ *
+ * A package gives its name as an offset into the pool and its manifest,
+ * in the compiled form of manifest_pack(), as a range of the manifests.
+ * The files are a hash table of every path of every manifest to the
+ * packages that own it, probed linearly from the hash_data() of the path
+ * and kept at most half full.  Paths are stored without their leading
+ * slashes, which manifests may or may not write.  A path owned by several packages, as
+ * directories often are, takes a slot for each of them.
+ *
+ * db.log:
+ *
+ *   |=======================================================|
+ *   | Components     | Subcomponent |                  Size |
+ *   |=======================================================|
+ *   | header         | db_log_hdr   |                    12 |
+ *   |================|======================================|
+ *   | record         | db_log_rec   |                    16 |
+ *   |                | name         |     r_namelen bytes   |
+ *   |                | manifest     |        r_size bytes   |
+ *   |================|======================================|
+ *   | ...            |              |                       |
+ *   |========================================================
+ *
+ * A log only applies to the db.bin with the same serial; an older one has
+ * been folded into it already.  A record cut short by a crash ends the
+ * log, the next writer truncates it.  The files of db.bin say nothing of
+ * the packages a log changes, db_owners() indexes those in memory.
+ *
+ * db.bin is never written in place and db.log is only ever appended to, so
+ * mappings stay valid for as long as they are held.  The per-package
+ * directories are still written.  They hold what does not belong in the
+ * database, and db.bin is rebuilt from them when it is missing or cannot
+ * be used.
+ */
+#define DB_BIN_MAG	"!<dbbin>"
+#define DB_BIN_VERSION	4
+#define DB_BIN_AUTOMATIC	0x1
+#define DB_LOG_MAG	"!<dblog>"
+#define DB_LOG_REMOVE	0x2
+#define DB_LOG_MIN	(256 * 1024)	/* before it is folded into db.bin */
+#define DB_LOG_RATIO	4		/* ... and once past db.bin / ratio */
+
+struct db_bin_hdr {
+	char	b_magic[8];	/* DB_BIN_MAG */
+	uint8_t	b_version[4];	/* DB_BIN_VERSION */
+	uint8_t	b_serial[4];
+	uint8_t	b_npkgs[4];
+	uint8_t	b_poolsize[4];
+	uint8_t	b_datasize[8];
+	uint8_t	b_nslots[4];	/* a power of two, or 0 */
+	uint8_t	b_pathsize[4];
+} __attribute__((packed));
+
+struct db_bin_pkg {
+	uint8_t	p_name[4];
+	uint8_t	p_release[4];
+	uint8_t	p_flags[4];	/* DB_BIN_AUTOMATIC */
+	uint8_t	p_size[4];	/* manifest size */
+	uint8_t	p_offset[8];	/* manifest offset */
+} __attribute__((packed));
+
+struct db_bin_file {
+	uint8_t	f_hash[4];	/* low bits of the hash of the path */
+	uint8_t	f_pkg[4];	/* index + 1 of the owner, 0 for a free slot */
+	uint8_t	f_path[4];	/* offset into the paths */
+} __attribute__((packed));
+
+struct db_log_hdr {
+	char	l_magic[8];	/* DB_LOG_MAG */
+	uint8_t	l_serial[4];	/* of the db.bin it applies to */
+} __attribute__((packed));
+
+struct db_log_rec {
+	uint8_t	r_namelen[4];	/* including its NUL */
+	uint8_t	r_release[4];
+	uint8_t	r_flags[4];	/* DB_BIN_AUTOMATIC, DB_LOG_REMOVE */
+	uint8_t	r_size[4];	/* manifest size */
+} __attribute__((packed));
+
+/*
+ * A package on its way in or out of the database.  Its manifest is either
+ * borrowed from a mapping or packed for the occasion.
+ */
+struct db_entry {
+	const char	*name;
+	int		release;
+	uint32_t	flags;
+	const void	*data;
+	size_t		size;
+	void		*owned;		/* to be freed, name and data may be in it */
+	uint32_t	binidx;		/* index + 1 in db.bin, or 0 */
+};
+
+/*
+ * One of the owners of a path, for the packages that db.bin does not
+ * index or not as they are now.
+ */
+struct db_owner {
+	const char	*path;
+	dbnode_t	*node;
+	struct db_owner	*next;
+};
+
+/*
+ * The installed packages that depend on a name, counted once per depend.
+ */
+struct db_refs {
+	const char	*name;
+	size_t		refs;
+};
+
+/*
+ * Entries being brought up to date with changes.
+ */
+struct db_set {
+	struct db_entry	*entries;
+	size_t		n;
+	size_t		cap;
+	htab_t		*names;		/* index + 1 by name */
+};
+
+static const char *db_bin_data(const char *map, const struct db_bin_pkg **pkgs,
+			       const char **pool);
+static struct db_entry *db_bin_entries(const char *map, size_t *np);
+static int	db_bin_head(const char *path, uint32_t *serial, size_t *lenp);
+static uint32_t	db_bin_files(const char *map, const struct db_bin_file **files,
+			     const char **paths);
+static int	db_bin_index(struct db_entry *entries, size_t n,
+			     struct db_bin_file **filesp, uint32_t *nslotsp,
+			     char **pathsp, uint32_t *pathsizep);
+static char	*db_bin_open(const char *path, size_t *lenp);
+static uint32_t	db_bin_serial(const char *map);
+static int	db_bin_write(db_t *db, struct db_entry *entries, size_t n,
+			     uint32_t serial);
+static int	db_compact(db_t *db, struct db_entry *entries, size_t n,
+			   uint32_t serial);
+static void	db_entries_free(struct db_entry *entries, size_t n);
+static void	db_files_add(db_t *db, dbnode_t *node);
+static void	db_files_remove(db_t *db, dbnode_t *node);
+static int	db_entry_cmp(const void *p1, const void *p2);
+static uint32_t	db_get32(const uint8_t *p);
+static uint64_t	db_get64(const uint8_t *p);
+static int	db_import(const char *path, struct db_entry *entry);
+static int	db_lock(db_t *db);
+static int	db_log_create(db_t *db, uint32_t serial);
+static int	db_log_next(const char *map, size_t len, size_t *pos,
+			    struct db_entry *entry);
+static char	*db_log_open(const char *path, size_t *lenp, uint32_t *serial);
+static void	db_map(db_t *db);
+static void	db_nodes_free(dbnode_t *nodes);
+static void	db_put32(uint8_t *p, uint32_t val);
+static void	db_put64(uint8_t *p, uint64_t val);
+static void	db_rebuild(db_t *db, struct db_entry *change, uint32_t serial);
+static void	db_refs_count(db_t *db, dbnode_t *node, int delta);
+static const char *db_relpath(const char *path);
+static struct db_entry *db_scan(db_t *db, size_t *np);
+static void	db_set_apply(struct db_set *set, const struct db_entry *change);
+static struct db_entry *db_set_finish(struct db_set *set, size_t *np);
+static void	db_set_init(struct db_set *set, struct db_entry *entries,
+			    size_t n);
+static void	db_set_replay(struct db_set *set, const char *log,
+			      size_t loglen);
+static void	db_unmap(db_t *db);
+
+/*
+ * Map the database read only, db_load() builds the packages out of it.
+ */
 db_t *
 db_init(const char *path)
 {
@@ -55,57 +255,1307 @@ db_init(const char *path)
 
 	if (access(db->path, X_OK) == -1)
 		mpkg_mkdirs(db->path);
+
+	db_map(db);
 	return (db);
 }
 
 void
 db_free(db_t *db)
 {
-	dbnode_t *dbnode, *tmp;
+	db_nodes_free(db->nodes);
+	htab_free(db->index);
+	htab_free(db->files);
+	htab_free(db->rdepends);
+	db_unmap(db);
+	free(db);
+}
 
-	for (dbnode = db->nodes; dbnode; /* void */) {
-		tmp = dbnode->next;
-		manifest_free(dbnode->pkg);
-		free(dbnode);
-		dbnode = tmp;
+/*
+ * Add mf, which the database takes over, as the manifest of a package it
+ * does not know about yet.  Like db_replace() and db_remove(), this only
+ * changes the database in memory, db_commit() writes changes down.
+ */
+dbnode_t *
+db_add(db_t *db, manifest_t *mf, int automatic)
+{
+	dbnode_t *dbnode, **prevp;
+
+	if (db_find(db, mf->name))
+		errx(1, "%s: already in the database", mf->name);
+
+	dbnode = xcalloc(1, sizeof(dbnode_t));
+	dbnode->name = mf->name;
+	dbnode->release = mf->release;
+	dbnode->automatic = automatic;
+	dbnode->pkg = mf;
+
+	for (prevp = &db->nodes; *prevp; prevp = &(*prevp)->next) {
+		if (strcmp((*prevp)->name, dbnode->name) > 0)
+			break;
 	}
-	free(db);
+	dbnode->next = *prevp;
+	*prevp = dbnode;
+	if (db->index)
+		htab_insert(db->index, dbnode->name, dbnode);
+	if (db->files)
+		db_files_add(db, dbnode);
+	if (db->rdepends)
+		db_refs_count(db, dbnode, 1);
+	return (dbnode);
 }
 
-static dbnode_t *
-db_import(const char *path)
+/*
+ * Record mf as the manifest of package, or forget about package when mf is
+ * NULL.  The change is appended to db.log, against the database as it is
+ * on disk rather than as it was loaded, so concurrent writers do not undo
+ * each other.
+ */
+void
+db_commit(db_t *db, const char *package, manifest_t *mf, int automatic)
+{
+	char bin[PATH_MAX], log[PATH_MAX], *binmap, *logmap;
+	int fd, lock;
+	size_t binlen, end, loglen, n, namelen;
+	struct db_entry change, *entries, entry;
+	struct db_log_rec rec;
+	struct db_set set;
+	struct stat sb;
+	uint32_t logserial, serial;
+	uint8_t *buf;
+
+	bzero(&change, sizeof(change));
+	change.name = package;
+	if (mf) {
+		change.release = mf->release;
+		change.flags = automatic ? DB_BIN_AUTOMATIC : 0;
+		change.owned = manifest_pack(mf, &change.size);
+		change.data = change.owned;
+	}
+	else
+		change.flags = DB_LOG_REMOVE;
+
+	if ((lock = db_lock(db)) == -1)
+		err(1, "%s/lock", db->path);
+	snprintf(bin, PATH_MAX, "%s/db.bin", db->path);
+	snprintf(log, PATH_MAX, "%s/db.log", db->path);
+
+	if (db_bin_head(bin, &serial, &binlen) == -1) {
+		/* there is nothing to log against, start a new db.bin */
+		db_rebuild(db, &change, 1);
+		close(lock);
+		return;
+	}
+
+	/* a log that only grew by our own records needs no reading */
+	if (serial == db->logserial && stat(log, &sb) == 0 &&
+	    (size_t)sb.st_size == db->logend) {
+		end = db->logend;
+		loglen = end;
+	}
+	else {
+		end = sizeof(struct db_log_hdr);
+		if ((logmap = db_log_open(log, &loglen, &logserial))) {
+			if (logserial == serial) {
+				while (db_log_next(logmap, loglen, &end,
+						   &entry))
+					continue;
+			}
+			munmap(logmap, loglen);
+		}
+		if (!logmap || logserial != serial) {
+			if (db_log_create(db, serial) == -1)
+				err(1, "%s", log);
+			loglen = end;
+		}
+	}
+
+	namelen = strlen(package) + 1;
+	bzero(&rec, sizeof(rec));
+	db_put32(rec.r_namelen, (uint32_t)namelen);
+	db_put32(rec.r_release, (uint32_t)change.release);
+	db_put32(rec.r_flags, change.flags);
+	db_put32(rec.r_size, (uint32_t)change.size);
+	buf = xmalloc(sizeof(rec) + namelen + change.size);
+	memcpy(buf, &rec, sizeof(rec));
+	memcpy(buf + sizeof(rec), package, namelen);
+	if (change.size)
+		memcpy(buf + sizeof(rec) + namelen, change.data, change.size);
+
+	if ((fd = open(log, O_WRONLY|O_APPEND|O_CLOEXEC)) == -1)
+		err(1, "cannot open file: %s", log);
+	if (end < loglen && ftruncate(fd, (off_t)end) == -1)
+		err(1, "ftruncate: %s", log);
+	n = sizeof(rec) + namelen + change.size;
+	if (write(fd, buf, n) != (ssize_t)n)
+		err(1, "write: %s", log);
+	if (close(fd) == -1)
+		err(1, "close: %s", log);
+	free(buf);
+	free(change.owned);
+	db->logserial = serial;
+	db->logend = end + n;
+
+	if (db->logend >= DB_LOG_MIN && db->logend >= binlen / DB_LOG_RATIO) {
+		if (!(binmap = db_bin_open(bin, &binlen))) {
+			/* the directories are up to date, start over */
+			db_rebuild(db, NULL, serial + 1);
+			close(lock);
+			return;
+		}
+		if (!(logmap = db_log_open(log, &loglen, &logserial)))
+			errx(1, "%s: cannot read it back", log);
+		entries = db_bin_entries(binmap, &n);
+		db_set_init(&set, entries, n);
+		db_set_replay(&set, logmap, loglen);
+		entries = db_set_finish(&set, &n);
+		if (db_compact(db, entries, n, serial + 1) == -1)
+			err(1, "%s", bin);
+		db_entries_free(entries, n);
+		munmap(logmap, loglen);
+		munmap(binmap, binlen);
+	}
+	close(lock);
+}
+
+/*
+ * Load every package of an empty database and index them by name, leaving
+ * their manifests to db_manifest().  A database without a usable db.bin
+ * is imported from its directories, and db.bin written for the next time
+ * if we are allowed to.
+ */
+void
+db_load(db_t *db)
+{
+	char bin[PATH_MAX], *data;
+	dbnode_t *dbnode, *last;
+	int lock;
+	size_t idx, n;
+	struct db_entry *entries, *scanned = NULL;
+	struct db_set set;
+
+	db->index = htab_new();
+	db->arena = arena_new();
+	if (!db->map) {
+		snprintf(bin, PATH_MAX, "%s/db.bin", db->path);
+		scanned = entries = db_scan(db, &n);
+		qsort(entries, n, sizeof(struct db_entry), db_entry_cmp);
+		if ((lock = db_lock(db)) == -1 ||
+		    db_compact(db, entries, n, 1) == -1)
+			warn("%s", bin);
+		else
+			db_map(db);
+		if (lock != -1)
+			close(lock);
+		if (db->map) {
+			db_entries_free(scanned, n);
+			scanned = NULL;
+		}
+	}
+	if (db->map) {
+		entries = db_bin_entries(db->map, &n);
+		if (db->logmap) {
+			db_set_init(&set, entries, n);
+			db_set_replay(&set, db->logmap, db->loglen);
+			entries = db_set_finish(&set, &n);
+		}
+	}
+
+	last = NULL;
+	for (idx = 0; idx < n; ++idx) {
+		dbnode = xcalloc(1, sizeof(dbnode_t));
+		dbnode->name = entries[idx].name;
+		dbnode->release = entries[idx].release;
+		dbnode->automatic = entries[idx].flags & DB_BIN_AUTOMATIC;
+		dbnode->data = entries[idx].data;
+		dbnode->size = entries[idx].size;
+		dbnode->binidx = entries[idx].binidx;
+		if (scanned) {
+			/* there is no mapping to point into */
+			dbnode->name = arena_strdup(db->arena, dbnode->name);
+			data = arena_alloc(db->arena, dbnode->size);
+			memcpy(data, dbnode->data, dbnode->size);
+			dbnode->data = data;
+		}
+
+		if (!db->nodes)
+			db->nodes = dbnode;
+		else
+			last->next = dbnode;
+		last = dbnode;
+		htab_insert(db->index, dbnode->name, dbnode);
+	}
+	if (scanned)
+		db_entries_free(scanned, n);
+	else
+		free(entries);
+}
+
+/*
+ * Return the manifest of node, loading it on first use.  Only its depends
+ * are decoded, its nodes are read out of the mapping as they are walked.
+ */
+manifest_t *
+db_manifest(db_t *db, dbnode_t *node)
+{
+	if (node->pkg)
+		return (node->pkg);
+
+	if (!(node->pkg = manifest_unpack(node->data, node->size, db->arena)))
+		errx(1, "%s: %s: corrupt manifest", db->path, node->name);
+	return (node->pkg);
+}
+
+/*
+ * Return the packages that were only installed as depends and that no
+ * package installed on purpose needs anymore, as a NULL terminated array
+ * to be freed.  They are marked from the packages installed on purpose
+ * and swept in one pass.  Packages come before their depends, but for
+ * those that depend on each other, which come last.
+ */
+dbnode_t **
+db_orphans(db_t *db)
+{
+	dbnode_t **orphans, *dbnode, **stack;
+	htab_t *marks, *slots;
+	manifest_depend_t *depend;
+	size_t head, idx, n, nnodes, *refs, slot, tail;
+
+	nnodes = 0;
+	for (dbnode = db->nodes; dbnode; dbnode = dbnode->next)
+		++nnodes;
+	stack = xcalloc(nnodes + 1, sizeof(dbnode_t *));
+
+	/* mark what the packages installed on purpose need */
+	marks = htab_new();
+	n = 0;
+	for (dbnode = db->nodes; dbnode; dbnode = dbnode->next) {
+		if (dbnode->automatic)
+			continue;
+		htab_insert(marks, dbnode->name, dbnode);
+		stack[n++] = dbnode;
+	}
+	while (n > 0) {
+		depend = db_manifest(db, stack[--n])->depends;
+		for (/* void */; depend; depend = depend->next) {
+			if (!(dbnode = db_find(db, depend->name)) ||
+			    htab_find(marks, dbnode->name))
+				continue;
+			htab_insert(marks, dbnode->name, dbnode);
+			stack[n++] = dbnode;
+		}
+	}
+
+	/* sweep the others, counting how many of them need each */
+	slots = htab_new();
+	n = 0;
+	for (dbnode = db->nodes; dbnode; dbnode = dbnode->next) {
+		if (htab_find(marks, dbnode->name))
+			continue;
+		stack[n++] = dbnode;
+		htab_insert(slots, dbnode->name, (void *)(uintptr_t)n);
+	}
+	htab_free(marks);
+	refs = xcalloc(n + 1, sizeof(size_t));
+	for (idx = 0; idx < n; ++idx) {
+		depend = db_manifest(db, stack[idx])->depends;
+		for (/* void */; depend; depend = depend->next) {
+			slot = (uintptr_t)htab_find(slots, depend->name);
+			if (slot && slot - 1 != idx)
+				++refs[slot-1];
+		}
+	}
+
+	/* and order them: an orphan goes once nothing left needs it */
+	orphans = xcalloc(n + 1, sizeof(dbnode_t *));
+	head = tail = 0;
+	for (idx = 0; idx < n; ++idx) {
+		if (!refs[idx])
+			orphans[tail++] = stack[idx];
+	}
+	while (head < tail) {
+		dbnode = orphans[head++];
+		depend = db_manifest(db, dbnode)->depends;
+		for (/* void */; depend; depend = depend->next) {
+			slot = (uintptr_t)htab_find(slots, depend->name);
+			if (slot && stack[slot-1] != dbnode &&
+			    --refs[slot-1] == 0)
+				orphans[tail++] = stack[slot-1];
+		}
+	}
+	for (idx = 0; idx < n && tail < n; ++idx) {
+		if (refs[idx])
+			orphans[tail++] = stack[idx];
+	}
+
+	htab_free(slots);
+	free(refs);
+	free(stack);
+	return (orphans);
+}
+
+/*
+ * Return the packages that own path, as a NULL terminated array to be
+ * freed.  Those still as they are in db.bin are found through its files,
+ * the others through an index of their own built on first use and kept up
+ * to date with the database.
+ */
+dbnode_t **
+db_owners(db_t *db, const char *path)
+{
+	const char *name, *paths, *pool;
+	dbnode_t **owners, *dbnode;
+	const struct db_bin_file *files;
+	const struct db_bin_hdr *hdr;
+	const struct db_bin_pkg *pkgs;
+	size_t n;
+	struct db_owner *owner;
+	uint32_t mask, npkgs, nslots, pathsize, pkg, slot;
+	uint64_t hash;
+
+	path = db_relpath(path);
+	owners = xcalloc(1, sizeof(dbnode_t *));
+	n = 0;
+
+	if (db->map && (nslots = db_bin_files(db->map, &files, &paths))) {
+		hdr = (const struct db_bin_hdr *)db->map;
+		(void)db_bin_data(db->map, &pkgs, &pool);
+		npkgs = db_get32(hdr->b_npkgs);
+		pathsize = db_get32(hdr->b_pathsize);
+		hash = hash_data(path, strlen(path));
+		mask = nslots - 1;
+		for (slot = hash & mask; (pkg = db_get32(files[slot].f_pkg));
+		     slot = (slot + 1) & mask) {
+			if (db_get32(files[slot].f_hash) != (uint32_t)hash ||
+			    pkg > npkgs ||
+			    db_get32(files[slot].f_path) >= pathsize ||
+			    strcmp(paths + db_get32(files[slot].f_path), path))
+				continue;
+			name = pool + db_get32(pkgs[pkg-1].p_name);
+			/* a package changed since is not what db.bin says */
+			if (!(dbnode = db_find(db, name)) ||
+			    dbnode->binidx != pkg)
+				continue;
+			owners = xrealloc(owners, (n+2) * sizeof(dbnode_t *));
+			owners[n++] = dbnode;
+		}
+	}
+
+	if (!db->files) {
+		db->files = htab_new();
+		for (dbnode = db->nodes; dbnode; dbnode = dbnode->next) {
+			if (!dbnode->binidx)
+				db_files_add(db, dbnode);
+		}
+	}
+	for (owner = htab_find(db->files, path); owner; owner = owner->next) {
+		owners = xrealloc(owners, (n+2) * sizeof(dbnode_t *));
+		owners[n++] = owner->node;
+	}
+
+	owners[n] = NULL;
+	return (owners);
+}
+
+/*
+ * Throw away what was loaded and load the database again, to see changes
+ * made by someone else.  Our own are better applied with db_add(),
+ * db_remove() and db_replace().
+ */
+void
+db_reload(db_t *db)
+{
+	db_nodes_free(db->nodes);
+	db->nodes = NULL;
+	htab_free(db->index);
+	db->index = NULL;
+	htab_free(db->files);
+	db->files = NULL;
+	htab_free(db->rdepends);
+	db->rdepends = NULL;
+	db_unmap(db);
+
+	db_map(db);
+	db_load(db);
+}
+
+/*
+ * Return how many installed packages depend on package, whether it is
+ * installed or not.  The counts are taken on first use and kept up to
+ * date with the database.
+ */
+size_t
+db_rdepends(db_t *db, const char *package)
 {
-	char mypath[PATH_MAX];
 	dbnode_t *dbnode;
+	struct db_refs *refs;
 
-	dbnode = xcalloc(1, sizeof(dbnode_t));
+	if (!db->rdepends) {
+		db->rdepends = htab_new();
+		for (dbnode = db->nodes; dbnode; dbnode = dbnode->next)
+			db_refs_count(db, dbnode, 1);
+	}
+	if (!(refs = htab_find(db->rdepends, package)))
+		return (0);
+	return (refs->refs);
+}
 
-	bzero(mypath, sizeof(char) * PATH_MAX);
-	snprintf(mypath, PATH_MAX, "%s/manifest", path);
-	if (access(mypath, R_OK) == -1) {
-		free(dbnode);
+void
+db_remove(db_t *db, const char *package)
+{
+	dbnode_t *dbnode, **prevp;
+
+	for (prevp = &db->nodes; (dbnode = *prevp); prevp = &dbnode->next) {
+		if (!strcmp(dbnode->name, package))
+			break;
+	}
+	if (!dbnode)
+		return;
+
+	if (db->index)
+		htab_remove(db->index, dbnode->name);
+	if (db->files && !dbnode->binidx)
+		db_files_remove(db, dbnode);
+	if (db->rdepends)
+		db_refs_count(db, dbnode, -1);
+	*prevp = dbnode->next;
+	if (dbnode->pkg)
+		manifest_free(dbnode->pkg);
+	free(dbnode);
+}
+
+/*
+ * Make mf, which the database takes over, the manifest of its package,
+ * whether it was known or not.
+ */
+dbnode_t *
+db_replace(db_t *db, manifest_t *mf, int automatic)
+{
+	dbnode_t *dbnode;
+
+	if (!(dbnode = db_find(db, mf->name)))
+		return (db_add(db, mf, automatic));
+
+	if (db->index)
+		htab_remove(db->index, dbnode->name);
+	if (db->files && !dbnode->binidx)
+		db_files_remove(db, dbnode);
+	if (db->rdepends)
+		db_refs_count(db, dbnode, -1);
+	if (dbnode->pkg)
+		manifest_free(dbnode->pkg);
+	dbnode->name = mf->name;
+	dbnode->release = mf->release;
+	dbnode->automatic = automatic;
+	dbnode->pkg = mf;
+	dbnode->data = NULL;
+	dbnode->size = 0;
+	dbnode->binidx = 0;
+	if (db->index)
+		htab_insert(db->index, dbnode->name, dbnode);
+	if (db->files)
+		db_files_add(db, dbnode);
+	if (db->rdepends)
+		db_refs_count(db, dbnode, 1);
+	return (dbnode);
+}
+
+dbnode_t *
+db_find(db_t *db, const char *package)
+{
+	dbnode_t *node;
+
+	if (db->index)
+		return (htab_find(db->index, package));
+
+	for (node = db->nodes; node; /* void */) {
+		if (!strcmp(node->name, package))
+			return (node);
+		node = node->next;
+	}
+	return (NULL);
+}
+
+/*
+ * Return the manifests of a mapped db.bin, along with its packages and
+ * string pool.
+ */
+static const char *
+db_bin_data(const char *map, const struct db_bin_pkg **pkgs, const char **pool)
+{
+	const struct db_bin_hdr *hdr = (const struct db_bin_hdr *)map;
+
+	*pkgs = (const struct db_bin_pkg *)(map + sizeof(*hdr));
+	*pool = (const char *)(*pkgs + db_get32(hdr->b_npkgs));
+	return (*pool + db_get32(hdr->b_poolsize));
+}
+
+static struct db_entry *
+db_bin_entries(const char *map, size_t *np)
+{
+	const char *data, *pool;
+	const struct db_bin_pkg *pkgs;
+	struct db_entry *entries;
+	uint32_t idx, npkgs;
+
+	data = db_bin_data(map, &pkgs, &pool);
+	npkgs = db_get32(((const struct db_bin_hdr *)map)->b_npkgs);
+	entries = xcalloc(npkgs + 1, sizeof(struct db_entry));
+	for (idx = 0; idx < npkgs; ++idx) {
+		entries[idx].name = pool + db_get32(pkgs[idx].p_name);
+		entries[idx].release = (int)db_get32(pkgs[idx].p_release);
+		entries[idx].flags = db_get32(pkgs[idx].p_flags);
+		entries[idx].data = data + db_get64(pkgs[idx].p_offset);
+		entries[idx].size = db_get32(pkgs[idx].p_size);
+		entries[idx].binidx = idx + 1;
+	}
+	*np = npkgs;
+	return (entries);
+}
+
+static uint32_t
+db_bin_files(const char *map, const struct db_bin_file **files,
+	     const char **paths)
+{
+	const struct db_bin_hdr *hdr = (const struct db_bin_hdr *)map;
+	const char *data, *pool;
+	const struct db_bin_pkg *pkgs;
+	uint32_t nslots;
+
+	data = db_bin_data(map, &pkgs, &pool);
+	nslots = db_get32(hdr->b_nslots);
+	*files = (const struct db_bin_file *)(data + db_get64(hdr->b_datasize));
+	*paths = (const char *)(*files + nslots);
+	return (nslots);
+}
+
+/*
+ * Read the serial and the size of the db.bin at path, checking no more of
+ * it than its header.  Return -1 if there is none to log against.
+ */
+static int
+db_bin_head(const char *path, uint32_t *serial, size_t *lenp)
+{
+	int fd;
+	struct db_bin_hdr hdr;
+	struct stat sb;
+
+	if ((fd = open(path, O_RDONLY|O_CLOEXEC)) == -1)
+		return (-1);
+	if (fstat(fd, &sb) == -1 ||
+	    pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+	    memcmp(hdr.b_magic, DB_BIN_MAG, sizeof(hdr.b_magic)) ||
+	    db_get32(hdr.b_version) != DB_BIN_VERSION) {
+		close(fd);
+		return (-1);
+	}
+	close(fd);
+
+	*serial = db_get32(hdr.b_serial);
+	*lenp = (size_t)sb.st_size;
+	return (0);
+}
+
+/*
+ * Build the files and paths of a db.bin of entries, which must be in the
+ * order they are written.  Return -1 with errno set if they do not fit.
+ */
+static int
+db_bin_index(struct db_entry *entries, size_t n, struct db_bin_file **filesp,
+	     uint32_t *nslotsp, char **pathsp, uint32_t *pathsizep)
+{
+	arena_t *arena;
+	char *paths;
+	const char *path;
+	int shared;
+	manifest_iter_t iter;
+	manifest_node_t *node;
+	manifest_t **mfs;
+	size_t cap, idx, len, nfiles, pathsize, used;
+	struct db_bin_file *files;
+	uint32_t mask, nslots, off, slot;
+	uint64_t hash;
+
+	arena = arena_new();
+	mfs = xcalloc(n + 1, sizeof(manifest_t *));
+	nfiles = 0;
+	for (idx = 0; idx < n; ++idx) {
+		mfs[idx] = manifest_unpack(entries[idx].data, entries[idx].size,
+					   arena);
+		if (mfs[idx])
+			nfiles += mfs[idx]->nnodes;
+	}
+	if (nfiles > UINT32_MAX / 4) {
+		free(mfs);
+		arena_free(arena);
+		errno = EFBIG;
+		return (-1);
+	}
+	for (nslots = nfiles ? 1 : 0; nslots && nslots < 2 * nfiles; /* void */)
+		nslots <<= 1;
+	mask = nslots - 1;
+
+	files = xcalloc(nslots + 1, sizeof(struct db_bin_file));
+	paths = NULL;
+	pathsize = cap = used = 0;
+	for (idx = 0; idx < n; ++idx) {
+		if (!mfs[idx])
+			continue;
+		manifest_iter_init(&iter, mfs[idx]);
+		/* trust nnodes no further than to keep the table half empty */
+		while (used < nfiles && (node = manifest_iter_next(&iter))) {
+			path = db_relpath(node->path);
+			len = strlen(path) + 1;
+			hash = hash_data(path, len - 1);
+
+			/* a path several packages own is only stored once */
+			shared = 0;
+			off = 0;
+			for (slot = hash & mask; db_get32(files[slot].f_pkg);
+			     slot = (slot + 1) & mask) {
+				if (db_get32(files[slot].f_hash) !=
+				    (uint32_t)hash ||
+				    strcmp(paths + db_get32(files[slot].f_path),
+					   path))
+					continue;
+				if (db_get32(files[slot].f_pkg) == idx + 1)
+					break;
+				shared = 1;
+				off = db_get32(files[slot].f_path);
+			}
+			if (db_get32(files[slot].f_pkg))
+				continue;
+
+			if (!shared) {
+				if (pathsize + len > UINT32_MAX) {
+					free(paths);
+					free(files);
+					free(mfs);
+					arena_free(arena);
+					errno = EFBIG;
+					return (-1);
+				}
+				if (pathsize + len > cap) {
+					cap = cap ? cap * 2 : 4096;
+					if (cap < pathsize + len)
+						cap = pathsize + len;
+					paths = xrealloc(paths, cap);
+				}
+				memcpy(paths + pathsize, path, len);
+				off = (uint32_t)pathsize;
+				pathsize += len;
+			}
+			db_put32(files[slot].f_hash, (uint32_t)hash);
+			db_put32(files[slot].f_pkg, (uint32_t)idx + 1);
+			db_put32(files[slot].f_path, off);
+			++used;
+		}
+	}
+	free(mfs);
+	arena_free(arena);
+
+	*filesp = files;
+	*nslotsp = nslots;
+	*pathsp = paths;
+	*pathsizep = (uint32_t)pathsize;
+	return (0);
+}
+
+/*
+ * Map the db.bin at path, or return NULL if there is none.  One that does
+ * not check out is complained about and otherwise treated the same, except
+ * for one of another version which is quietly rebuilt.
+ */
+static char *
+db_bin_open(const char *path, size_t *lenp)
+{
+	char *map;
+	const char *data, *paths, *pool;
+	int fd;
+	const struct db_bin_file *files;
+	const struct db_bin_hdr *hdr;
+	const struct db_bin_pkg *pkgs;
+	struct stat sb;
+	uint32_t idx, npkgs, nslots, pathsize, poolsize;
+	uint64_t datasize, len;
+
+	if ((fd = open(path, O_RDONLY|O_CLOEXEC)) == -1) {
+		if (errno != ENOENT)
+			warn("%s", path);
+		return (NULL);
+	}
+	if (fstat(fd, &sb) == -1 || sb.st_size < (off_t)sizeof(*hdr)) {
+		close(fd);
+		warnx("%s: ignoring corrupt database", path);
+		return (NULL);
+	}
+	map = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		warn("mmap: %s", path);
 		return (NULL);
 	}
-	dbnode->pkg = manifest_parse(mypath);
+
+	hdr = (const struct db_bin_hdr *)map;
+	if (!memcmp(hdr->b_magic, DB_BIN_MAG, sizeof(hdr->b_magic)) &&
+	    db_get32(hdr->b_version) != DB_BIN_VERSION) {
+		munmap(map, (size_t)sb.st_size);
+		return (NULL);
+	}
+
+	npkgs = db_get32(hdr->b_npkgs);
+	poolsize = db_get32(hdr->b_poolsize);
+	datasize = db_get64(hdr->b_datasize);
+	nslots = db_get32(hdr->b_nslots);
+	pathsize = db_get32(hdr->b_pathsize);
+	len = sizeof(*hdr) + sizeof(struct db_bin_pkg) * (uint64_t)npkgs +
+		poolsize + datasize +
+		sizeof(struct db_bin_file) * (uint64_t)nslots + pathsize;
+	if (memcmp(hdr->b_magic, DB_BIN_MAG, sizeof(hdr->b_magic)) ||
+	    datasize > (uint64_t)sb.st_size ||
+	    len != (uint64_t)sb.st_size ||
+	    (nslots & (nslots - 1)))
+		goto corrupt;
+
+	/* the slots themselves are checked as they are probed */
+	data = db_bin_data(map, &pkgs, &pool);
+	(void)db_bin_files(map, &files, &paths);
+	if ((poolsize && data[-1] != '\0') ||
+	    (pathsize && paths[pathsize-1] != '\0'))
+		goto corrupt;
+	for (idx = 0; idx < npkgs; ++idx) {
+		if (db_get32(pkgs[idx].p_name) >= poolsize ||
+		    db_get64(pkgs[idx].p_offset) > datasize ||
+		    db_get32(pkgs[idx].p_size) >
+		    datasize - db_get64(pkgs[idx].p_offset))
+			goto corrupt;
+	}
+
+	*lenp = (size_t)sb.st_size;
+	return (map);
+
+corrupt:
+	munmap(map, (size_t)sb.st_size);
+	warnx("%s: ignoring corrupt database", path);
+	return (NULL);
+}
+
+static uint32_t
+db_bin_serial(const char *map)
+{
+	return (db_get32(((const struct db_bin_hdr *)map)->b_serial));
+}
+
+/*
+ * Replace db.bin with entries, which must be sorted.  Return -1 with errno
+ * set if it could not be written, the previous one is left alone then.
+ */
+static int
+db_bin_write(db_t *db, struct db_entry *entries, size_t n, uint32_t serial)
+{
+	FILE *fp;
+	char bin[PATH_MAX], *paths, tmp[PATH_MAX];
+	int error, fd;
+	size_t idx, poolsize;
+	struct db_bin_file *files;
+	struct db_bin_hdr hdr;
+	struct db_bin_pkg pkg;
+	uint32_t nslots, pathsize;
+	uint64_t offset;
+
+	poolsize = 0;
+	offset = 0;
+	for (idx = 0; idx < n; ++idx) {
+		poolsize += strlen(entries[idx].name) + 1;
+		offset += entries[idx].size;
+	}
+	if (n > UINT32_MAX || poolsize > UINT32_MAX) {
+		errno = EFBIG;
+		return (-1);
+	}
+	if (db_bin_index(entries, n, &files, &nslots, &paths, &pathsize) == -1)
+		return (-1);
+
+	bzero(&hdr, sizeof(hdr));
+	memcpy(hdr.b_magic, DB_BIN_MAG, sizeof(hdr.b_magic));
+	db_put32(hdr.b_version, DB_BIN_VERSION);
+	db_put32(hdr.b_serial, serial);
+	db_put32(hdr.b_npkgs, (uint32_t)n);
+	db_put32(hdr.b_poolsize, (uint32_t)poolsize);
+	db_put64(hdr.b_datasize, offset);
+	db_put32(hdr.b_nslots, nslots);
+	db_put32(hdr.b_pathsize, pathsize);
+
+	snprintf(bin, PATH_MAX, "%s/db.bin", db->path);
+	snprintf(tmp, PATH_MAX, "%s/db.bin.XXXXXX", db->path);
+	if ((fd = mkstemp(tmp)) == -1) {
+		error = errno;
+		free(files);
+		free(paths);
+		errno = error;
+		return (-1);
+	}
+	if (fchmod(fd, 0644) == -1 || !(fp = fdopen(fd, "w"))) {
+		error = errno;
+		close(fd);
+		goto fail;
+	}
+
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	poolsize = 0;
+	offset = 0;
+	for (idx = 0; idx < n; ++idx) {
+		db_put32(pkg.p_name, (uint32_t)poolsize);
+		db_put32(pkg.p_release, (uint32_t)entries[idx].release);
+		db_put32(pkg.p_flags, entries[idx].flags);
+		db_put32(pkg.p_size, (uint32_t)entries[idx].size);
+		db_put64(pkg.p_offset, offset);
+		fwrite(&pkg, sizeof(pkg), 1, fp);
+		poolsize += strlen(entries[idx].name) + 1;
+		offset += entries[idx].size;
+	}
+	for (idx = 0; idx < n; ++idx)
+		fwrite(entries[idx].name, strlen(entries[idx].name) + 1, 1, fp);
+	for (idx = 0; idx < n; ++idx)
+		fwrite(entries[idx].data, entries[idx].size, 1, fp);
+	fwrite(files, sizeof(struct db_bin_file), nslots, fp);
+	if (pathsize)
+		fwrite(paths, pathsize, 1, fp);
+	free(files);
+	files = NULL;
+	free(paths);
+	paths = NULL;
+
+	if (ferror(fp)) {
+		error = errno;
+		fclose(fp);
+		goto fail;
+	}
+	if (fclose(fp) == EOF) {
+		error = errno;
+		goto fail;
+	}
+	if (rename(tmp, bin) == -1) {
+		error = errno;
+		goto fail;
+	}
+	return (0);
+
+fail:
+	free(files);
+	free(paths);
+	unlink(tmp);
+	errno = error;
+	return (-1);
+}
+
+/*
+ * Write entries, which must be sorted, to a new db.bin with an empty log.
+ * Readers that catch db.bin and db.log in between tell from the serials.
+ */
+static int
+db_compact(db_t *db, struct db_entry *entries, size_t n, uint32_t serial)
+{
+	if (db_bin_write(db, entries, n, serial) == -1 ||
+	    db_log_create(db, serial) == -1)
+		return (-1);
+	db->logserial = serial;
+	db->logend = sizeof(struct db_log_hdr);
+	return (0);
+}
+
+static void
+db_entries_free(struct db_entry *entries, size_t n)
+{
+	size_t idx;
+
+	for (idx = 0; idx < n; ++idx)
+		free(entries[idx].owned);
+	free(entries);
+}
+
+static int
+db_entry_cmp(const void *p1, const void *p2)
+{
+	const struct db_entry *e1 = p1, *e2 = p2;
+
+	return (strcmp(e1->name, e2->name));
+}
+
+/*
+ * Index the paths of node, which db.bin does not, by the time db_owners()
+ * has been asked for them.
+ */
+static void
+db_files_add(db_t *db, dbnode_t *node)
+{
+	const char *path;
+	manifest_iter_t iter;
+	manifest_node_t *mfnode;
+	struct db_owner *head, *owner;
+
+	manifest_iter_init(&iter, db_manifest(db, node));
+	while ((mfnode = manifest_iter_next(&iter))) {
+		owner = arena_alloc(db->arena, sizeof(struct db_owner));
+		owner->node = node;
+		path = db_relpath(mfnode->path);
+		if ((head = htab_find(db->files, path))) {
+			owner->path = head->path;
+			owner->next = head->next;
+			head->next = owner;
+		}
+		else {
+			owner->path = arena_strdup(db->arena, path);
+			htab_insert(db->files, owner->path, owner);
+		}
+	}
+}
+
+static void
+db_files_remove(db_t *db, dbnode_t *node)
+{
+	manifest_iter_t iter;
+	manifest_node_t *mfnode;
+	struct db_owner *head, **prevp;
+
+	manifest_iter_init(&iter, db_manifest(db, node));
+	while ((mfnode = manifest_iter_next(&iter))) {
+		if (!(head = htab_find(db->files, db_relpath(mfnode->path))))
+			continue;
+		if (head->node == node) {
+			htab_remove(db->files, head->path);
+			if (head->next)
+				htab_insert(db->files, head->path, head->next);
+			continue;
+		}
+		for (prevp = &head->next; *prevp; prevp = &(*prevp)->next) {
+			if ((*prevp)->node == node) {
+				*prevp = (*prevp)->next;
+				break;
+			}
+		}
+	}
+}
+
+static uint32_t
+db_get32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+		(uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+}
+
+static uint64_t
+db_get64(const uint8_t *p)
+{
+	return ((uint64_t)db_get32(p) | (uint64_t)db_get32(p + 4) << 32);
+}
+
+/*
+ * Import the package of the directory path into entry, or return -1 if it
+ * does not hold one.
+ */
+static int
+db_import(const char *path, struct db_entry *entry)
+{
+	char mypath[PATH_MAX];
+	manifest_t *mf;
+	size_t namelen, size;
+	void *data;
+
+	bzero(mypath, sizeof(char) * PATH_MAX);
+	snprintf(mypath, PATH_MAX, "%s/manifest", path);
+	if (access(mypath, R_OK) == -1)
+		return (-1);
+	mf = manifest_parse(mypath);
+
+	/* the name and the packed manifest go together */
+	bzero(entry, sizeof(*entry));
+	data = manifest_pack(mf, &size);
+	namelen = strlen(mf->name) + 1;
+	entry->owned = xmalloc(namelen + size);
+	memcpy(entry->owned, mf->name, namelen);
+	memcpy((char *)entry->owned + namelen, data, size);
+	entry->name = entry->owned;
+	entry->release = mf->release;
+	entry->data = (char *)entry->owned + namelen;
+	entry->size = size;
+	free(data);
+	manifest_free(mf);
 
 	bzero(mypath, sizeof(char) * PATH_MAX);
 	snprintf(mypath, PATH_MAX, "%s/automatic", path);
 	if (access(mypath, R_OK) == 0)
-		dbnode->automatic = 1;
+		entry->flags = DB_BIN_AUTOMATIC;
 
-	return (dbnode);
+	return (0);
 }
 
-void
-db_load(db_t *db)
+/*
+ * Serialize the writers of the database.  Return the descriptor holding
+ * the lock, or -1 with errno set.
+ */
+static int
+db_lock(db_t *db)
+{
+	char path[PATH_MAX];
+	int error, fd;
+
+	snprintf(path, PATH_MAX, "%s/lock", db->path);
+	if ((fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0644)) == -1)
+		return (-1);
+	if (flock(fd, LOCK_EX) == -1) {
+		error = errno;
+		close(fd);
+		errno = error;
+		return (-1);
+	}
+	return (fd);
+}
+
+/*
+ * Replace db.log with an empty one for the db.bin of the given serial.
+ */
+static int
+db_log_create(db_t *db, uint32_t serial)
+{
+	char log[PATH_MAX], tmp[PATH_MAX];
+	int error, fd;
+	struct db_log_hdr hdr;
+
+	bzero(&hdr, sizeof(hdr));
+	memcpy(hdr.l_magic, DB_LOG_MAG, sizeof(hdr.l_magic));
+	db_put32(hdr.l_serial, serial);
+
+	snprintf(log, PATH_MAX, "%s/db.log", db->path);
+	snprintf(tmp, PATH_MAX, "%s/db.log.XXXXXX", db->path);
+	if ((fd = mkstemp(tmp)) == -1)
+		return (-1);
+	if (fchmod(fd, 0644) == -1 ||
+	    write(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr)) {
+		error = errno;
+		close(fd);
+		goto fail;
+	}
+	if (close(fd) == -1 || rename(tmp, log) == -1) {
+		error = errno;
+		goto fail;
+	}
+	return (0);
+
+fail:
+	unlink(tmp);
+	errno = error;
+	return (-1);
+}
+
+/*
+ * Read the record of the mapped log at *pos into entry and move past it.
+ * Return 0 at the end of the log, or of what can be trusted of it.
+ */
+static int
+db_log_next(const char *map, size_t len, size_t *pos, struct db_entry *entry)
+{
+	const struct db_log_rec *rec;
+	size_t left;
+	uint32_t namelen, size;
+
+	if (len - *pos < sizeof(*rec))
+		return (0);
+	rec = (const struct db_log_rec *)(map + *pos);
+	left = len - *pos - sizeof(*rec);
+	namelen = db_get32(rec->r_namelen);
+	size = db_get32(rec->r_size);
+	if (namelen == 0 || namelen > left || size > left - namelen ||
+	    map[*pos + sizeof(*rec) + namelen - 1] != '\0')
+		return (0);
+
+	entry->name = map + *pos + sizeof(*rec);
+	entry->release = (int)db_get32(rec->r_release);
+	entry->flags = db_get32(rec->r_flags);
+	entry->data = entry->name + namelen;
+	entry->size = size;
+	entry->owned = NULL;
+	entry->binidx = 0;
+	*pos += sizeof(*rec) + namelen + size;
+	return (1);
+}
+
+/*
+ * Map the db.log at path and return its serial in *serial, or NULL if
+ * there is none that can be used.
+ */
+static char *
+db_log_open(const char *path, size_t *lenp, uint32_t *serial)
+{
+	char *map;
+	int fd;
+	const struct db_log_hdr *hdr;
+	struct stat sb;
+
+	if ((fd = open(path, O_RDONLY|O_CLOEXEC)) == -1) {
+		if (errno != ENOENT)
+			warn("%s", path);
+		return (NULL);
+	}
+	if (fstat(fd, &sb) == -1 || sb.st_size < (off_t)sizeof(*hdr)) {
+		close(fd);
+		warnx("%s: ignoring corrupt log", path);
+		return (NULL);
+	}
+	map = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		warn("mmap: %s", path);
+		return (NULL);
+	}
+
+	hdr = (const struct db_log_hdr *)map;
+	if (memcmp(hdr->l_magic, DB_LOG_MAG, sizeof(hdr->l_magic))) {
+		munmap(map, (size_t)sb.st_size);
+		warnx("%s: ignoring corrupt log", path);
+		return (NULL);
+	}
+	*serial = db_get32(hdr->l_serial);
+	*lenp = (size_t)sb.st_size;
+	return (map);
+}
+
+/*
+ * Map db.bin and the db.log that goes with it.  Writers replace db.bin
+ * first, so a log newer than db.bin means db.bin was replaced after it was
+ * mapped, and it is mapped again.
+ */
+static void
+db_map(db_t *db)
+{
+	char bin[PATH_MAX], log[PATH_MAX];
+	int tries;
+	uint32_t serial;
+
+	snprintf(bin, PATH_MAX, "%s/db.bin", db->path);
+	snprintf(log, PATH_MAX, "%s/db.log", db->path);
+	for (tries = 0; /* void */; ++tries) {
+		if (!(db->map = db_bin_open(bin, &db->maplen)))
+			return;
+		if (!(db->logmap = db_log_open(log, &db->loglen, &serial)))
+			return;
+		if (serial == db_bin_serial(db->map))
+			return;
+
+		munmap(db->logmap, db->loglen);
+		db->logmap = NULL;
+		if ((int32_t)(serial - db_bin_serial(db->map)) < 0 ||
+		    tries == 2)
+			return;
+		munmap(db->map, db->maplen);
+	}
+}
+
+static void
+db_nodes_free(dbnode_t *nodes)
+{
+	dbnode_t *tmp;
+
+	while (nodes) {
+		tmp = nodes->next;
+		if (nodes->pkg)
+			manifest_free(nodes->pkg);
+		free(nodes);
+		nodes = tmp;
+	}
+}
+
+static void
+db_put32(uint8_t *p, uint32_t val)
+{
+	p[0] = val & 0xff;
+	p[1] = (val >> 8) & 0xff;
+	p[2] = (val >> 16) & 0xff;
+	p[3] = (val >> 24) & 0xff;
+}
+
+static void
+db_put64(uint8_t *p, uint64_t val)
+{
+	db_put32(p, (uint32_t)val);
+	db_put32(p + 4, (uint32_t)(val >> 32));
+}
+
+/*
+ * Write a new db.bin and log of the given serial out of the per-package
+ * directories, with change applied if they do not have it yet.
+ */
+static void
+db_rebuild(db_t *db, struct db_entry *change, uint32_t serial)
+{
+	size_t n;
+	struct db_entry *entries;
+	struct db_set set;
+
+	entries = db_scan(db, &n);
+	db_set_init(&set, entries, n);
+	if (change)
+		db_set_apply(&set, change);
+	entries = db_set_finish(&set, &n);
+	if (db_compact(db, entries, n, serial) == -1)
+		err(1, "%s/db.bin", db->path);
+	db_entries_free(entries, n);
+}
+
+/*
+ * Return path without its leading slashes, the form the files are
+ * indexed under.
+ */
+static const char *
+db_relpath(const char *path)
+{
+	while (*path == '/')
+		++path;
+	return (path);
+}
+
+/*
+ * Count the depends of node in, or out of, the rdepends of the database.
+ * A package depending on itself is not counted.
+ */
+static void
+db_refs_count(db_t *db, dbnode_t *node, int delta)
+{
+	manifest_depend_t *depend;
+	struct db_refs *refs;
+
+	depend = db_manifest(db, node)->depends;
+	for (/* void */; depend; depend = depend->next) {
+		if (!strcmp(depend->name, node->name))
+			continue;
+		if (!(refs = htab_find(db->rdepends, depend->name))) {
+			refs = arena_alloc(db->arena, sizeof(struct db_refs));
+			refs->name = arena_strdup(db->arena, depend->name);
+			htab_insert(db->rdepends, refs->name, refs);
+		}
+		if (delta > 0)
+			++refs->refs;
+		else if (refs->refs > 0)
+			--refs->refs;
+	}
+}
+
+/*
+ * Import the packages of the per-package directories.
+ */
+static struct db_entry *
+db_scan(db_t *db, size_t *np)
 {
 	DIR *dirp;
 	struct dirent *dirent;
-	dbnode_t *dbnode, *tmp;
 	char path[PATH_MAX];
+	size_t cap, n;
+	struct db_entry *entries;
 
 	if (!(dirp = opendir(db->path)))
 		err(1, "opendir: %s", db->path);
+	entries = NULL;
+	cap = n = 0;
 	while ((dirent = readdir(dirp))) {
 		if (!strcmp(dirent->d_name, ".") ||
 		    !strcmp(dirent->d_name, ".."))
@@ -113,44 +1563,104 @@ db_load(db_t *db)
 		if (dirent->d_type != DT_DIR)
 			continue;
 
+		if (n == cap) {
+			cap = cap ? cap * 2 : 64;
+			entries = xrealloc(entries,
+					   cap * sizeof(struct db_entry));
+		}
 		bzero(path, sizeof(char) * PATH_MAX);
 		snprintf(path, PATH_MAX, "%s/%s", db->path, dirent->d_name);
-		dbnode = db_import(path);
-
-		if (!db->nodes)
-			db->nodes = dbnode;
-		else {
-			for (tmp = db->nodes; tmp->next; /* void */)
-				tmp = tmp->next;
-			tmp->next = dbnode;
-		}
+		if (db_import(path, &entries[n]) == 0)
+			++n;
 	}
 	(void)closedir(dirp);
+	*np = n;
+	return (entries);
 }
 
-void
-db_reload(db_t *db)
+/*
+ * Apply change to set, which takes over what it owns.
+ */
+static void
+db_set_apply(struct db_set *set, const struct db_entry *change)
 {
-	dbnode_t *dbnode, *tmp;
+	uintptr_t slot;
 
-	for (dbnode = db->nodes; dbnode; /* void */) {
-		tmp = dbnode->next;
-		manifest_free(dbnode->pkg);
-		free(dbnode);
-		dbnode = tmp;
+	if ((slot = (uintptr_t)htab_remove(set->names, change->name))) {
+		free(set->entries[slot-1].owned);
+		set->entries[slot-1].owned = NULL;
+		set->entries[slot-1].name = NULL;
 	}
-	db_load(db);
+	if (change->flags & DB_LOG_REMOVE) {
+		free(change->owned);
+		return;
+	}
+
+	if (!slot) {
+		if (set->n == set->cap) {
+			set->cap = set->cap ? set->cap * 2 : 64;
+			set->entries = xrealloc(set->entries,
+						set->cap * sizeof(struct db_entry));
+		}
+		slot = ++set->n;
+	}
+	set->entries[slot-1] = *change;
+	htab_insert(set->names, set->entries[slot-1].name, (void *)slot);
 }
 
-dbnode_t *
-db_find(db_t *db, const char *package)
+/*
+ * Return the entries of set, sorted and without the removed ones.
+ */
+static struct db_entry *
+db_set_finish(struct db_set *set, size_t *np)
 {
-	dbnode_t *node;
+	size_t idx, n;
 
-	for (node = db->nodes; node; /* void */) {
-		if (!strcmp(node->pkg->name, package))
-			return (node);
-		node = node->next;
+	for (idx = n = 0; idx < set->n; ++idx) {
+		if (set->entries[idx].name)
+			set->entries[n++] = set->entries[idx];
 	}
-	return (NULL);
+	qsort(set->entries, n, sizeof(struct db_entry), db_entry_cmp);
+	htab_free(set->names);
+	*np = n;
+	return (set->entries);
+}
+
+static void
+db_set_init(struct db_set *set, struct db_entry *entries, size_t n)
+{
+	size_t idx;
+
+	set->entries = entries;
+	set->n = n;
+	set->cap = n;
+	set->names = htab_new();
+	for (idx = 0; idx < n; ++idx)
+		htab_insert(set->names, entries[idx].name,
+			    (void *)(uintptr_t)(idx + 1));
+}
+
+static void
+db_set_replay(struct db_set *set, const char *log, size_t loglen)
+{
+	size_t pos;
+	struct db_entry entry;
+
+	pos = sizeof(struct db_log_hdr);
+	while (db_log_next(log, loglen, &pos, &entry))
+		db_set_apply(set, &entry);
+}
+
+static void
+db_unmap(db_t *db)
+{
+	if (db->arena)
+		arena_free(db->arena);
+	db->arena = NULL;
+	if (db->logmap)
+		munmap(db->logmap, db->loglen);
+	db->logmap = NULL;
+	if (db->map)
+		munmap(db->map, db->maplen);
+	db->map = NULL;
 }
@@ -28,6 +28,10 @@
 #ifndef __DB_H
 #define __DB_H
 
+#include <stdint.h>
+
+#include "arena.h"
+#include "htab.h"
 #include "manifest.h"
 
 typedef struct db db_t;
@@ -36,21 +40,52 @@ typedef struct dbnode dbnode_t;
 struct db {
 	char		*path;
 	dbnode_t	*nodes;
+	htab_t		*index;		/* nodes by package name */
+	char		*map;		/* db.bin, see db.c */
+	size_t		maplen;
+	char		*logmap;	/* db.log, changes since db.bin */
+	size_t		loglen;
+	uint32_t	logserial;	/* serial and end of db.log as of */
+	size_t		logend;		/* ... our last write to it */
+	arena_t		*arena;		/* manifests loaded from the maps */
+	htab_t		*files;		/* owners of the paths db.bin misses */
+	htab_t		*rdepends;	/* how many packages need a name */
 };
 
+/*
+ * A package is loaded in stages: its name, release and automatic flag
+ * come with the database, its manifest only when db_manifest() asks for
+ * it.
+ */
 struct dbnode {
-	manifest_t	*pkg;
+	const char	*name;
+	int		release;
 	int		automatic;
 
+	manifest_t	*pkg;		/* NULL until loaded */
+	const void	*data;		/* compiled manifest, in a map */
+	size_t		size;
+	uint32_t	binidx;		/* index + 1 in db.bin, 0 if changed */
+
 	dbnode_t	*next;
 };
 
 db_t	*db_init(const char *path);
 void	db_free(db_t *db);
 
+void	db_commit(db_t *db, const char *package, manifest_t *mf,
+		  int automatic);
 void	db_load(db_t *db);
 void	db_reload(db_t *db);
 
+dbnode_t *db_add(db_t *db, manifest_t *mf, int automatic);
+void	db_remove(db_t *db, const char *package);
+dbnode_t *db_replace(db_t *db, manifest_t *mf, int automatic);
+
 dbnode_t *db_find(db_t *db, const char *package);
+manifest_t *db_manifest(db_t *db, dbnode_t *node);
+dbnode_t **db_orphans(db_t *db);
+dbnode_t **db_owners(db_t *db, const char *path);
+size_t	db_rdepends(db_t *db, const char *package);
 
 #endif	/* __DB_H */
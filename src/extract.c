@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2015, Quentin Schwerkolt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif	/* HAVE_CONFIG_H */
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <err.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ar.h"
+#include "mpkg.h"
+#include "utils.h"
+
+static void usage(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+void
+extract_func(config_t *config, int argc, char **argv)
+{
+	ar_info_t *info;
+	ar_t *ar;
+	char arfile[PATH_MAX], parent[PATH_MAX];
+	char *wrkdir;
+	int ch, idx, rv;
+	struct stat sb;
+
+	optreset = 1; optind = 1; opterr = 0;
+	wrkdir = ".";
+	while ((ch = getopt(argc, argv, "C:")) != -1) {
+		switch (ch) {
+		case 'C':
+			wrkdir = optarg;
+			break;
+
+		default:
+			usage("%c -- unknown option", ch);
+			break;
+		}
+	}
+	if ((argc - optind) < 1)
+		usage("no package specified");
+	if ((argc - optind) < 2)
+		usage("no path specified");
+
+	snprintf(arfile, PATH_MAX, "%s/%s/data.a",
+		 config->repodir, argv[optind]);
+	ar = ar_open_read(arfile);
+	ar_set_wrkdir(ar, wrkdir);
+
+	rv = 0;
+	for (idx = optind + 1; idx < argc; ++idx) {
+		if (!(info = ar_find(ar, argv[idx])) && *argv[idx] == '/')
+			info = ar_find(ar, argv[idx] + strspn(argv[idx], "/"));
+		if (!info) {
+			warnx("%s: not found in %s", argv[idx], argv[optind]);
+			rv = 1;
+			continue;
+		}
+
+		snprintf(parent, PATH_MAX, "%s", info->path);
+		mpkg_mkdirs(dirname(parent));
+
+		if (!S_ISDIR(info->mode) || lstat(info->path, &sb) == -1)
+			ar_extract(ar, info);
+		if (config->verbose)
+			printf("%s\n", info->path);
+		free(info);
+	}
+
+	ar_close(ar);
+	if (rv)
+		exit(rv);
+}
+
+static void
+usage(const char *fmt, ...)
+{
+	const char *progname;
+	va_list ap;
+
+	if (fmt) {
+		va_start(ap, fmt);
+		vwarnx(fmt, ap);
+		va_end(ap);
+	}
+
+	progname = getprogname();
+	fprintf(stdout,
+		"usage:\n"
+		"\t%s extract [-C directory] package path [...]\n",
+		progname);
+
+	exit(2);
+}
@@ -0,0 +1,492 @@
+/*
+ * Copyright (c) 2015, Quentin Schwerkolt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif	/* HAVE_CONFIG_H */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif	/* __SSE2__ */
+
+#include "hash.h"
+#include "xalloc.h"
+
+#define HASH_BUFSIZ	(1024 * 1024)
+
+#define SECRETLEN	192
+#define STRIPES		((SECRETLEN - HASH_STRIPE) / 8)	/* per block */
+#define SHORTMAX	240	/* longer inputs go through the stripes */
+
+#define PRIME32_1	0x9E3779B1U
+#define PRIME32_2	0x85EBCA77U
+#define PRIME32_3	0xC2B2AE3DU
+#define PRIME64_1	0x9E3779B185EBCA87ULL
+#define PRIME64_2	0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3	0x165667B19E3779F9ULL
+#define PRIME64_4	0x85EBCA77C2B2AE63ULL
+#define PRIME64_5	0x27D4EB2F165667C5ULL
+
+/*
+ * This is XXH3, 64 bits, with no seed and the default secret; the
+ * stripe loop uses SSE2 where available, which is where the time goes.
+ */
+static const unsigned char secret[SECRETLEN] = {
+	0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe,
+	0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+	0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb,
+	0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+	0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78,
+	0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+	0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e,
+	0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+	0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb,
+	0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+	0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e,
+	0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+	0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f,
+	0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+	0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31,
+	0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+	0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3,
+	0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+	0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49,
+	0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+	0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc,
+	0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+	0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28,
+	0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e
+};
+
+static void	hash_accumulate(uint64_t *acc, const unsigned char *p,
+				const unsigned char *key, size_t nstripes);
+static inline uint64_t	hash_avalanche(uint64_t h);
+#if defined(__SSE2__)
+static inline __m128i	hash_lane(__m128i acc, const unsigned char *p,
+				  const unsigned char *key);
+#endif	/* __SSE2__ */
+static void	hash_consume(uint64_t *acc, size_t *stripes,
+			     const unsigned char *p, size_t nstripes);
+static uint64_t	hash_merge(const uint64_t *acc, uint64_t start);
+static inline uint64_t	hash_mix16(const unsigned char *p,
+				   const unsigned char *key);
+static inline uint64_t	hash_mul128(uint64_t a, uint64_t b);
+static inline uint32_t	hash_read32(const unsigned char *p);
+static inline uint64_t	hash_read64(const unsigned char *p);
+static inline uint64_t	hash_rotl(uint64_t x, int r);
+static void	hash_scramble(uint64_t *acc);
+static uint64_t	hash_short(const unsigned char *p, size_t len);
+static inline uint64_t	hash_swap64(uint64_t x);
+
+void
+hash_init(hash_t *hash)
+{
+	bzero(hash, sizeof(hash_t));
+	hash->acc[0] = PRIME32_3;
+	hash->acc[1] = PRIME64_1;
+	hash->acc[2] = PRIME64_2;
+	hash->acc[3] = PRIME64_3;
+	hash->acc[4] = PRIME64_4;
+	hash->acc[5] = PRIME32_2;
+	hash->acc[6] = PRIME64_5;
+	hash->acc[7] = PRIME32_1;
+}
+
+void
+hash_update(hash_t *hash, const void *data, size_t len)
+{
+	const unsigned char *p, *end;
+	size_t fill, nstripes;
+
+	p = data;
+	end = p + len;
+	hash->total += len;
+
+	if (hash->buflen + len <= sizeof(hash->buf)) {
+		(void)memcpy(hash->buf + hash->buflen, p, len);
+		hash->buflen += len;
+		return;
+	}
+
+	if (hash->buflen) {
+		fill = sizeof(hash->buf) - hash->buflen;
+		(void)memcpy(hash->buf + hash->buflen, p, fill);
+		p += fill;
+		hash_consume(hash->acc, &hash->stripes, hash->buf,
+			     sizeof(hash->buf) / HASH_STRIPE);
+		hash->buflen = 0;
+	}
+
+	/*
+	 * At least one byte is always left behind, as the digest needs
+	 * the last full stripe; the end of the buffer keeps what precedes
+	 * it when that is all there is.
+	 */
+	if (end - p > (ptrdiff_t)sizeof(hash->buf)) {
+		nstripes = (size_t)(end - p - 1) / HASH_STRIPE;
+		hash_consume(hash->acc, &hash->stripes, p, nstripes);
+		p += nstripes * HASH_STRIPE;
+		(void)memcpy(hash->buf + sizeof(hash->buf) - HASH_STRIPE,
+			     p - HASH_STRIPE, HASH_STRIPE);
+	}
+
+	hash->buflen = (size_t)(end - p);
+	(void)memcpy(hash->buf, p, hash->buflen);
+}
+
+uint64_t
+hash_final(hash_t *hash)
+{
+	const unsigned char *p;
+	unsigned char last[HASH_STRIPE];
+	uint64_t acc[8];
+	size_t catchup, nstripes, stripes;
+
+	if (hash->total <= SHORTMAX)
+		return (hash_short(hash->buf, (size_t)hash->total));
+
+	(void)memcpy(acc, hash->acc, sizeof(acc));
+	stripes = hash->stripes;
+	if (hash->buflen >= HASH_STRIPE) {
+		nstripes = (hash->buflen - 1) / HASH_STRIPE;
+		hash_consume(acc, &stripes, hash->buf, nstripes);
+		p = hash->buf + hash->buflen - HASH_STRIPE;
+	}
+	else {
+		catchup = HASH_STRIPE - hash->buflen;
+		(void)memcpy(last, hash->buf + sizeof(hash->buf) - catchup,
+			     catchup);
+		(void)memcpy(last + catchup, hash->buf, hash->buflen);
+		p = last;
+	}
+	hash_accumulate(acc, p, secret + SECRETLEN - HASH_STRIPE - 7, 1);
+
+	return (hash_merge(acc, hash->total * PRIME64_1));
+}
+
+uint64_t
+hash_data(const void *data, size_t len)
+{
+	hash_t hash;
+
+	if (len <= SHORTMAX)
+		return (hash_short(data, len));
+
+	hash_init(&hash);
+	hash_update(&hash, data, len);
+	return (hash_final(&hash));
+}
+
+uint64_t
+hash_fd(int fd, const char *name)
+{
+	char *buf;
+	hash_t hash;
+	ssize_t nbytes;
+
+	buf = xmalloc(HASH_BUFSIZ);
+	hash_init(&hash);
+	while ((nbytes = read(fd, buf, HASH_BUFSIZ)) > 0)
+		hash_update(&hash, buf, (size_t)nbytes);
+	if (nbytes == -1)
+		err(1, "read: %s", name);
+	free(buf);
+	return (hash_final(&hash));
+}
+
+/*
+ * Fold nstripes stripes into the accumulators, the n-th one keyed with
+ * the secret shifted by 8n bytes.
+ */
+static void
+hash_accumulate(uint64_t *acc, const unsigned char *p,
+		const unsigned char *key, size_t nstripes)
+{
+#if defined(__SSE2__)
+	__m128i a0, a1, a2, a3;
+	size_t n;
+
+	a0 = _mm_loadu_si128((const __m128i *)acc);
+	a1 = _mm_loadu_si128((const __m128i *)(acc + 2));
+	a2 = _mm_loadu_si128((const __m128i *)(acc + 4));
+	a3 = _mm_loadu_si128((const __m128i *)(acc + 6));
+	for (n = 0; n < nstripes; ++n, p += HASH_STRIPE, key += 8) {
+		a0 = hash_lane(a0, p, key);
+		a1 = hash_lane(a1, p + 16, key + 16);
+		a2 = hash_lane(a2, p + 32, key + 32);
+		a3 = hash_lane(a3, p + 48, key + 48);
+	}
+	_mm_storeu_si128((__m128i *)acc, a0);
+	_mm_storeu_si128((__m128i *)(acc + 2), a1);
+	_mm_storeu_si128((__m128i *)(acc + 4), a2);
+	_mm_storeu_si128((__m128i *)(acc + 6), a3);
+#else
+	uint64_t dkey, data, lacc[8];
+	size_t idx, n;
+
+	/* kept local: stores through acc could alias the data */
+	(void)memcpy(lacc, acc, sizeof(lacc));
+	for (n = 0; n < nstripes; ++n) {
+		for (idx = 0; idx < 8; ++idx) {
+			data = hash_read64(p + n * HASH_STRIPE + 8 * idx);
+			dkey = data ^ hash_read64(key + 8 * n + 8 * idx);
+			lacc[idx ^ 1] += data;
+			lacc[idx] += (dkey & 0xffffffff) * (dkey >> 32);
+		}
+	}
+	(void)memcpy(acc, lacc, sizeof(lacc));
+#endif	/* __SSE2__ */
+}
+
+static inline uint64_t
+hash_avalanche(uint64_t h)
+{
+	h ^= h >> 37;
+	h *= 0x165667919E3779F9ULL;
+	h ^= h >> 32;
+	return (h);
+}
+
+/*
+ * Accumulate stripes, scrambling the accumulators at every block end.
+ */
+static void
+hash_consume(uint64_t *acc, size_t *stripes, const unsigned char *p,
+	     size_t nstripes)
+{
+	size_t n;
+
+	while (nstripes > 0) {
+		n = STRIPES - *stripes;
+		if (n > nstripes)
+			n = nstripes;
+		hash_accumulate(acc, p, secret + *stripes * 8, n);
+		p += n * HASH_STRIPE;
+		nstripes -= n;
+		if ((*stripes += n) == STRIPES) {
+			hash_scramble(acc);
+			*stripes = 0;
+		}
+	}
+}
+
+static uint64_t
+hash_merge(const uint64_t *acc, uint64_t start)
+{
+	const unsigned char *key;
+	size_t idx;
+
+	key = secret + 11;
+	for (idx = 0; idx < 4; ++idx) {
+		start += hash_mul128(acc[2*idx] ^ hash_read64(key + 16 * idx),
+				     acc[2*idx+1] ^
+				     hash_read64(key + 16 * idx + 8));
+	}
+	return (hash_avalanche(start));
+}
+
+#if defined(__SSE2__)
+/*
+ * Two of the eight accumulators: each gets the product of the low and
+ * high halves of its keyed input, plus its neighbour's input.
+ */
+static inline __m128i
+hash_lane(__m128i acc, const unsigned char *p, const unsigned char *key)
+{
+	__m128i data, dkey, prod;
+
+	data = _mm_loadu_si128((const __m128i *)p);
+	dkey = _mm_xor_si128(data, _mm_loadu_si128((const __m128i *)key));
+	prod = _mm_mul_epu32(dkey,
+			     _mm_shuffle_epi32(dkey, _MM_SHUFFLE(0, 3, 0, 1)));
+	return (_mm_add_epi64(acc, _mm_add_epi64(prod,
+		_mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2)))));
+}
+#endif	/* __SSE2__ */
+
+static inline uint64_t
+hash_mix16(const unsigned char *p, const unsigned char *key)
+{
+	return (hash_mul128(hash_read64(p) ^ hash_read64(key),
+			    hash_read64(p + 8) ^ hash_read64(key + 8)));
+}
+
+/*
+ * Both halves of the 128 bits product, folded together.
+ */
+static inline uint64_t
+hash_mul128(uint64_t a, uint64_t b)
+{
+#if defined(__SIZEOF_INT128__)
+	unsigned __int128 r;
+
+	r = (unsigned __int128)a * b;
+	return ((uint64_t)r ^ (uint64_t)(r >> 64));
+#else
+	uint64_t cross, hihi, hilo, lohi, lolo;
+
+	lolo = (a & 0xffffffff) * (b & 0xffffffff);
+	hilo = (a >> 32) * (b & 0xffffffff);
+	lohi = (a & 0xffffffff) * (b >> 32);
+	hihi = (a >> 32) * (b >> 32);
+	cross = (lolo >> 32) + (hilo & 0xffffffff) + lohi;
+	return (((cross << 32) | (lolo & 0xffffffff)) ^
+		((hilo >> 32) + (cross >> 32) + hihi));
+#endif	/* __SIZEOF_INT128__ */
+}
+
+static inline uint32_t
+hash_read32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+		(uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+}
+
+static inline uint64_t
+hash_read64(const unsigned char *p)
+{
+	return ((uint64_t)hash_read32(p) | (uint64_t)hash_read32(p+4) << 32);
+}
+
+static inline uint64_t
+hash_rotl(uint64_t x, int r)
+{
+	return ((x << r) | (x >> (64 - r)));
+}
+
+static void
+hash_scramble(uint64_t *acc)
+{
+	const unsigned char *key;
+	size_t idx;
+
+	key = secret + SECRETLEN - HASH_STRIPE;
+	for (idx = 0; idx < 8; ++idx) {
+		acc[idx] ^= acc[idx] >> 47;
+		acc[idx] ^= hash_read64(key + 8 * idx);
+		acc[idx] *= PRIME32_1;
+	}
+}
+
+/*
+ * Inputs of up to SHORTMAX bytes are hashed in one go, with a variant
+ * for each size class.
+ */
+static uint64_t
+hash_short(const unsigned char *p, size_t len)
+{
+	uint64_t acc, h, lo, hi;
+	size_t idx;
+
+	if (len == 0) {
+		h = hash_read64(secret + 56) ^ hash_read64(secret + 64);
+		goto xxh64;
+	}
+	if (len <= 3) {
+		h = ((uint64_t)p[0] << 16 | (uint64_t)p[len >> 1] << 24 |
+		     (uint64_t)p[len - 1] | (uint64_t)len << 8) ^
+			(uint64_t)(hash_read32(secret) ^
+				   hash_read32(secret + 4));
+		goto xxh64;
+	}
+	if (len <= 8) {
+		h = ((uint64_t)hash_read32(p + len - 4) +
+		     ((uint64_t)hash_read32(p) << 32)) ^
+			(hash_read64(secret + 8) ^ hash_read64(secret + 16));
+		h ^= hash_rotl(h, 49) ^ hash_rotl(h, 24);
+		h *= 0x9FB21C651E98DF25ULL;
+		h ^= (h >> 35) + len;
+		h *= 0x9FB21C651E98DF25ULL;
+		return (h ^ (h >> 28));
+	}
+	if (len <= 16) {
+		lo = hash_read64(p) ^
+			(hash_read64(secret + 24) ^ hash_read64(secret + 32));
+		hi = hash_read64(p + len - 8) ^
+			(hash_read64(secret + 40) ^ hash_read64(secret + 48));
+		acc = len + hash_swap64(lo) + hi + hash_mul128(lo, hi);
+		return (hash_avalanche(acc));
+	}
+
+	acc = len * PRIME64_1;
+	if (len <= 128) {
+		if (len > 32) {
+			if (len > 64) {
+				if (len > 96) {
+					acc += hash_mix16(p + 48, secret + 96);
+					acc += hash_mix16(p + len - 64,
+							  secret + 112);
+				}
+				acc += hash_mix16(p + 32, secret + 64);
+				acc += hash_mix16(p + len - 48, secret + 80);
+			}
+			acc += hash_mix16(p + 16, secret + 32);
+			acc += hash_mix16(p + len - 32, secret + 48);
+		}
+		acc += hash_mix16(p, secret);
+		acc += hash_mix16(p + len - 16, secret + 16);
+		return (hash_avalanche(acc));
+	}
+
+	for (idx = 0; idx < 8; ++idx)
+		acc += hash_mix16(p + 16 * idx, secret + 16 * idx);
+	acc = hash_avalanche(acc);
+	for (idx = 8; idx < len / 16; ++idx)
+		acc += hash_mix16(p + 16 * idx, secret + 16 * (idx - 8) + 3);
+	acc += hash_mix16(p + len - 16, secret + 136 - 17);
+	return (hash_avalanche(acc));
+
+xxh64:
+	/* the tiniest inputs get the XXH64 avalanche instead */
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return (h);
+}
+
+static inline uint64_t
+hash_swap64(uint64_t x)
+{
+	return ((x << 56) | ((x << 40) & 0x00ff000000000000ULL) |
+		((x << 24) & 0x0000ff0000000000ULL) |
+		((x << 8) & 0x000000ff00000000ULL) |
+		((x >> 8) & 0x00000000ff000000ULL) |
+		((x >> 24) & 0x0000000000ff0000ULL) |
+		((x >> 40) & 0x000000000000ff00ULL) | (x >> 56));
+}
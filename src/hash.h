@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2015, Quentin Schwerkolt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __HASH_H
+#define __HASH_H
+
+#include <sys/types.h>
+
+#include <stdint.h>
+
+#define HASH_LEN	16	/* hex digits of a digest */
+#define HASH_STRIPE	64
+
+/*
+ * XXH3 (64 bits) of a member's contents, computed incrementally.
+ */
+typedef struct hash hash_t;
+
+struct hash {
+	uint64_t	acc[8];
+	unsigned char	buf[4 * HASH_STRIPE];
+	size_t		buflen;
+	size_t		stripes;	/* stripes into the current block */
+	uint64_t	total;
+};
+
+void		hash_init(hash_t *hash);
+void		hash_update(hash_t *hash, const void *data, size_t len);
+uint64_t	hash_final(hash_t *hash);
+
+uint64_t	hash_data(const void *data, size_t len);
+uint64_t	hash_fd(int fd, const char *name);
+
+#endif	/* __HASH_H */
@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2015, Quentin Schwerkolt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif	/* HAVE_CONFIG_H */
+
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "htab.h"
+#include "xalloc.h"
+
+#define HTAB_MINSIZE	64	/* a power of two */
+
+struct htab_slot {
+	uint64_t	hash;
+	const char	*key;		/* NULL for an empty slot */
+	void		*value;
+};
+
+/*
+ * Slots are probed linearly and the table is kept at most half full, so
+ * that a lookup for a missing key ends quickly too.
+ */
+struct htab {
+	struct htab_slot *slots;
+	size_t	size;
+	size_t	count;
+};
+
+static void	htab_grow(htab_t *htab);
+static struct htab_slot *htab_lookup(const htab_t *htab, const char *key,
+				     uint64_t hash);
+
+htab_t *
+htab_new(void)
+{
+	htab_t *htab;
+
+	htab = xcalloc(1, sizeof(htab_t));
+	htab->size = HTAB_MINSIZE;
+	htab->slots = xcalloc(htab->size, sizeof(struct htab_slot));
+	return (htab);
+}
+
+void
+htab_free(htab_t *htab)
+{
+	if (!htab)
+		return;
+	free(htab->slots);
+	free(htab);
+}
+
+void
+htab_insert(htab_t *htab, const char *key, void *value)
+{
+	struct htab_slot *slot;
+	uint64_t hash;
+
+	hash = hash_data(key, strlen(key));
+	slot = htab_lookup(htab, key, hash);
+	if (slot->key)
+		return;
+
+	slot->hash = hash;
+	slot->key = key;
+	slot->value = value;
+	if (++htab->count * 2 > htab->size)
+		htab_grow(htab);
+}
+
+void *
+htab_find(const htab_t *htab, const char *key)
+{
+	struct htab_slot *slot;
+
+	slot = htab_lookup(htab, key, hash_data(key, strlen(key)));
+	return (slot->key ? slot->value : NULL);
+}
+
+/*
+ * Remove key and return its value, or NULL when it is not in the table.
+ */
+void *
+htab_remove(htab_t *htab, const char *key)
+{
+	struct htab_slot *slot;
+	size_t hole, home, idx, mask;
+	void *value;
+
+	slot = htab_lookup(htab, key, hash_data(key, strlen(key)));
+	if (!slot->key)
+		return (NULL);
+	value = slot->value;
+
+	/*
+	 * Move back into the hole every following key whose probe went
+	 * through it, so that no lookup stops short of its key.
+	 */
+	mask = htab->size - 1;
+	hole = (size_t)(slot - htab->slots);
+	for (idx = (hole + 1) & mask; htab->slots[idx].key;
+	     idx = (idx + 1) & mask) {
+		home = (size_t)htab->slots[idx].hash & mask;
+		if (((idx - home) & mask) >= ((idx - hole) & mask)) {
+			htab->slots[hole] = htab->slots[idx];
+			hole = idx;
+		}
+	}
+	memset(&htab->slots[hole], 0, sizeof(struct htab_slot));
+	--htab->count;
+	return (value);
+}
+
+static void
+htab_grow(htab_t *htab)
+{
+	struct htab_slot *old, *slot;
+	size_t idx, oldsize;
+
+	old = htab->slots;
+	oldsize = htab->size;
+	htab->size *= 2;
+	htab->slots = xcalloc(htab->size, sizeof(struct htab_slot));
+
+	for (idx = 0; idx < oldsize; ++idx) {
+		if (!old[idx].key)
+			continue;
+		slot = htab_lookup(htab, old[idx].key, old[idx].hash);
+		*slot = old[idx];
+	}
+	free(old);
+}
+
+/*
+ * Return the slot holding key, or the empty slot where it would go.
+ */
+static struct htab_slot *
+htab_lookup(const htab_t *htab, const char *key, uint64_t hash)
+{
+	struct htab_slot *slot;
+	size_t idx, mask;
+
+	mask = htab->size - 1;
+	for (idx = (size_t)hash & mask; /* void */; idx = (idx + 1) & mask) {
+		slot = &htab->slots[idx];
+		if (!slot->key)
+			return (slot);
+		if (slot->hash == hash && !strcmp(slot->key, key))
+			return (slot);
+	}
+}
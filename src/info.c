@@ -42,6 +42,8 @@
 #include "manifest.h"
 #include "mpkg.h"
 
+static void info_node(db_t *db, dbnode_t *dbnode, int show_deps,
+		      int show_files);
 static void info_show(db_t *db, char **list, int show_deps, int show_files);
 static void usage(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
 
@@ -97,37 +99,42 @@ info_show(db_t *db, char **list, int show_deps, int show_files)
 {
 	dbnode_t *dbnode;
 	int idx;
+
+	if (!list) {
+		for (dbnode = db->nodes; dbnode; dbnode = dbnode->next)
+			info_node(db, dbnode, show_deps, show_files);
+		return;
+	}
+
+	for (idx = 0; list[idx]; ++idx) {
+		if ((dbnode = db_find(db, list[idx])))
+			info_node(db, dbnode, show_deps, show_files);
+	}
+}
+
+static void
+info_node(db_t *db, dbnode_t *dbnode, int show_deps, int show_files)
+{
 	manifest_depend_t *depend;
+	manifest_iter_t iter;
 	manifest_node_t *node;
 
-	for (dbnode = db->nodes; dbnode; /* void */) {
-		if (list) {
-			for (idx = 0; list[idx]; ++idx)
-				if (!strcmp(dbnode->pkg->name, list[idx]))
-					break;
-			if (!list[idx])
-				continue;
-		}
-		printf("%s-%d\n", dbnode->pkg->name, dbnode->pkg->release);
-
-		if (show_deps) {
-			printf("depends:\n");
-			for (depend =
-				     dbnode->pkg->depends; depend; /* void */) {
-				printf("\t%s\n", depend->name);
-				depend = depend->next;
-			}
-		}
+	printf("%s-%d\n", dbnode->name, dbnode->release);
 
-		if (show_files) {
-			printf("content:\n");
-			for (node = dbnode->pkg->nodes; node; /* void */) {
-				printf("\t%s\n", node->path);
-				node = node->next;
-			}
+	if (show_deps) {
+		printf("depends:\n");
+		depend = db_manifest(db, dbnode)->depends;
+		for (/* void */; depend; /* void */) {
+			printf("\t%s\n", depend->name);
+			depend = depend->next;
 		}
+	}
 
-		dbnode = dbnode->next;
+	if (show_files) {
+		printf("content:\n");
+		manifest_iter_init(&iter, db_manifest(db, dbnode));
+		while ((node = manifest_iter_next(&iter)))
+			printf("\t%s\n", node->path);
 	}
 }
 
@@ -73,7 +73,7 @@ install_func(config_t *config, int argc, char **argv)
 
 	for (idx = optind; idx < argc; ++idx) {
 		worker = worker_new(config, argv[idx],
-				    WORKER_ACTION_INSTALL, true);
+				    WORKER_ACTION_INSTALL, false);
 		worker_set_catalog(worker, catalog);
 		worker_set_db(worker, db);
 
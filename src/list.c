@@ -86,13 +86,13 @@ list_func(config_t *config, int argc, char **argv)
 	for (dbnode = db->nodes; dbnode; /* void */) {
 		if (automatic && dbnode->automatic)
 			printf("%s-%d\n",
-			       dbnode->pkg->name,
-			       dbnode->pkg->release);
+			       dbnode->name,
+			       dbnode->release);
 
 		if (manual && !dbnode->automatic)
 			printf("%s-%d\n",
-			       dbnode->pkg->name,
-			       dbnode->pkg->release);
+			       dbnode->name,
+			       dbnode->release);
 
 		dbnode = dbnode->next;
 	}
@@ -29,67 +29,162 @@
 #include "config.h"
 #endif	/* HAVE_CONFIG_H */
 
-#if !defined(_WITH_GETLINE)
-#define _WITH_GETLINE
-#endif
-
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#include <ctype.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "hash.h"
 #include "manifest.h"
 #include "xalloc.h"
 
-static void	mf_config(manifest_t *mf, const char *arg1);
-static void	mf_depend(manifest_t *mf, const char *arg1);
-static void	mf_dir(manifest_t *mf, const char *arg1);
-static void	mf_file(manifest_t *mf, const char *arg1);
-static void	mf_package(manifest_t *mf, const char *arg1);
-static void	mf_release(manifest_t *mf, const char *arg1);
-static void	mf_script(manifest_t *mf, const char *arg1);
+#define MF_MAXARGS	16
+
+/*
+ * Nodes are kept front-coded, in manifest order, one record each:
+ *
+ *   kind	one byte, MF_NODE_* possibly or'ed with MF_HASHED, MF_STATED
+ *   shared	varint, bytes shared with the previous path
+ *   suffix	varint length, then the rest of the path
+ *   hash	8 bytes, little endian, with MF_HASHED
+ *   stat	varints mode, uid, gid, mtime and size, with MF_STATED
+ *
+ * Varints are little endian base 128; mtime is stored as its 64-bit two's
+ * complement.  Packages list the files of a directory together, so most
+ * paths only store their last component.  manifest_iter_next() rebuilds
+ * full paths one node at a time.
+ */
+#define MF_HASHED	0x80
+#define MF_STATED	0x40
+#define MF_KINDMASK	0x07
+#define MF_VARMAX	10	/* longest varint */
+
+/*
+ * Node attributes that make up the metadata; a node has all of them or
+ * none, except for directories which have no size.
+ */
+#define MF_ST_MODE	0x01
+#define MF_ST_UID	0x02
+#define MF_ST_GID	0x04
+#define MF_ST_MTIME	0x08
+#define MF_ST_SIZE	0x10
+#define MF_ST_ALL	0x1f
+
+/*
+ * A compiled manifest lives next to the text one, in <manifest>.bin.  It
+ * records the size and modification time of the text it was compiled from
+ * and is ignored as soon as they no longer match.  All integers are little
+ * endian:
+ *
+ *   |=======================================================|
+ *   | Components     | Subcomponent |                  Size |
+ *   |=======================================================|
+ *   | header         | mf_bin_hdr   |                    64 |
+ *   |================|======================================|
+ *   | depends        | name         |        4 * b_ndepends |
+ *   |================|======================================|
+ *   | string pool    |              |      b_poolsize bytes |
+ *   |================|======================================|
+ *   | nodes          |              |     b_nodesize bytes |
+ *   |========================================================
+ *
+ * Strings are given as offsets into the pool, MF_BIN_NONE standing for an
+ * unset one.  Nodes are stored exactly as they are kept in memory.  Both
+ * are used straight out of the mapping, so loading a compiled manifest
+ * only allocates its depends.  The database keeps the manifests of the
+ * installed packages in the same form, with the stamps left zeroed.
+ */
+#define MF_BIN_MAG	"!<mfbin>"
+#define MF_BIN_NONE	0xffffffff
+
+struct mf_bin_hdr {
+	char	b_magic[8];	/* MF_BIN_MAG */
+	uint8_t	b_srcsize[8];	/* size of the text manifest */
+	uint8_t	b_srcsec[8];	/* modification time of the text manifest */
+	uint8_t	b_srcnsec[4];
+	uint8_t	b_release[4];
+	uint8_t	b_name[4];
+	uint8_t	b_script[4];
+	uint8_t	b_compress[4];
+	uint8_t	b_ndepends[4];
+	uint8_t	b_poolsize[4];
+	uint8_t	b_nnodes[8];
+	uint8_t	b_nodesize[8];
+} __attribute__((packed));
+
+struct mf_pool {
+	char	*buf;
+	size_t	len;
+	size_t	cap;
+};
+
+#define mf_isspace(c)	((c) == ' ' || ((c) >= '\t' && (c) <= '\r'))
 
+static int	mf_attrs(const char *filename, int lineno, char **args,
+			 manifest_node_t *node);
+static manifest_t *mf_bin_load(const char *filename, struct stat *sb);
+static char	*mf_bin_str(const char *pool, uint32_t poolsize, uint32_t off,
+			    int *error);
+static void	mf_compress(manifest_t *mf, char *arg1);
+static void	mf_corrupt(manifest_t *mf);
+static void	mf_depend(manifest_t *mf, char *arg1);
+static uint32_t	mf_get32(const uint8_t *p);
+static uint64_t	mf_get64(const uint8_t *p);
+static int	mf_gethash(const char *str, uint64_t *hash);
+static int	mf_getnum(const char *str, int base, uint64_t *num);
+static uint64_t	mf_getvar(manifest_iter_t *iter);
+static int	mf_line(manifest_t *mf, const char *filename, int lineno,
+			char *line, char *eol);
+static void	mf_package(manifest_t *mf, char *arg1);
+static uint32_t	mf_pool_add(struct mf_pool *pool, const char *str);
+static void	mf_put32(uint8_t *p, uint32_t val);
+static void	mf_put64(uint8_t *p, uint64_t val);
+static void	mf_putvar(manifest_t *mf, uint64_t val);
+static void	mf_release(manifest_t *mf, char *arg1);
+static void	mf_reserve(manifest_t *mf, size_t len);
+static void	mf_script(manifest_t *mf, char *arg1);
+
+/*
+ * Node commands have no callback, they add a node of their kind and may
+ * be followed by "key=value" attributes.
+ */
 static struct {
 	const char	*name;
-	void		(*callback)(manifest_t *, const char *);
+	void		(*callback)(manifest_t *, char *);
+	int		kind;
 } commands[] = {
-	{ "config",	mf_config },
-	{ "depend",	mf_depend },
-	{ "dir",	mf_dir },
-	{ "file",	mf_file },
-	{ "package",	mf_package },
-	{ "release",	mf_release },
-	{ "script",	mf_script },
-	{ NULL,		NULL }
+	{ "compress",	mf_compress,	0 },
+	{ "config",	NULL,		MF_NODE_CONFIG },
+	{ "depend",	mf_depend,	0 },
+	{ "dir",	NULL,		MF_NODE_DIR },
+	{ "file",	NULL,		MF_NODE_FILE },
+	{ "package",	mf_package,	0 },
+	{ "release",	mf_release,	0 },
+	{ "script",	mf_script,	0 },
+	{ NULL,		NULL,		0 }
 };
 
 void
 manifest_free(manifest_t *mf)
 {
-	manifest_depend_t *depend;
-	manifest_node_t *node;
-
-	free(mf->name);
-	if (mf->depends) {
-		while (mf->depends) {
-			depend = mf->depends;
-			mf->depends = mf->depends->next;
-			free(depend->name);
-			free(depend);
-		}
-	}
-	if (mf->nodes) {
-		while (mf->nodes) {
-			node = mf->nodes;
-			mf->nodes = mf->nodes->next;
-			free(node->path);
-			free(node);
-		}
-	}
-	free(mf);
+	if (mf->map)
+		munmap(mf->map, mf->maplen);
+	if (mf->nodecap)
+		free(mf->nodes);
+	free(mf->lastpath);
+	/* mf itself lives in the arena */
+	if (mf->arena)
+		arena_free(mf->arena);
 }
 
 void
@@ -97,6 +192,7 @@ manifest_emit(manifest_t *mf, const char *filename)
 {
 	FILE *ofs;
 	manifest_depend_t *depend;
+	manifest_iter_t iter;
 	manifest_node_t *node;
 
 	if (!(ofs = fopen(filename, "w")))
@@ -110,7 +206,10 @@ manifest_emit(manifest_t *mf, const char *filename)
 
 	fprintf(ofs,
 		"package\t%s\n"
-		"release\t%d\n\n", mf->name, mf->release);
+		"release\t%d\n", mf->name, mf->release);
+	if (mf->compress)
+		fprintf(ofs, "compress\t%s\n", mf->compress);
+	fprintf(ofs, "\n");
 
 	for (depend = mf->depends; depend; /* void */) {
 		fprintf(ofs, "depend\t%s\n", depend->name);
@@ -118,7 +217,8 @@ manifest_emit(manifest_t *mf, const char *filename)
 	}
 	fprintf(ofs, "\n");
 
-	for (node = mf->nodes; node; /* void */) {
+	manifest_iter_init(&iter, mf);
+	while ((node = manifest_iter_next(&iter))) {
 		switch (node->kind) {
 		case MF_NODE_CONFIG:
 			fprintf(ofs, "config");
@@ -130,163 +230,809 @@ manifest_emit(manifest_t *mf, const char *filename)
 			fprintf(ofs, "file");
 			break;
 		}
-		fprintf(ofs, "\t%s\n", node->path);
-		node = node->next;
+		fprintf(ofs, "\t%s", node->path);
+		if (node->stated) {
+			fprintf(ofs, "\tmode=%o\tuid=%u\tgid=%u\tmtime=%lld",
+				(unsigned int)node->mode,
+				(unsigned int)node->uid,
+				(unsigned int)node->gid,
+				(long long)node->mtime);
+			if (node->kind != MF_NODE_DIR)
+				fprintf(ofs, "\tsize=%lld",
+					(long long)node->size);
+		}
+		if (node->hashed)
+			fprintf(ofs, "\thash=%0*" PRIx64, HASH_LEN, node->hash);
+		fprintf(ofs, "\n");
 	}
 
 	fclose(ofs);
 }
 
+/*
+ * Compile mf, as parsed from the text manifest filename, into
+ * <filename>.bin.  The file is replaced atomically, so readers never see a
+ * partial one.
+ */
+void
+manifest_compile(manifest_t *mf, const char *filename)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	int fd;
+	struct mf_bin_hdr *hdr;
+	struct stat sb;
+	uint8_t *buf;
+	size_t len;
+
+	if (stat(filename, &sb) == -1)
+		err(1, "%s", filename);
+
+	buf = manifest_pack(mf, &len);
+	hdr = (struct mf_bin_hdr *)buf;
+	mf_put64(hdr->b_srcsize, (uint64_t)sb.st_size);
+	mf_put64(hdr->b_srcsec, (uint64_t)sb.st_mtim.tv_sec);
+	mf_put32(hdr->b_srcnsec, (uint32_t)sb.st_mtim.tv_nsec);
+
+	snprintf(path, PATH_MAX, "%s.bin", filename);
+	snprintf(tmp, PATH_MAX, "%s.bin.XXXXXX", filename);
+	if ((fd = mkstemp(tmp)) == -1)
+		err(1, "mkstemp: %s", tmp);
+	if (fchmod(fd, 0644) == -1)
+		err(1, "fchmod: %s", tmp);
+	if (write(fd, buf, len) != (ssize_t)len)
+		err(1, "write: %s", tmp);
+	if (close(fd) == -1)
+		err(1, "close: %s", tmp);
+	if (rename(tmp, path) == -1)
+		err(1, "rename: %s", path);
+
+	free(buf);
+}
+
+/*
+ * Encode mf in the compiled form, without the stamps of a text manifest,
+ * and return it along with its length in *lenp.  The caller frees it.
+ */
+void *
+manifest_pack(manifest_t *mf, size_t *lenp)
+{
+	manifest_depend_t *depend;
+	struct mf_bin_hdr hdr;
+	struct mf_pool pool;
+	uint32_t idx, ndepends = 0, *names;
+	uint8_t *buf, *p;
+	size_t len;
+
+	for (depend = mf->depends; depend; depend = depend->next)
+		++ndepends;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memset(&pool, 0, sizeof(pool));
+	memcpy(hdr.b_magic, MF_BIN_MAG, sizeof(hdr.b_magic));
+	mf_put32(hdr.b_release, (uint32_t)mf->release);
+	mf_put32(hdr.b_name, mf_pool_add(&pool, mf->name));
+	mf_put32(hdr.b_script, mf_pool_add(&pool, mf->script));
+	mf_put32(hdr.b_compress, mf_pool_add(&pool, mf->compress));
+	mf_put32(hdr.b_ndepends, ndepends);
+	mf_put64(hdr.b_nnodes, (uint64_t)mf->nnodes);
+	mf_put64(hdr.b_nodesize, (uint64_t)mf->nodelen);
+
+	names = xcalloc(ndepends + 1, sizeof(uint32_t));
+	for (idx = 0, depend = mf->depends; depend; depend = depend->next)
+		names[idx++] = mf_pool_add(&pool, depend->name);
+	if (pool.len >= MF_BIN_NONE)
+		errx(1, "%s: manifest too large", mf->name);
+	mf_put32(hdr.b_poolsize, (uint32_t)pool.len);
+
+	len = sizeof(hdr) + ndepends * 4 + pool.len + mf->nodelen;
+	p = buf = xmalloc(len);
+	memcpy(p, &hdr, sizeof(hdr));
+	p += sizeof(hdr);
+	for (idx = 0; idx < ndepends; ++idx, p += 4)
+		mf_put32(p, names[idx]);
+	if (pool.len)
+		memcpy(p, pool.buf, pool.len);
+	p += pool.len;
+	if (mf->nodelen)
+		memcpy(p, mf->nodes, mf->nodelen);
+
+	free(names);
+	free(pool.buf);
+	*lenp = len;
+	return (buf);
+}
+
+/*
+ * Decode len bytes of a compiled manifest, as made by manifest_pack, or
+ * return NULL if they do not look like one.  The manifest points into buf,
+ * which must outlive it.  It is allocated from arena when one is given,
+ * and manifest_free() then leaves the memory to its owner.
+ */
+manifest_t *
+manifest_unpack(const void *buf, size_t len, arena_t *arena)
+{
+	arena_t *own = NULL;
+	const char *map = buf, *pool;
+	int error = 0;
+	manifest_depend_t *depends;
+	manifest_t *mf;
+	const struct mf_bin_hdr *hdr;
+	const uint8_t *p;
+	uint32_t idx, ndepends, poolsize;
+	uint64_t nodeoff, nodesize, pooloff;
+
+	if (len < sizeof(*hdr))
+		return (NULL);
+	hdr = buf;
+	ndepends = mf_get32(hdr->b_ndepends);
+	poolsize = mf_get32(hdr->b_poolsize);
+	nodesize = mf_get64(hdr->b_nodesize);
+	pooloff = sizeof(*hdr) + (uint64_t)ndepends * 4;
+	nodeoff = pooloff + poolsize;
+
+	if (memcmp(hdr->b_magic, MF_BIN_MAG, sizeof(hdr->b_magic)) ||
+	    nodesize > (uint64_t)len ||
+	    nodeoff + nodesize != (uint64_t)len ||
+	    (poolsize && map[nodeoff - 1] != '\0'))
+		return (NULL);
+	pool = map + pooloff;
+
+	if (!arena)
+		arena = own = arena_new();
+	mf = arena_alloc(arena, sizeof(manifest_t));
+	mf->arena = own;
+	mf->nodes = (uint8_t *)map + nodeoff;
+	mf->nodelen = (size_t)nodesize;
+	mf->nnodes = (size_t)mf_get64(hdr->b_nnodes);
+
+	mf->release = (int)mf_get32(hdr->b_release);
+	mf->name = mf_bin_str(pool, poolsize, mf_get32(hdr->b_name), &error);
+	mf->script = mf_bin_str(pool, poolsize,
+				mf_get32(hdr->b_script), &error);
+	mf->compress = mf_bin_str(pool, poolsize,
+				  mf_get32(hdr->b_compress), &error);
+
+	p = (const uint8_t *)map + sizeof(*hdr);
+	depends = arena_alloc(arena, ndepends * sizeof(manifest_depend_t));
+	for (idx = 0; idx < ndepends; ++idx, p += 4) {
+		depends[idx].name = mf_bin_str(pool, poolsize,
+					       mf_get32(p), &error);
+		if (!depends[idx].name)
+			error = 1;
+		if (idx > 0)
+			depends[idx-1].next = &depends[idx];
+	}
+	if (ndepends) {
+		mf->depends = depends;
+		mf->dlast = &depends[ndepends-1];
+	}
+
+	if (error) {
+		manifest_free(mf);
+		return (NULL);
+	}
+	return (mf);
+}
+
+/*
+ * Append node to mf.  Its hash and metadata are only read when hashed and
+ * stated say so.
+ */
+void
+manifest_add_node(manifest_t *mf, const manifest_node_t *node)
+{
+	size_t len, max, shared = 0;
+	uint8_t kind;
+
+	if ((len = strlen(node->path)) >= PATH_MAX)
+		errx(1, "%s: path too long", node->path);
+	if (!mf->lastpath)
+		mf->lastpath = xmalloc(PATH_MAX);
+
+	/* a word at a time, both paths are NUL-terminated past max */
+	max = len < mf->lastlen ? len : mf->lastlen;
+	while (shared + 8 <= max &&
+	       !memcmp(mf->lastpath + shared, node->path + shared, 8))
+		shared += 8;
+	while (shared < max && mf->lastpath[shared] == node->path[shared])
+		++shared;
+
+	kind = (uint8_t)node->kind;
+	if (node->hashed)
+		kind |= MF_HASHED;
+	if (node->stated)
+		kind |= MF_STATED;
+
+	mf_reserve(mf, 1 + 2 * MF_VARMAX + (len - shared) + 8 +
+		   5 * MF_VARMAX);
+	mf->nodes[mf->nodelen++] = kind;
+	mf_putvar(mf, shared);
+	mf_putvar(mf, len - shared);
+	memcpy(mf->nodes + mf->nodelen, node->path + shared, len - shared);
+	mf->nodelen += len - shared;
+	if (node->hashed) {
+		mf_put64(mf->nodes + mf->nodelen, node->hash);
+		mf->nodelen += 8;
+	}
+	if (node->stated) {
+		mf_putvar(mf, (uint64_t)node->mode);
+		mf_putvar(mf, (uint64_t)node->uid);
+		mf_putvar(mf, (uint64_t)node->gid);
+		mf_putvar(mf, (uint64_t)(int64_t)node->mtime);
+		mf_putvar(mf, (uint64_t)node->size);
+	}
+
+	memcpy(mf->lastpath + shared, node->path + shared, len - shared + 1);
+	mf->lastlen = len;
+	++mf->nnodes;
+}
+
+void
+manifest_iter_init(manifest_iter_t *iter, manifest_t *mf)
+{
+	iter->mf = mf;
+	iter->nodes = mf->nodes;
+	iter->nodelen = mf->nodelen;
+	iter->owned = NULL;
+	iter->pos = 0;
+	iter->pathlen = 0;
+	iter->path[0] = '\0';
+	iter->node.path = iter->path;
+}
+
+/*
+ * Return the next node of the manifest, NULL past the last one.  The node
+ * and its path are overwritten by the following call.
+ */
+manifest_node_t *
+manifest_iter_next(manifest_iter_t *iter)
+{
+	manifest_node_t *node = &iter->node;
+	uint64_t len, shared;
+	uint8_t kind;
+
+	if (iter->pos >= iter->nodelen) {
+		free(iter->owned);
+		iter->owned = NULL;
+		return (NULL);
+	}
+
+	kind = iter->nodes[iter->pos++];
+	shared = mf_getvar(iter);
+	len = mf_getvar(iter);
+	if (shared > iter->pathlen || len >= PATH_MAX - shared ||
+	    len > iter->nodelen - iter->pos)
+		mf_corrupt(iter->mf);
+
+	memcpy(iter->path + shared, iter->nodes + iter->pos, (size_t)len);
+	iter->pos += (size_t)len;
+	iter->pathlen = (size_t)(shared + len);
+	iter->path[iter->pathlen] = '\0';
+
+	node->kind = kind & MF_KINDMASK;
+	node->hashed = (kind & MF_HASHED) != 0;
+	node->hash = 0;
+	if (node->hashed) {
+		if (iter->nodelen - iter->pos < 8)
+			mf_corrupt(iter->mf);
+		node->hash = mf_get64(iter->nodes + iter->pos);
+		iter->pos += 8;
+	}
+
+	node->stated = (kind & MF_STATED) != 0;
+	if (node->stated) {
+		node->mode = (mode_t)mf_getvar(iter);
+		node->uid = (uid_t)mf_getvar(iter);
+		node->gid = (gid_t)mf_getvar(iter);
+		node->mtime = (time_t)(int64_t)mf_getvar(iter);
+		node->size = (off_t)mf_getvar(iter);
+	} else {
+		node->mode = 0;
+		node->uid = 0;
+		node->gid = 0;
+		node->mtime = 0;
+		node->size = 0;
+	}
+	return (node);
+}
+
+/*
+ * Walk the nodes of mf while it is emptied, so that the caller can add
+ * them back one by one with manifest_add_node(), changed as it sees fit.
+ * The walk must be run to its end.
+ */
+void
+manifest_iter_rewrite(manifest_iter_t *iter, manifest_t *mf)
+{
+	manifest_iter_init(iter, mf);
+	/* nodes in a compiled manifest stay mapped until manifest_free */
+	if (mf->nodecap)
+		iter->owned = mf->nodes;
+
+	mf->nodes = NULL;
+	mf->nodelen = 0;
+	mf->nodecap = 0;
+	mf->nnodes = 0;
+	mf->lastlen = 0;
+}
+
+/*
+ * A fresh compiled manifest is used when there is one.  Otherwise the text
+ * is mapped privately and tokenized in place; nodes are encoded as they are
+ * read, and the few other strings are copied to the arena, so the mapping
+ * is gone by the time the manifest is returned.  Errors are fatal.
+ */
 manifest_t *
 manifest_parse(const char *filename)
 {
-	FILE *ifs;
-	char **args;
-	char *line = NULL, *myline, *myline1, *s;
-	int idx, lineno = 0;
 	manifest_t *mf;
-	size_t linecap = 0;
-	ssize_t linelen;
 
-	if (!(ifs = fopen(filename, "r")))
-		err(1, "%s", filename);
-	mf = xcalloc(1, sizeof(manifest_t));
+	/* the error was reported already */
+	if (!(mf = manifest_load(filename)))
+		exit(1);
+	return (mf);
+}
 
-	while ((linelen = getline(&line, &linecap, ifs)) > 0) {
-		++lineno;
-		args = xcalloc(1, sizeof(char *));
-		myline = myline1 = xstrdup(line);
-
-		while (isspace(*myline))
-			++myline;
-		if (*myline == '\0' || *myline == '#')
-			goto next;
-
-		for (idx = 1; (s = strsep(&myline, WS)); /* void */) {
-			if (*s == '\0')
-				continue;
-
-			args = xrealloc(args, (idx+1) * sizeof(char *));
-			args[idx] = NULL;
-			args[idx-1] = s;
-			++idx;
-		}
+/*
+ * Same as manifest_parse(), but warn and return NULL when filename cannot
+ * be read or is not a valid manifest.
+ */
+manifest_t *
+manifest_load(const char *filename)
+{
+	arena_t *arena;
+	char *end, *eol, *line, *map = NULL;
+	int error = 0, fd, lineno = 0;
+	manifest_t *mf;
+	size_t maplen;
+	struct stat st;
 
-		--idx;
-		if (idx < 2)
-			errx(1, "%s:%d: not enough arguments", filename, lineno);
-		if (idx > 2)
-			errx(1, "%s:%d: too many arguments", filename, lineno);
+	if ((fd = open(filename, O_RDONLY)) == -1) {
+		warn("%s", filename);
+		return (NULL);
+	}
+	if (fstat(fd, &st) == -1) {
+		warn("%s", filename);
+		close(fd);
+		return (NULL);
+	}
+	if ((mf = mf_bin_load(filename, &st))) {
+		close(fd);
+		return (mf);
+	}
 
-		for (idx = 0; commands[idx].name; ++idx) {
-			if (!strcmp(*args, commands[idx].name))
-				break;
+	maplen = (size_t)st.st_size;
+	if (maplen > 0) {
+		map = mmap(NULL, maplen, PROT_READ|PROT_WRITE, MAP_PRIVATE,
+			   fd, 0);
+		if (map == MAP_FAILED) {
+			warn("%s", filename);
+			close(fd);
+			return (NULL);
 		}
+	}
+	close(fd);
 
-		if (!commands[idx].name)
-			errx(1, "%s:%d: %s: unknown command", filename, lineno, *args);
+	arena = arena_new();
+	mf = arena_alloc(arena, sizeof(manifest_t));
+	mf->arena = arena;
 
-		commands[idx].callback(mf, *(args + 1));
+	line = map;
+	end = map + maplen;
+	while (line < end && !error) {
+		++lineno;
+		if ((eol = memchr(line, '\n', (size_t)(end - line)))) {
+			error = mf_line(mf, filename, lineno, line, eol);
+			line = eol + 1;
+			continue;
+		}
 
-	next:
-		free(args);
-		free(myline1);
+		/* no room past the mapping to terminate the last token */
+		eol = arena_strndup(arena, line, (size_t)(end - line));
+		error = mf_line(mf, filename, lineno, eol, eol + (end - line));
+		break;
 	}
-	free(line);
 
-	fclose(ifs);
+	if (map)
+		munmap(map, maplen);
+	if (error) {
+		manifest_free(mf);
+		return (NULL);
+	}
+	free(mf->lastpath);
+	mf->lastpath = NULL;
+	mf->lastlen = 0;
 	return (mf);
 }
 
-static void
-mf_config(manifest_t *mf, const char *arg1)
+static int
+mf_attrs(const char *filename, int lineno, char **args, manifest_node_t *node)
+{
+	char *value;
+	int seen = 0, want;
+	uint64_t num;
+
+	for (; *args; ++args) {
+		if (!(value = strchr(*args, '='))) {
+			warnx("%s:%d: %s: invalid attribute",
+			      filename, lineno, *args);
+			return (-1);
+		}
+		*value++ = '\0';
+
+		/* unknown attributes are left for newer versions */
+		if (!strcmp(*args, "hash")) {
+			if (mf_gethash(value, &node->hash) == -1) {
+				warnx("%s:%d: %s: invalid hash",
+				      filename, lineno, value);
+				return (-1);
+			}
+			/* directories have no contents to hash */
+			node->hashed = node->kind != MF_NODE_DIR;
+			continue;
+		}
+
+		if (!strcmp(*args, "mode")) {
+			if (mf_getnum(value, 8, &num) == -1)
+				goto invalid;
+			node->mode = (mode_t)num;
+			seen |= MF_ST_MODE;
+		} else if (!strcmp(*args, "uid")) {
+			if (mf_getnum(value, 10, &num) == -1)
+				goto invalid;
+			node->uid = (uid_t)num;
+			seen |= MF_ST_UID;
+		} else if (!strcmp(*args, "gid")) {
+			if (mf_getnum(value, 10, &num) == -1)
+				goto invalid;
+			node->gid = (gid_t)num;
+			seen |= MF_ST_GID;
+		} else if (!strcmp(*args, "mtime")) {
+			/* the only signed one */
+			if (mf_getnum(*value == '-' ? value + 1 : value, 10,
+				      &num) == -1)
+				goto invalid;
+			node->mtime = *value == '-' ?
+				-(time_t)num : (time_t)num;
+			seen |= MF_ST_MTIME;
+		} else if (!strcmp(*args, "size")) {
+			if (mf_getnum(value, 10, &num) == -1)
+				goto invalid;
+			node->size = (off_t)num;
+			seen |= MF_ST_SIZE;
+		}
+		continue;
+invalid:
+		warnx("%s:%d: %s: invalid %s", filename, lineno, value,
+		      *args);
+		return (-1);
+	}
+
+	want = node->kind == MF_NODE_DIR ? MF_ST_ALL & ~MF_ST_SIZE : MF_ST_ALL;
+	if (seen && (seen & want) != want) {
+		warnx("%s:%d: %s: incomplete metadata",
+		      filename, lineno, node->path);
+		return (-1);
+	}
+	node->stated = seen != 0;
+	return (0);
+}
+
+/*
+ * Load <filename>.bin if it was compiled from the text manifest described
+ * by sb, NULL otherwise.  Anything that does not check out sends the
+ * caller back to the text.
+ */
+static manifest_t *
+mf_bin_load(const char *filename, struct stat *sb)
 {
-	manifest_node_t *node, *tmp;
+	char path[PATH_MAX], *map;
+	int fd;
+	manifest_t *mf;
+	const struct mf_bin_hdr *hdr;
+	struct stat bsb;
 
-	node = xcalloc(1, sizeof(manifest_node_t));
-	node->path = xstrdup(arg1);
-	node->kind = MF_NODE_CONFIG;
+	snprintf(path, PATH_MAX, "%s.bin", filename);
+	if ((fd = open(path, O_RDONLY|O_CLOEXEC)) == -1)
+		return (NULL);
+	if (fstat(fd, &bsb) == -1 || bsb.st_size < (off_t)sizeof(*hdr)) {
+		close(fd);
+		return (NULL);
+	}
+	map = mmap(NULL, (size_t)bsb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return (NULL);
 
-	if (!mf->nodes) {
-		mf->nodes = node;
+	hdr = (const struct mf_bin_hdr *)map;
+	if (mf_get64(hdr->b_srcsize) != (uint64_t)sb->st_size ||
+	    mf_get64(hdr->b_srcsec) != (uint64_t)sb->st_mtim.tv_sec ||
+	    mf_get32(hdr->b_srcnsec) != (uint32_t)sb->st_mtim.tv_nsec ||
+	    !(mf = manifest_unpack(map, (size_t)bsb.st_size, NULL))) {
+		munmap(map, (size_t)bsb.st_size);
+		return (NULL);
 	}
-	else {
-		for (tmp = mf->nodes; tmp->next; /* void */)
-			tmp = tmp->next;
-		tmp->next = node;
+	mf->map = map;
+	mf->maplen = (size_t)bsb.st_size;
+	return (mf);
+}
+
+static char *
+mf_bin_str(const char *pool, uint32_t poolsize, uint32_t off, int *error)
+{
+	if (off == MF_BIN_NONE)
+		return (NULL);
+	if (off >= poolsize) {
+		*error = 1;
+		return (NULL);
 	}
+	/* the pool is read only, strings must not be written through */
+	return ((char *)pool + off);
 }
 
 static void
-mf_depend(manifest_t *mf, const char *arg1)
+mf_compress(manifest_t *mf, char *arg1)
 {
-	manifest_depend_t *depend, *tmp;
+	mf->compress = arena_strdup(mf->arena, arg1);
+}
 
-	depend = xcalloc(1, sizeof(manifest_depend_t));
-        depend->name = xstrdup(arg1);
+/*
+ * Compiled manifests are only checked as far as their header goes, the
+ * nodes are checked as they are decoded.
+ */
+static void
+mf_corrupt(manifest_t *mf)
+{
+	errx(1, "%s: corrupt manifest", mf->name ? mf->name : "(unnamed)");
+}
+
+static void
+mf_depend(manifest_t *mf, char *arg1)
+{
+	manifest_depend_t *depend;
 
-	if (!mf->depends) {
+	depend = arena_alloc(mf->arena, sizeof(manifest_depend_t));
+	depend->name = arena_strdup(mf->arena, arg1);
+
+	if (mf->dlast)
+		mf->dlast->next = depend;
+	else
 		mf->depends = depend;
+	mf->dlast = depend;
+}
+
+static uint32_t
+mf_get32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+		(uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+}
+
+static uint64_t
+mf_get64(const uint8_t *p)
+{
+	return ((uint64_t)mf_get32(p) | (uint64_t)mf_get32(p + 4) << 32);
+}
+
+/*
+ * Decode a HASH_LEN digit hexadecimal hash, -1 if str is not one.  Digits
+ * are random, so they are looked up rather than compared against ranges.
+ */
+static int
+mf_gethash(const char *str, uint64_t *hash)
+{
+	/* one more than the value of each digit, 0 for anything else */
+	static const uint8_t xdigits[256] = {
+		['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+		['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+		['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15,
+		['f'] = 16, ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14,
+		['E'] = 15, ['F'] = 16,
+	};
+	int idx;
+	uint8_t digit;
+	uint64_t val = 0;
+
+	/* NUL is not a digit either, so short strings stop here */
+	for (idx = 0; idx < HASH_LEN; ++idx) {
+		if (!(digit = xdigits[(unsigned char)str[idx]]))
+			return (-1);
+		val = val << 4 | (uint64_t)(digit - 1);
 	}
-	else {
-		for (tmp = mf->depends; tmp->next; /* void */)
-			tmp = tmp->next;
-		tmp->next = depend;
+	if (str[HASH_LEN] != '\0')
+		return (-1);
+	*hash = val;
+	return (0);
+}
+
+/*
+ * Decode a number written in base, -1 if str is not one or does not fit in
+ * 63 bits.
+ */
+static int
+mf_getnum(const char *str, int base, uint64_t *num)
+{
+	char *end;
+	unsigned long long val;
+
+	if (*str < '0' || *str > '9')
+		return (-1);
+	errno = 0;
+	val = strtoull(str, &end, base);
+	if (errno || *end != '\0' || val > INT64_MAX)
+		return (-1);
+	*num = (uint64_t)val;
+	return (0);
+}
+
+static uint64_t
+mf_getvar(manifest_iter_t *iter)
+{
+	uint64_t val = 0;
+	unsigned int shift;
+	uint8_t byte;
+
+	for (shift = 0; shift < 64; shift += 7) {
+		if (iter->pos >= iter->nodelen)
+			break;
+		byte = iter->nodes[iter->pos++];
+		val |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return (val);
 	}
+	mf_corrupt(iter->mf);
+	return (0);
 }
 
-static void
-mf_dir(manifest_t *mf, const char *arg1)
+/*
+ * Split [line, eol) into NUL-terminated words and run the command they
+ * spell.  *eol must be writable.  Returns -1, after a warning, if the
+ * line is not valid.
+ */
+static int
+mf_line(manifest_t *mf, const char *filename, int lineno, char *line,
+	char *eol)
 {
-	manifest_node_t *node, *tmp;
+	char *args[MF_MAXARGS+1];
+	int idx, nargs = 0;
+	manifest_node_t node;
+
+	for (;;) {
+		while (line < eol && mf_isspace(*line))
+			++line;
+		if (line >= eol)
+			break;
+		if (nargs == 0 && *line == '#')
+			return (0);
+		if (nargs == MF_MAXARGS)
+			goto toomany;
+
+		args[nargs++] = line;
+		while (line < eol && !mf_isspace(*line))
+			++line;
+		*line++ = '\0';
+	}
+	if (nargs == 0)
+		return (0);
+	args[nargs] = NULL;
+
+	if (nargs < 2) {
+		warnx("%s:%d: not enough arguments", filename, lineno);
+		return (-1);
+	}
 
-	node = xcalloc(1, sizeof(manifest_node_t));
-	node->path = xstrdup(arg1);
-	node->kind = MF_NODE_DIR;
+	for (idx = 0; commands[idx].name; ++idx) {
+		if (!strcmp(*args, commands[idx].name))
+			break;
+	}
 
-	if (!mf->nodes) {
-		mf->nodes = node;
+	if (!commands[idx].name) {
+		warnx("%s:%d: %s: unknown command", filename, lineno, *args);
+		return (-1);
 	}
-	else {
-		for (tmp = mf->nodes; tmp->next; /* void */)
-			tmp = tmp->next;
-		tmp->next = node;
+
+	if (!commands[idx].kind) {
+		if (nargs > 2)
+			goto toomany;
+		commands[idx].callback(mf, *(args + 1));
+		return (0);
 	}
+
+	memset(&node, 0, sizeof(node));
+	node.path = *(args + 1);
+	node.kind = commands[idx].kind;
+	if (strlen(node.path) >= PATH_MAX) {
+		warnx("%s:%d: %s: path too long", filename, lineno, node.path);
+		return (-1);
+	}
+	if (mf_attrs(filename, lineno, args + 2, &node) == -1)
+		return (-1);
+	manifest_add_node(mf, &node);
+	return (0);
+
+toomany:
+	warnx("%s:%d: too many arguments", filename, lineno);
+	return (-1);
 }
 
 static void
-mf_file(manifest_t *mf, const char *arg1)
+mf_package(manifest_t *mf, char *arg1)
 {
-	manifest_node_t *node, *tmp;
+	mf->name = arena_strdup(mf->arena, arg1);
+}
 
-	node = xcalloc(1, sizeof(manifest_node_t));
-	node->path = xstrdup(arg1);
-	node->kind = MF_NODE_FILE;
+/*
+ * Append str to the string pool and return its offset.  Strings are not
+ * shared, manifests rarely repeat one verbatim.
+ */
+static uint32_t
+mf_pool_add(struct mf_pool *pool, const char *str)
+{
+	size_t len, off;
 
-	if (!mf->nodes) {
-		mf->nodes = node;
-	}
-	else {
-		for (tmp = mf->nodes; tmp->next; /* void */)
-			tmp = tmp->next;
-		tmp->next = node;
+	if (!str)
+		return (MF_BIN_NONE);
+
+	len = strlen(str) + 1;
+	off = pool->len;
+	if (off + len > pool->cap) {
+		pool->cap = pool->cap ? pool->cap * 2 : 4096;
+		if (pool->cap < off + len)
+			pool->cap = off + len;
+		pool->buf = xrealloc(pool->buf, pool->cap);
 	}
+	memcpy(pool->buf + off, str, len);
+	pool->len += len;
+	/* offsets past MF_BIN_NONE are caught by manifest_pack */
+	return ((uint32_t)off);
 }
 
 static void
-mf_package(manifest_t *mf, const char *arg1)
+mf_put32(uint8_t *p, uint32_t val)
 {
-	mf->name = xstrdup(arg1);
+	p[0] = val & 0xff;
+	p[1] = (val >> 8) & 0xff;
+	p[2] = (val >> 16) & 0xff;
+	p[3] = (val >> 24) & 0xff;
 }
 
 static void
-mf_release(manifest_t *mf, const char *arg1)
+mf_put64(uint8_t *p, uint64_t val)
+{
+	mf_put32(p, (uint32_t)val);
+	mf_put32(p + 4, (uint32_t)(val >> 32));
+}
+
+static void
+mf_putvar(manifest_t *mf, uint64_t val)
+{
+	while (val >= 0x80) {
+		mf->nodes[mf->nodelen++] = (uint8_t)(val | 0x80);
+		val >>= 7;
+	}
+	mf->nodes[mf->nodelen++] = (uint8_t)val;
+}
+
+static void
+mf_release(manifest_t *mf, char *arg1)
 {
 	mf->release = (int)strtol(arg1, (char **)NULL, 10);
 }
 
 static void
-mf_script(manifest_t *mf, const char *arg1)
+mf_reserve(manifest_t *mf, size_t len)
+{
+	if (mf->nodelen + len <= mf->nodecap)
+		return;
+
+	mf->nodecap = mf->nodecap ? mf->nodecap * 2 : 4096;
+	if (mf->nodecap < mf->nodelen + len)
+		mf->nodecap = mf->nodelen + len;
+	mf->nodes = xrealloc(mf->nodes, mf->nodecap);
+}
+
+static void
+mf_script(manifest_t *mf, char *arg1)
 {
-	mf->script = xstrdup(arg1);
+	mf->script = arena_strdup(mf->arena, arg1);
 }
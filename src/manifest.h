@@ -28,6 +28,13 @@
 #ifndef __MANIFEST_H
 #define __MANIFEST_H
 
+#include <sys/types.h>
+
+#include <limits.h>
+#include <stdint.h>
+
+#include "arena.h"
+
 #define WS	"\t\n\v\f\r "
 
 #define MF_NODE_CONFIG	0x1
@@ -36,14 +43,31 @@
 
 typedef struct manifest manifest_t;
 typedef struct manifest_depend manifest_depend_t;
+typedef struct manifest_iter manifest_iter_t;
 typedef struct manifest_node manifest_node_t;
 
+/*
+ * The depends and the few other strings of a manifest live in its arena or
+ * in the compiled manifest it was loaded from.  Nodes are front-coded and
+ * only read through a manifest_iter_t.
+ */
 struct manifest {
 	char	*name;
 	int	release;
 	char	*script;
+	char	*compress;
 	manifest_depend_t *depends;
-	manifest_node_t	  *nodes;
+	size_t	nnodes;		/* number of nodes */
+
+	arena_t	*arena;		/* NULL when it belongs to someone else */
+	char	*map;		/* compiled manifest, if loaded from one */
+	size_t	maplen;
+	uint8_t	*nodes;		/* encoded nodes, see manifest.c */
+	size_t	nodelen;
+	size_t	nodecap;	/* 0 when nodes point into map */
+	char	*lastpath;	/* path of the last node added, if any */
+	size_t	lastlen;
+	manifest_depend_t *dlast;	/* tail, for constant time appends */
 };
 
 struct manifest_depend {
@@ -51,14 +75,45 @@ struct manifest_depend {
 	manifest_depend_t *next;
 };
 
+/*
+ * The metadata is recorded by mpkg-create, along with the hash.  Older
+ * manifests have neither, and nodes added without them leave them unset.
+ */
 struct manifest_node {
 	char	*path;
 	int	kind;
-	manifest_node_t	*next;
+	int	hashed;		/* hash is set */
+	uint64_t hash;		/* contents hash, as recorded by mpkg-create */
+	int	stated;		/* the fields below are set */
+	mode_t	mode;		/* file type and permissions */
+	uid_t	uid;
+	gid_t	gid;
+	time_t	mtime;
+	off_t	size;		/* contents size, 0 for directories */
 };
 
+struct manifest_iter {
+	manifest_t	*mf;
+	const uint8_t	*nodes;		/* what is being walked */
+	size_t		nodelen;
+	uint8_t		*owned;		/* detached by manifest_iter_rewrite */
+	size_t		pos;
+	size_t		pathlen;
+	manifest_node_t	node;
+	char		path[PATH_MAX];
+};
+
+void		manifest_compile(manifest_t *mf, const char *filename);
 void		manifest_free(manifest_t *mf);
 void		manifest_emit(manifest_t *mf, const char *filename);
 manifest_t	*manifest_parse(const char *filename);
+manifest_t	*manifest_load(const char *filename);
+void		*manifest_pack(manifest_t *mf, size_t *lenp);
+manifest_t	*manifest_unpack(const void *buf, size_t len, arena_t *arena);
+
+void		manifest_add_node(manifest_t *mf, const manifest_node_t *node);
+void		manifest_iter_init(manifest_iter_t *iter, manifest_t *mf);
+manifest_node_t	*manifest_iter_next(manifest_iter_t *iter);
+void		manifest_iter_rewrite(manifest_iter_t *iter, manifest_t *mf);
 
 #endif	/* __MANIFEST_H */
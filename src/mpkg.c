@@ -44,11 +44,14 @@ static struct {
 	void (*callback)(config_t *, int, char **);
         const char *help;
 } commands[] = {
+	{ "autoremove",	autoremove_func, "remove packages nothing needs" },
+	{ "extract",	extract_func, "extract files from a package" },
 	{ "info",	info_func, "get information about installed packages" },
 	{ "install",    install_func, "install package" },
 	{ "list",	list_func, "list installed package" },
 	{ "remove",     remove_func, "remove installed package" },
 	{ "update",     update_func, "update installed package" },
+	{ "which",	which_func, "find the packages owning a path" },
 	{ NULL,		NULL, NULL }
 };
 
@@ -64,13 +67,20 @@ main(int argc, char **argv)
 	bzero(config, sizeof(config_t));
 	config->repodir = getenv("PKG_REPO");
 	config->rootdir = "/";
+	config->jobs = 1;
 
-	while ((ch = getopt(argc, argv, "R:r:nvy")) != -1) {
+	while ((ch = getopt(argc, argv, "R:j:r:nsvy")) != -1) {
 		switch (ch) {
 		case 'R':
 			config->rootdir = optarg;
 			break;
 
+		case 'j':
+			config->jobs = (int)strtol(optarg, (char **)NULL, 10);
+			if (config->jobs < 1)
+				usage("%s -- invalid number of jobs", optarg);
+			break;
+
 		case 'n':
 			config->dryrun = 1;
 			break;
@@ -79,6 +89,10 @@ main(int argc, char **argv)
 			config->repodir = optarg;
 			break;
 
+		case 's':
+			config->store = 1;
+			break;
+
 		case 'v':
 			config->verbose = 1;
 			break;
@@ -123,7 +137,7 @@ usage(const char *fmt, ...)
 
 	fprintf(stdout,
 		"usage:\n"
-		"\t%s [-R root] [-nvy] command ...\n\n"
+		"\t%s [-R root] [-j jobs] [-nsvy] command ...\n\n"
 		"commands:\n",
 		getprogname());
 
@@ -34,15 +34,21 @@ struct config {
 	char		*rootdir;
 	char		*repodir;
 
+	int		jobs;
+	int		store;
+
 	int		dryrun;
 	int		verbose;
 	int		ansyes;
 };
 
+void	autoremove_func(config_t *config, int argc, char **argv);
+void	extract_func(config_t *config, int argc, char **argv);
 void	info_func(config_t *config, int argc, char **argv);
 void	install_func(config_t *config, int argc, char **argv);
 void	update_func(config_t *config, int argc, char **argv);
 void    list_func(config_t *config, int argc, char **argv);
 void    remove_func(config_t *config, int argc, char **argv);
+void	which_func(config_t *config, int argc, char **argv);
 
 #endif	/* __MPKG_H */
@@ -40,6 +40,7 @@
 #include "catalog.h"
 #include "db.h"
 #include "mpkg.h"
+#include "store.h"
 #include "worker.h"
 
 static void usage(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
@@ -51,6 +52,7 @@ remove_func(config_t *config, int argc, char **argv)
 	char pathname[PATH_MAX];
 	db_t *db;
 	int ch, idx;
+	store_t *store;
 	worker_t *worker;
 
 	optreset = 1; optind = 1; opterr = 0;
@@ -82,6 +84,11 @@ remove_func(config_t *config, int argc, char **argv)
 		worker_free(worker);
 	}
 
+	if ((store = store_open(config->rootdir, 0))) {
+		store_gc(store, db->path);
+		store_close(store);
+	}
+
 	catalog_free(catalog);
 	db_free(db);
 }
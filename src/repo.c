@@ -29,32 +29,154 @@
 #include "config.h"
 #endif	/* HAVE_CONFIG_H */
 
+#if !defined(_WITH_GETLINE)
+#define _WITH_GETLINE
+#endif
+
 #include <sys/types.h>
+#include <sys/stat.h>
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#endif	/* __linux__ */
 
 #include <dirent.h>
 #include <err.h>
+#include <errno.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "catalog.h"
+#include "htab.h"
 #include "manifest.h"
 #include "xalloc.h"
 
+#define STATE_MAGIC	"#mpkg-repo state 1"
+#define WATCH_DELAY	50	/* ms without changes before publishing */
+#define WATCH_MAXDELAY	1000	/* ms before publishing a burst anyway */
+
+/*
+ * mpkg-repo remembers, in <repodir>/catalog.state, the catalog entry it
+ * built from each manifest along with the inode, size and modification
+ * time of the manifest.  The next run only parses the manifests whose
+ * inode, size or time changed.  Each line of the state file holds
+ *
+ *	sec|nsec|size|inode|package|release|depend,...|path
+ *
+ * with the path of the manifest relative to the repository last, so that
+ * it may contain any character but a newline.
+ */
+struct state {
+	char		*path;
+	int64_t		sec;
+	long		nsec;
+	uint64_t	size;
+	uint64_t	ino;
+	catalog_t	*obj;		/* NULL once taken, or the manifest gone */
+	struct state	*next;
+};
+
+struct dir {
+	char		*path;
+	struct dir	*next;
+};
+
+/*
+ * The repository is walked by several threads taking directories from a
+ * shared queue.  Each of them collects the state of the manifests it finds
+ * on its own, and the lists are merged and sorted once they are done, so
+ * the catalog does not depend on the order the directories were read in.
+ */
+struct repo {
+	const char	*root;
+	size_t		rootlen;
+	catalog_t	*catalog;
+	htab_t		*cache;		/* previous state, by path */
+	struct state	*prev;
+	struct state	*states;	/* state of the new catalog */
+	int		jobs;
+	int		watching;	/* bad manifests are skipped */
+	htab_t		*index;		/* states, by path, when watching */
+
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	struct dir	*queue;
+	size_t		busy;		/* directories queued or being read */
+};
+
+struct walker {
+	struct repo	*repo;
+	pthread_t	thread;
+	struct state	*states;
+};
+
+/*
+ * With -w, mpkg-repo keeps running and watches every directory of the
+ * repository.  Manifests that change are gathered until the repository
+ * has been quiet for WATCH_DELAY, then only they are checked again and
+ * the catalog is published once for the whole burst.
+ */
+struct watch {
+	struct repo	*repo;
+	int		fd;
+	char		**dirs;		/* directory of each descriptor */
+	size_t		ndirs;
+	htab_t		*dirty;		/* manifests to check, by path */
+	char		**paths;
+	size_t		npaths;
+	struct timespec	since;		/* first change not yet published */
+};
+
+static catalog_t *entry(const char *path);
+static void	publish(struct repo *repo);
+static const char *repo_path(struct repo *repo, const char *path);
+static void	state_free(struct state *state);
+static void	state_load(struct repo *repo);
+static void	state_save(struct repo *repo);
+static int	state_sort(const void *a, const void *b);
+static void	update(struct repo *repo);
 static void	usage(char *fmt, ...);
-static void	walk(catalog_t **head, const char *pathname);
+static void	walk(struct repo *repo);
+static void	walk_dir(struct walker *walker, const char *pathname);
+static void	*walk_main(void *arg);
+static void	walk_push(struct repo *repo, const char *pathname);
+static void	watch(struct repo *repo);
+#if defined(__linux__)
+static void	watch_add(struct watch *w, const char *pathname, int scan);
+static void	watch_dirty(struct watch *w, const char *path);
+static void	watch_drop(struct watch *w, const char *pathname);
+static void	watch_event(struct watch *w, struct inotify_event *ev);
+static void	watch_flush(struct watch *w);
+#endif	/* __linux__ */
 
 int
 main(int argc, char **argv)
 {
-	catalog_t *catalog;
-	int ch, idx;
+	int ch, idx, jobs, watching;
+	struct repo repo;
 
-	while ((ch = getopt(argc, argv, "")) != -1) {
+	jobs = 1;
+	watching = 0;
+	while ((ch = getopt(argc, argv, "j:w")) != -1) {
 		switch (ch) {
+		case 'j':
+			jobs = (int)strtol(optarg, (char **)NULL, 10);
+			if (jobs < 1)
+				usage("%s -- invalid number of jobs", optarg);
+			break;
+
+		case 'w':
+			watching = 1;
+			break;
+
 		default:
 			usage("%c -- unknown global option", (char)ch);
 			break;
@@ -62,28 +184,349 @@ main(int argc, char **argv)
 	}
 	if ((argc - optind) < 1)
 		usage(NULL);
+	if (watching && (argc - optind) > 1)
+		usage("-w and several repositories specified");
 
 	for (idx = optind; idx < argc; ++idx) {
-		catalog = NULL;
+		memset(&repo, 0, sizeof(repo));
+		repo.root = argv[idx];
+		repo.rootlen = strlen(argv[idx]);
+		repo.jobs = jobs;
+		repo.watching = watching;
+
+		state_load(&repo);
+		if (watching)
+			watch(&repo);
+		update(&repo);
 
-		walk(&catalog, argv[idx]);
-		catalog_emit(catalog, argv[idx]);
-		catalog_free(catalog);
+		state_free(repo.states);
+		catalog_free(repo.catalog);
 	}
 
 	return (0);
 }
 
-static void
-walk(catalog_t **head, const char *pathname)
+/*
+ * Build the catalog entry of a manifest, NULL after a warning if it cannot
+ * be parsed.
+ */
+static catalog_t *
+entry(const char *path)
 {
-	DIR *dirp;
-	catalog_t *obj, *tmp;
-	char newpath[PATH_MAX];
+	catalog_t *obj;
 	int idx;
 	manifest_depend_t *depend;
 	manifest_t *pkg;
+
+	if (!(pkg = manifest_load(path)))
+		return (NULL);
+	if (!pkg->name) {
+		warnx("%s: no package name", path);
+		manifest_free(pkg);
+		return (NULL);
+	}
+
+	obj = xcalloc(1, sizeof(catalog_t));
+	obj->package = xstrdup(pkg->name);
+	obj->release = pkg->release;
+
+	if (pkg->depends) {
+		obj->depends = xcalloc(1, sizeof(char *));
+		depend = pkg->depends;
+		for (idx = 1; depend; ++idx) {
+			obj->depends = xrealloc(obj->depends,
+						(idx + 1) * sizeof(char *));
+			obj->depends[idx] = NULL;
+			obj->depends[idx - 1] = xstrdup(depend->name);
+			depend = depend->next;
+		}
+	}
+
+	manifest_free(pkg);
+	return (obj);
+}
+
+/*
+ * Sort the catalog, forget the manifests that are gone, and write the
+ * catalog, catalog.bin and the state file.
+ */
+static void
+publish(struct repo *repo)
+{
+	size_t count, nstates;
+	struct state *next, **states, *state;
+
+	for (nstates = 0, state = repo->states; state; state = state->next)
+		++nstates;
+	states = xcalloc(nstates + 1, sizeof(struct state *));
+	for (nstates = 0, state = repo->states; state; state = next) {
+		next = state->next;
+		if (state->obj)
+			states[nstates++] = state;
+		else {
+			free(state->path);
+			free(state);
+		}
+	}
+	qsort(states, nstates, sizeof(struct state *), state_sort);
+
+	repo->states = NULL;
+	repo->catalog = NULL;
+	for (count = nstates; count-- > 0; /* void */) {
+		states[count]->next = repo->states;
+		repo->states = states[count];
+		states[count]->obj->next = repo->catalog;
+		repo->catalog = states[count]->obj;
+	}
+	free(states);
+
+	catalog_emit(repo->catalog, repo->root);
+	catalog_compile(repo->catalog, repo->root);
+	state_save(repo);
+}
+
+/*
+ * Path of a file of the repository, relative to the repository.
+ */
+static const char *
+repo_path(struct repo *repo, const char *path)
+{
+	path += repo->rootlen;
+	while (*path == '/')
+		++path;
+	return (path);
+}
+
+/*
+ * Free a state list; the catalog entries are left alone.
+ */
+static void
+state_free(struct state *state)
+{
+	struct state *next;
+
+	for (/* void */; state; state = next) {
+		next = state->next;
+		free(state->path);
+		free(state);
+	}
+}
+
+/*
+ * Read the state left by the previous run, if any.  The state is only a
+ * cache: when it cannot be used, every manifest is parsed again.
+ */
+static void
+state_load(struct repo *repo)
+{
+	FILE *fp;
+	catalog_t *obj;
+	char **fields, infile[PATH_MAX], *line, *p, *s;
+	int idx, lineno, ndepends;
+	size_t linecap;
+	ssize_t linelen;
+	struct state *state, **tail;
+
+	repo->cache = htab_new();
+	snprintf(infile, PATH_MAX, "%s/catalog.state", repo->root);
+	if (!(fp = fopen(infile, "r")))
+		return;
+
+	fields = xcalloc(8, sizeof(char *));
+	line = NULL;
+	linecap = 0;
+	lineno = 0;
+	tail = &repo->prev;
+	while ((linelen = getline(&line, &linecap, fp)) > 0) {
+		++lineno;
+		if (line[linelen - 1] != '\n')
+			goto corrupt;
+		line[linelen - 1] = '\0';
+		if (lineno == 1) {
+			if (strcmp(line, STATE_MAGIC))
+				goto corrupt;
+			continue;
+		}
+
+		p = line;
+		for (idx = 0; idx < 7; ++idx)
+			if (!(fields[idx] = strsep(&p, "|")) || !p)
+				goto corrupt;
+		if (*p == '\0' || *fields[4] == '\0')
+			goto corrupt;
+
+		state = xcalloc(1, sizeof(struct state));
+		state->path = xstrdup(p);
+		state->sec = strtoll(fields[0], NULL, 10);
+		state->nsec = strtol(fields[1], NULL, 10);
+		state->size = strtoull(fields[2], NULL, 10);
+		state->ino = strtoull(fields[3], NULL, 10);
+
+		obj = xcalloc(1, sizeof(catalog_t));
+		obj->package = xstrdup(fields[4]);
+		obj->release = atoi(fields[5]);
+		if (*fields[6] != '\0') {
+			for (ndepends = 1, s = fields[6]; *s; ++s)
+				if (*s == ',')
+					++ndepends;
+			obj->depends = xcalloc(ndepends + 1, sizeof(char *));
+			for (idx = 0; (s = strsep(&fields[6], ",")); ++idx)
+				obj->depends[idx] = xstrdup(s);
+		}
+		state->obj = obj;
+
+		*tail = state;
+		tail = &state->next;
+		htab_insert(repo->cache, state->path, state);
+	}
+	if (ferror(fp))
+		err(1, "getline: %s", infile);
+
+	free(fields);
+	free(line);
+	fclose(fp);
+	return;
+
+corrupt:
+	warnx("%s:%d: ignoring corrupt state", infile, lineno);
+	for (state = repo->prev; state; state = state->next)
+		catalog_free(state->obj);
+	state_free(repo->prev);
+	repo->prev = NULL;
+	htab_free(repo->cache);
+	repo->cache = htab_new();
+	free(fields);
+	free(line);
+	fclose(fp);
+}
+
+/*
+ * Replace the state file with the state of the catalog just emitted.
+ */
+static void
+state_save(struct repo *repo)
+{
+	FILE *fp;
+	catalog_t *obj;
+	char outfile[PATH_MAX], tmp[PATH_MAX];
+	int fd, idx;
+	struct state *state;
+
+	snprintf(outfile, PATH_MAX, "%s/catalog.state", repo->root);
+	snprintf(tmp, PATH_MAX, "%s/catalog.state.XXXXXX", repo->root);
+	if ((fd = mkstemp(tmp)) == -1)
+		err(1, "mkstemp: %s", tmp);
+	if (fchmod(fd, 0644) == -1)
+		err(1, "fchmod: %s", tmp);
+	if (!(fp = fdopen(fd, "w")))
+		err(1, "fdopen: %s", tmp);
+
+	fprintf(fp, "%s\n", STATE_MAGIC);
+	for (state = repo->states; state; state = state->next) {
+		obj = state->obj;
+		fprintf(fp, "%lld|%ld|%llu|%llu|%s|%d|",
+			(long long)state->sec, state->nsec,
+			(unsigned long long)state->size,
+			(unsigned long long)state->ino,
+			obj->package, obj->release);
+		for (idx = 0; obj->depends && obj->depends[idx]; ++idx)
+			fprintf(fp, idx ? ",%s" : "%s", obj->depends[idx]);
+		fprintf(fp, "|%s\n", state->path);
+	}
+
+	if (fclose(fp) == EOF)
+		err(1, "write: %s", tmp);
+	if (rename(tmp, outfile) == -1)
+		err(1, "rename: %s", outfile);
+}
+
+/*
+ * Order the catalog by package, and packages found twice by path.
+ */
+static int
+state_sort(const void *a, const void *b)
+{
+	const struct state *sa = *(const struct state * const *)a;
+	const struct state *sb = *(const struct state * const *)b;
+	int cmp;
+
+	if ((cmp = strcmp(sa->obj->package, sb->obj->package)))
+		return (cmp);
+	return (strcmp(sa->path, sb->path));
+}
+
+/*
+ * Find the manifests of the repository and build the sorted catalog and
+ * its state.
+ */
+static void
+walk(struct repo *repo)
+{
+	int error, idx;
+	struct state *next, *state;
+	struct walker *walkers;
+
+	if ((error = pthread_mutex_init(&repo->lock, NULL))) {
+		errno = error;
+		err(1, "pthread_mutex_init");
+	}
+	if ((error = pthread_cond_init(&repo->cond, NULL))) {
+		errno = error;
+		err(1, "pthread_cond_init");
+	}
+	walk_push(repo, repo->root);
+
+	walkers = xcalloc(repo->jobs, sizeof(struct walker));
+	for (idx = 0; idx < repo->jobs; ++idx)
+		walkers[idx].repo = repo;
+	if (repo->jobs < 2)
+		walk_main(&walkers[0]);
+	else {
+		for (idx = 0; idx < repo->jobs; ++idx) {
+			if ((error = pthread_create(&walkers[idx].thread,
+						    NULL, walk_main,
+						    &walkers[idx]))) {
+				errno = error;
+				err(1, "pthread_create");
+			}
+		}
+		for (idx = 0; idx < repo->jobs; ++idx) {
+			if ((error = pthread_join(walkers[idx].thread,
+						  NULL))) {
+				errno = error;
+				err(1, "pthread_join");
+			}
+		}
+	}
+
+	/* publish sorts them */
+	for (idx = 0; idx < repo->jobs; ++idx) {
+		for (state = walkers[idx].states; state; state = next) {
+			next = state->next;
+			state->next = repo->states;
+			repo->states = state;
+		}
+	}
+
+	free(walkers);
+	pthread_cond_destroy(&repo->cond);
+	pthread_mutex_destroy(&repo->lock);
+}
+
+/*
+ * Read one directory: queue its subdirectories and collect its manifest.
+ */
+static void
+walk_dir(struct walker *walker, const char *pathname)
+{
+	DIR *dirp;
+	catalog_t *obj;
+	char newpath[PATH_MAX];
+	const char *path;
 	struct dirent *dirent;
+	struct repo *repo = walker->repo;
+	struct stat sb;
+	struct state *prev, *state;
 
 	if (!(dirp = opendir(pathname))) {
 		/* err(1, "opendir: %s", pathname); */
@@ -99,50 +542,133 @@ walk(catalog_t **head, const char *pathname)
 		if (dirent->d_type == DT_DIR) {
 			snprintf(newpath, PATH_MAX,
 				 "%s/%s", pathname, dirent->d_name);
-			walk(head, newpath);
+			walk_push(repo, newpath);
 		}
 
 		if (!strcmp(dirent->d_name, "manifest")) {
 			snprintf(newpath, PATH_MAX, "%s/manifest", pathname);
-
-			pkg = manifest_parse(newpath);
-
-			obj = xcalloc(1, sizeof(catalog_t));
-			obj->package = xstrdup(pkg->name);
-			obj->release = pkg->release;
-
-			if (pkg->depends) {
-				obj->depends = xcalloc(1, sizeof(char *));
-				depend = pkg->depends;
-				for (idx = 1; depend; ++idx) {
-					obj->depends =
-						xrealloc(obj->depends,
-							 (idx + 1) *
-							 sizeof(char *));
-					obj->depends[idx] = NULL;
-					obj->depends[idx - 1] =
-						xstrdup(depend->name);
-				}
+			if (stat(newpath, &sb) == -1) {
+				if (!repo->watching)
+					err(1, "stat: %s", newpath);
+				warn("stat: %s", newpath);
+				continue;
 			}
 
-			manifest_free(pkg);
-			if (!(*head))
-				*head = obj;
-			else {
-				for (tmp = *head; tmp->next; /*  void */)
-					tmp = tmp->next;
-				tmp->next = obj;
+			path = repo_path(repo, newpath);
+
+			/* no other walker can find the same path */
+			prev = htab_find(repo->cache, path);
+			if (prev && prev->obj &&
+			    prev->sec == (int64_t)sb.st_mtim.tv_sec &&
+			    prev->nsec == sb.st_mtim.tv_nsec &&
+			    prev->size == (uint64_t)sb.st_size &&
+			    prev->ino == (uint64_t)sb.st_ino) {
+				obj = prev->obj;
+				prev->obj = NULL;
+			} else if (!(obj = entry(newpath))) {
+				if (!repo->watching)
+					exit(1);
+				if (!prev || !prev->obj)
+					continue;
+				/*
+				 * Keep the previous entry, and its times so
+				 * that the manifest is parsed again later.
+				 */
+				obj = prev->obj;
+				prev->obj = NULL;
+				sb.st_mtim.tv_sec = (time_t)prev->sec;
+				sb.st_mtim.tv_nsec = prev->nsec;
+				sb.st_size = (off_t)prev->size;
+				sb.st_ino = (ino_t)prev->ino;
 			}
+
+			state = xcalloc(1, sizeof(struct state));
+			state->path = xstrdup(path);
+			state->sec = (int64_t)sb.st_mtim.tv_sec;
+			state->nsec = sb.st_mtim.tv_nsec;
+			state->size = (uint64_t)sb.st_size;
+			state->ino = (uint64_t)sb.st_ino;
+			state->obj = obj;
+			state->next = walker->states;
+			walker->states = state;
 		}
 	}
 
 	closedir(dirp);
+}
+
+static void *
+walk_main(void *arg)
+{
+	struct dir *dir;
+	struct walker *walker = arg;
+	struct repo *repo = walker->repo;
+
+	for (;;) {
+		pthread_mutex_lock(&repo->lock);
+		while (!repo->queue && repo->busy)
+			pthread_cond_wait(&repo->cond, &repo->lock);
+		if (!(dir = repo->queue)) {
+			pthread_mutex_unlock(&repo->lock);
+			break;
+		}
+		repo->queue = dir->next;
+		pthread_mutex_unlock(&repo->lock);
 
+		walk_dir(walker, dir->path);
+		free(dir->path);
+		free(dir);
+
+		/* the last directory read wakes up the idle walkers to exit */
+		pthread_mutex_lock(&repo->lock);
+		if (--repo->busy == 0)
+			pthread_cond_broadcast(&repo->cond);
+		pthread_mutex_unlock(&repo->lock);
+	}
+	return (NULL);
+}
+
+static void
+walk_push(struct repo *repo, const char *pathname)
+{
+	struct dir *dir;
+
+	dir = xcalloc(1, sizeof(struct dir));
+	dir->path = xstrdup(pathname);
+
+	pthread_mutex_lock(&repo->lock);
+	dir->next = repo->queue;
+	repo->queue = dir;
+	++repo->busy;
+	pthread_cond_signal(&repo->cond);
+	pthread_mutex_unlock(&repo->lock);
+}
+
+/*
+ * Walk the repository and publish its catalog, reusing what is left of the
+ * previous state.
+ */
+static void
+update(struct repo *repo)
+{
+	struct state *state;
+
+	walk(repo);
+	publish(repo);
+
+	/* entries of vanished manifests were never taken */
+	for (state = repo->prev; state; state = state->next)
+		catalog_free(state->obj);
+	htab_free(repo->cache);
+	state_free(repo->prev);
+	repo->cache = NULL;
+	repo->prev = NULL;
 }
 
 static void
 usage(char *fmt, ...)
 {
+	const char *progname;
 	va_list ap;
 
 	if (fmt) {
@@ -151,10 +677,296 @@ usage(char *fmt, ...)
 		va_end(ap);
 	}
 
+	progname = getprogname();
 	fprintf(stdout,
 		"usage:\n"
-		"\t%s repodir ...\n",
-		getprogname());
+		"\t%s [-j jobs] repodir ...\n"
+		"\t%s [-j jobs] -w repodir\n",
+		progname, progname);
 
 	exit(2);
 }
+
+#if defined(__linux__)
+/*
+ * Watch the repository and publish its catalog as manifests change.  The
+ * directories are watched before the first walk, so that nothing changing
+ * meanwhile is missed.  Never returns.
+ */
+static void
+watch(struct repo *repo)
+{
+	char *buf, *p;
+	int timeout;
+	long elapsed;
+	ssize_t len;
+	struct inotify_event *ev;
+	struct pollfd pfd;
+	struct state *state;
+	struct timespec now;
+	struct watch w;
+
+	memset(&w, 0, sizeof(w));
+	w.repo = repo;
+	w.dirty = htab_new();
+	if ((w.fd = inotify_init1(IN_CLOEXEC)) == -1)
+		err(1, "inotify_init1");
+	watch_add(&w, repo->root, 0);
+
+	update(repo);
+	repo->index = htab_new();
+	for (state = repo->states; state; state = state->next)
+		htab_insert(repo->index, state->path, state);
+
+	buf = xmalloc(64 * (sizeof(struct inotify_event) + NAME_MAX + 1));
+	pfd.fd = w.fd;
+	pfd.events = POLLIN;
+	for (;;) {
+		timeout = -1;
+		if (w.npaths) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			elapsed = (now.tv_sec - w.since.tv_sec) * 1000 +
+				(now.tv_nsec - w.since.tv_nsec) / 1000000;
+			timeout = WATCH_MAXDELAY - elapsed;
+			if (timeout > WATCH_DELAY)
+				timeout = WATCH_DELAY;
+			if (timeout < 0)
+				timeout = 0;
+		}
+
+		switch (poll(&pfd, 1, timeout)) {
+		case -1:
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+
+		case 0:
+			watch_flush(&w);
+			continue;
+		}
+
+		len = read(w.fd, buf, 64 * (sizeof(struct inotify_event) +
+					    NAME_MAX + 1));
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "read: inotify");
+		}
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *)p;
+			watch_event(&w, ev);
+		}
+	}
+}
+
+/*
+ * Watch a directory and its subdirectories.  With scan, the manifests
+ * found in them are checked at the next flush.
+ */
+static void
+watch_add(struct watch *w, const char *pathname, int scan)
+{
+	DIR *dirp;
+	char newpath[PATH_MAX];
+	int wd;
+	struct dirent *dirent;
+
+	wd = inotify_add_watch(w->fd, pathname,
+			       IN_CREATE | IN_DELETE | IN_CLOSE_WRITE |
+			       IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR |
+			       IN_DONT_FOLLOW | IN_EXCL_UNLINK);
+	if (wd == -1) {
+		warn("inotify_add_watch: %s", pathname);
+		return;
+	}
+	if ((size_t)wd >= w->ndirs) {
+		w->dirs = xrealloc(w->dirs, (wd + 1) * sizeof(char *));
+		memset(w->dirs + w->ndirs, 0,
+		       (wd + 1 - w->ndirs) * sizeof(char *));
+		w->ndirs = wd + 1;
+	}
+	free(w->dirs[wd]);
+	w->dirs[wd] = xstrdup(pathname);
+
+	if (!(dirp = opendir(pathname))) {
+		warn("opendir: %s", pathname);
+		return;
+	}
+	while ((dirent = readdir(dirp))) {
+		if (!strcmp(dirent->d_name, ".") ||
+		    !strcmp(dirent->d_name, ".."))
+			continue;
+
+		snprintf(newpath, PATH_MAX, "%s/%s", pathname, dirent->d_name);
+		if (dirent->d_type == DT_DIR)
+			watch_add(w, newpath, scan);
+		else if (scan && !strcmp(dirent->d_name, "manifest"))
+			watch_dirty(w, repo_path(w->repo, newpath));
+	}
+	closedir(dirp);
+}
+
+static void
+watch_dirty(struct watch *w, const char *path)
+{
+	char *p;
+
+	if (htab_find(w->dirty, path))
+		return;
+	if (!w->npaths)
+		clock_gettime(CLOCK_MONOTONIC, &w->since);
+
+	p = xstrdup(path);
+	w->paths = xrealloc(w->paths, (w->npaths + 1) * sizeof(char *));
+	w->paths[w->npaths++] = p;
+	htab_insert(w->dirty, p, p);
+}
+
+/*
+ * Stop watching a directory that went away, and check again the manifests
+ * that were in it.
+ */
+static void
+watch_drop(struct watch *w, const char *pathname)
+{
+	const char *path;
+	size_t len, wd;
+	struct state *state;
+
+	len = strlen(pathname);
+	for (wd = 0; wd < w->ndirs; ++wd) {
+		if (!w->dirs[wd] || strncmp(w->dirs[wd], pathname, len) ||
+		    (w->dirs[wd][len] != '\0' && w->dirs[wd][len] != '/'))
+			continue;
+		/* the kernel may have removed it already */
+		inotify_rm_watch(w->fd, (int)wd);
+		free(w->dirs[wd]);
+		w->dirs[wd] = NULL;
+	}
+
+	path = repo_path(w->repo, pathname);
+	len = strlen(path);
+	for (state = w->repo->states; state; state = state->next) {
+		if (state->obj && !strncmp(state->path, path, len) &&
+		    state->path[len] == '/')
+			watch_dirty(w, state->path);
+	}
+}
+
+static void
+watch_event(struct watch *w, struct inotify_event *ev)
+{
+	char newpath[PATH_MAX];
+	struct state *state;
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		/* events were lost: check every manifest */
+		warnx("%s: too many changes, rescanning", w->repo->root);
+		for (state = w->repo->states; state; state = state->next)
+			if (state->obj)
+				watch_dirty(w, state->path);
+		watch_add(w, w->repo->root, 1);
+		return;
+	}
+	if (ev->wd < 0 || (size_t)ev->wd >= w->ndirs || !w->dirs[ev->wd])
+		return;
+	if (ev->mask & IN_IGNORED) {
+		free(w->dirs[ev->wd]);
+		w->dirs[ev->wd] = NULL;
+		return;
+	}
+	if (!ev->len)
+		return;
+
+	snprintf(newpath, PATH_MAX, "%s/%s", w->dirs[ev->wd], ev->name);
+	if (ev->mask & IN_ISDIR) {
+		if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+			watch_add(w, newpath, 1);
+		else if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+			watch_drop(w, newpath);
+	} else if (!strcmp(ev->name, "manifest"))
+		watch_dirty(w, repo_path(w->repo, newpath));
+}
+
+/*
+ * Check the manifests that changed and publish the catalog if any of them
+ * did.
+ */
+static void
+watch_flush(struct watch *w)
+{
+	catalog_t *obj;
+	char newpath[PATH_MAX];
+	int changed;
+	size_t idx;
+	struct repo *repo = w->repo;
+	struct stat sb;
+	struct state *state;
+
+	changed = 0;
+	for (idx = 0; idx < w->npaths; ++idx) {
+		snprintf(newpath, PATH_MAX, "%s/%s", repo->root, w->paths[idx]);
+		state = htab_find(repo->index, w->paths[idx]);
+
+		if (stat(newpath, &sb) == -1) {
+			if (errno != ENOENT && errno != ENOTDIR)
+				warn("stat: %s", newpath);
+			sb.st_mode = 0;
+		}
+		if (!S_ISREG(sb.st_mode)) {
+			if (state) {
+				htab_remove(repo->index, state->path);
+				state->obj->next = NULL;
+				catalog_free(state->obj);
+				state->obj = NULL;
+				changed = 1;
+			}
+			continue;
+		}
+		if (state &&
+		    state->sec == (int64_t)sb.st_mtim.tv_sec &&
+		    state->nsec == sb.st_mtim.tv_nsec &&
+		    state->size == (uint64_t)sb.st_size &&
+		    state->ino == (uint64_t)sb.st_ino)
+			continue;
+
+		/* a bad manifest leaves its previous entry alone */
+		if (!(obj = entry(newpath)))
+			continue;
+		if (state) {
+			state->obj->next = NULL;
+			catalog_free(state->obj);
+		} else {
+			state = xcalloc(1, sizeof(struct state));
+			state->path = xstrdup(w->paths[idx]);
+			state->next = repo->states;
+			repo->states = state;
+			htab_insert(repo->index, state->path, state);
+		}
+		state->sec = (int64_t)sb.st_mtim.tv_sec;
+		state->nsec = sb.st_mtim.tv_nsec;
+		state->size = (uint64_t)sb.st_size;
+		state->ino = (uint64_t)sb.st_ino;
+		state->obj = obj;
+		changed = 1;
+	}
+
+	/* catalog_free touched the links, publish rebuilds them */
+	if (changed)
+		publish(repo);
+
+	for (idx = 0; idx < w->npaths; ++idx)
+		free(w->paths[idx]);
+	free(w->paths);
+	w->paths = NULL;
+	w->npaths = 0;
+	htab_free(w->dirty);
+	w->dirty = htab_new();
+}
+#else	/* !__linux__ */
+static void
+watch(struct repo *repo)
+{
+	errx(1, "%s: -w is not supported on this system", repo->root);
+}
+#endif	/* __linux__ */
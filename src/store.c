@@ -0,0 +1,288 @@
+/*
+ * Copyright (c) 2015, Quentin Schwerkolt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif	/* HAVE_CONFIG_H */
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ar.h"
+#include "hash.h"
+#include "store.h"
+#include "utils.h"
+#include "xalloc.h"
+
+/*
+ * The store keeps one copy of every regular file installed in a root,
+ * named after its contents:
+ *
+ *   <root>/var/db/mpkg/store/<xx>/<hash>-<size>-<mode>
+ *
+ * where <hash> is the XXH3 of the contents in hexadecimal and <xx> its
+ * first two digits.  The mode is part of the key because files fall
+ * back to being hardlinked to their blob when the filesystem cannot
+ * clone them.  Every installed package lists the keys it uses in the
+ * "blobs" file of its database entry; blobs listed nowhere are garbage.
+ */
+struct store {
+	char	*path;
+};
+
+static int	store_keycmp(const void *a, const void *b);
+static void	store_link(const char *blob, const char *dst, mode_t mode);
+static void	store_tmp(store_t *store, ar_t *ar, ar_info_t *info,
+			  char *tmp);
+
+store_t *
+store_open(const char *rootdir, int create)
+{
+	char path[PATH_MAX];
+	store_t *store;
+
+	snprintf(path, PATH_MAX, "%s/%s", rootdir, STORE_DIR);
+	if (access(path, X_OK) == -1) {
+		if (!create)
+			return (NULL);
+		mpkg_mkdirs(path);
+	}
+
+	store = xcalloc(1, sizeof(store_t));
+	store->path = xstrdup(path);
+	return (store);
+}
+
+void
+store_close(store_t *store)
+{
+	free(store->path);
+	free(store);
+}
+
+void
+store_extract(store_t *store, ar_t *ar, ar_info_t *info, char *key)
+{
+	char blob[PATH_MAX], dir[PATH_MAX], tmp[PATH_MAX];
+	const char *data;
+	int fd;
+	off_t size;
+	struct stat sb;
+	uint64_t digest;
+
+	tmp[0] = '\0';
+
+	/*
+	 * Members carrying their hash, and raw members of a mapped archive
+	 * hashed in place, are never written at all when their contents
+	 * are known; anything else has to be extracted first to learn its
+	 * key.
+	 */
+	if (info->hashed) {
+		digest = info->hash;
+		size = info->rawsize;
+	}
+	else if ((data = ar_data(ar, info))) {
+		digest = hash_data(data, (size_t)info->size);
+		size = info->size;
+	}
+	else {
+		store_tmp(store, ar, info, tmp);
+		if ((fd = open(tmp, O_RDONLY|O_CLOEXEC)) == -1)
+			err(1, "cannot open file: %s", tmp);
+		if (fstat(fd, &sb) == -1)
+			err(1, "fstat: %s", tmp);
+		digest = hash_fd(fd, tmp);
+		size = sb.st_size;
+		close(fd);
+	}
+
+	snprintf(key, STORE_KEYMAX, "%0*" PRIx64 "-%lld-%04o",
+		 HASH_LEN, digest, (long long)size,
+		 (unsigned int)(info->mode & 07777));
+	snprintf(blob, PATH_MAX, "%s/%.2s/%s", store->path, key, key);
+
+	if (access(blob, F_OK) == 0) {
+		if (tmp[0] != '\0')
+			(void)unlink(tmp);
+	}
+	else {
+		if (tmp[0] == '\0')
+			store_tmp(store, ar, info, tmp);
+		if (chmod(tmp, info->mode & 07777) == -1)
+			err(1, "chmod: %s", tmp);
+
+		snprintf(dir, PATH_MAX, "%s/%.2s", store->path, key);
+		if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+			err(1, "mkdir: %s", dir);
+		if (rename(tmp, blob) == -1)
+			err(1, "rename: %s", blob);
+	}
+
+	store_link(blob, info->path, info->mode & 07777);
+}
+
+void
+store_gc(store_t *store, const char *dbpath)
+{
+	DIR *dbdir, *dirp, *subdirp;
+	FILE *fp;
+	char **keys, *line, *name;
+	char path[PATH_MAX];
+	size_t idx, linecap, nkeys;
+	ssize_t linelen;
+	struct dirent *dirent, *subdirent;
+
+	/* every key listed by an installed package */
+	keys = NULL;
+	nkeys = 0;
+	line = NULL;
+	linecap = 0;
+	if (!(dbdir = opendir(dbpath)))
+		err(1, "opendir: %s", dbpath);
+	while ((dirent = readdir(dbdir))) {
+		if (dirent->d_name[0] == '.' || dirent->d_type != DT_DIR)
+			continue;
+		snprintf(path, PATH_MAX, "%s/%s/blobs", dbpath, dirent->d_name);
+		if (!(fp = fopen(path, "r")))
+			continue;
+		while ((linelen = getline(&line, &linecap, fp)) > 0) {
+			if (line[linelen-1] == '\n')
+				line[linelen-1] = '\0';
+			keys = xrealloc(keys, (nkeys+1) * sizeof(char *));
+			keys[nkeys++] = xstrdup(line);
+		}
+		fclose(fp);
+	}
+	(void)closedir(dbdir);
+	free(line);
+	qsort(keys, nkeys, sizeof(char *), store_keycmp);
+
+	if (!(dirp = opendir(store->path)))
+		err(1, "opendir: %s", store->path);
+	while ((dirent = readdir(dirp))) {
+		if (dirent->d_name[0] == '.')
+			continue;
+
+		snprintf(path, PATH_MAX, "%s/%s", store->path, dirent->d_name);
+		if (!strncmp(dirent->d_name, "tmp.", 4)) {
+			/* left over by an interrupted extraction */
+			if (unlink(path) == -1)
+				warn("unlink: %s", path);
+			continue;
+		}
+		if (!(subdirp = opendir(path)))
+			continue;
+		while ((subdirent = readdir(subdirp))) {
+			if (subdirent->d_name[0] == '.')
+				continue;
+			name = subdirent->d_name;
+			if (bsearch(&name, keys, nkeys, sizeof(char *),
+				    store_keycmp))
+				continue;
+
+			snprintf(path, PATH_MAX, "%s/%s/%s", store->path,
+				 dirent->d_name, subdirent->d_name);
+			if (unlink(path) == -1)
+				warn("unlink: %s", path);
+		}
+		(void)closedir(subdirp);
+
+		/* only succeeds once the last blob is gone */
+		snprintf(path, PATH_MAX, "%s/%s", store->path, dirent->d_name);
+		(void)rmdir(path);
+	}
+	(void)closedir(dirp);
+
+	for (idx = 0; idx < nkeys; ++idx)
+		free(keys[idx]);
+	free(keys);
+}
+
+static int
+store_keycmp(const void *a, const void *b)
+{
+	return (strcmp(*(char * const *)a, *(char * const *)b));
+}
+
+static void
+store_link(const char *blob, const char *dst, mode_t mode)
+{
+	int ifd, ofd;
+
+	if (unlink(dst) == -1 && errno != ENOENT)
+		err(1, "unlink: %s", dst);
+
+	/*
+	 * A clone gets its own inode and can be modified freely; a
+	 * hardlink is the fallback on filesystems without reflinks.
+	 */
+	if ((ifd = open(blob, O_RDONLY|O_CLOEXEC)) == -1)
+		err(1, "cannot open file: %s", blob);
+	if ((ofd = open(dst, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, mode)) == -1)
+		err(1, "cannot open file: %s", dst);
+	if (mpkg_clone(ifd, ofd) == 0) {
+		close(ofd);
+		close(ifd);
+		return;
+	}
+	close(ofd);
+	close(ifd);
+
+	if (unlink(dst) == -1)
+		err(1, "unlink: %s", dst);
+	if (link(blob, dst) == -1)
+		err(1, "link: %s: %s", blob, dst);
+}
+
+static void
+store_tmp(store_t *store, ar_t *ar, ar_info_t *info, char *tmp)
+{
+	char dst[PATH_MAX];
+	int fd;
+
+	snprintf(tmp, PATH_MAX, "%s/tmp.XXXXXX", store->path);
+	if ((fd = mkstemp(tmp)) == -1)
+		err(1, "mkstemp: %s", tmp);
+	close(fd);
+
+	(void)memcpy(dst, info->path, PATH_MAX);
+	(void)memcpy(info->path, tmp, PATH_MAX);
+	ar_extract(ar, info);
+	(void)memcpy(info->path, dst, PATH_MAX);
+}
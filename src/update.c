@@ -40,7 +40,9 @@
 #include "catalog.h"
 #include "db.h"
 #include "mpkg.h"
+#include "store.h"
 #include "worker.h"
+#include "xalloc.h"
 
 static void usage(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
 
@@ -48,10 +50,12 @@ void
 update_func(config_t *config, int argc, char **argv)
 {
 	catalog_t *catalog;
-	char pathname[PATH_MAX];
+	char **packages, pathname[PATH_MAX];
 	db_t *db;
 	dbnode_t *node;
 	int ch;
+	size_t idx, npackages;
+	store_t *store;
 	worker_t *worker;
 
 	optreset = 1; optind = 1; opterr = 0;
@@ -71,8 +75,16 @@ update_func(config_t *config, int argc, char **argv)
 	db = db_init(pathname);
 	db_load(db);
 
-	for (node = db->nodes; node; /* void */) {
-		worker = worker_new(config, node->pkg->name,
+	/* workers replace and remove nodes, so walk a copy of the names */
+	npackages = 0;
+	for (node = db->nodes; node; node = node->next)
+		++npackages;
+	packages = xcalloc(npackages+1, sizeof(char *));
+	for (idx = 0, node = db->nodes; node; node = node->next)
+		packages[idx++] = xstrdup(node->name);
+
+	for (idx = 0; idx < npackages; ++idx) {
+		worker = worker_new(config, packages[idx],
 				    WORKER_ACTION_UPDATE, true);
 		worker_set_catalog(worker, catalog);
 		worker_set_db(worker, db);
@@ -80,7 +92,13 @@ update_func(config_t *config, int argc, char **argv)
 		worker_exec(worker);
 
 		worker_free(worker);
+		free(packages[idx]);
+	}
+	free(packages);
 
+	if ((store = store_open(config->rootdir, 0))) {
+		store_gc(store, db->path);
+		store_close(store);
 	}
 
 	catalog_free(catalog);
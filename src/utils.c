@@ -29,11 +29,20 @@
 #include "config.h"
 #endif	/* HAVE_CONFIG_H */
 
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#if defined(__linux__)
+#include <linux/fs.h>
+#include <sys/sendfile.h>
+#endif	/* __linux__ */
+
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -41,31 +50,139 @@
 #include "utils.h"
 #include "xalloc.h"
 
+#define COPY_BUFSIZ	(1024 * 1024)
+
+/*
+ * A method returns 0 once the whole range has been copied, or -1 when
+ * it cannot handle this pair of descriptors so the next one is tried.
+ * Methods advance cp->offset and cp->length as they make progress.
+ */
+struct copy {
+	int		ifd;
+	int		ofd;
+	const char	*src;
+	const char	*dst;
+	off_t		offset;		/* -1: current position of ifd */
+	off_t		length;
+};
+
+/*
+ * Shared state of an mpkg_parallel() run: every thread takes the next
+ * unclaimed index until all of them have been handed out.
+ */
+struct parallel {
+	pthread_mutex_t	lock;
+	size_t		next;
+	size_t		count;
+	void		(*func)(void *, size_t);
+	void		*arg;
+};
+
+static int	copy_file_range_method(struct copy *cp);
+static int	copy_reflink(struct copy *cp);
+static int	copy_rw(struct copy *cp);
+static int	copy_sendfile(struct copy *cp);
+static int	copy_unsupported(int error);
+static void	*parallel_main(void *arg);
+
+static struct {
+	const char	*name;
+	int		(*copy)(struct copy *);
+} methods[] = {
+	{ "reflink",		copy_reflink },
+	{ "copy_file_range",	copy_file_range_method },
+	{ "sendfile",		copy_sendfile },
+	{ "read/write",		copy_rw },
+	{ NULL,			NULL }
+};
+
 void
 mpkg_copy(const char *src, const char *dst)
 {
-	char buf[512];
-	ssize_t nbytes, written;
 	int ifd, ofd;
+	struct stat sb;
 
-	if ((ifd = open(src, O_RDONLY)) == -1)
+	if ((ifd = open(src, O_RDONLY|O_CLOEXEC)) == -1)
 		err(1, "cannot open file: %s", src);
-	if ((ofd = open(dst, O_WRONLY|O_CREAT|O_TRUNC, 0644)) == -1)
+	if ((ofd = open(dst, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644)) == -1)
 		err(1, "cannot open file: %s", dst);
+	if (fstat(ifd, &sb) == -1)
+		err(1, "fstat: %s", src);
 
-	while ((nbytes = read(ifd, buf, sizeof(buf))) > 0) {
-		if ((written = write(ofd, buf, nbytes)) == -1)
-			err(1, "write: %s", dst);
-		if (written < nbytes)
-			errx(1, "write: %s: truncated write", dst);
-	}
-	if (nbytes == -1)
-		err(1, "read: %s", src);
+	mpkg_copy_data(ifd, src, 0, ofd, dst, sb.st_size);
 
 	close(ifd);
 	close(ofd);
 }
 
+void
+mpkg_copy_data(int ifd, const char *src, off_t offset,
+	       int ofd, const char *dst, off_t length)
+{
+	int idx;
+	struct copy cp;
+
+	cp.ifd = ifd;
+	cp.ofd = ofd;
+	cp.src = src;
+	cp.dst = dst;
+	cp.offset = offset;
+	cp.length = length;
+
+	for (idx = 0; methods[idx].name; ++idx) {
+		if (cp.length == 0 || methods[idx].copy(&cp) == 0)
+			return;
+	}
+	errx(1, "%s: %s: no usable copy method", src, dst);
+}
+
+int
+mpkg_clone(int ifd, int ofd)
+{
+#if defined(__linux__) && defined(FICLONE)
+	return (ioctl(ofd, FICLONE, ifd) == -1 ? -1 : 0);
+#else
+	(void)ifd;
+	(void)ofd;
+	return (-1);
+#endif
+}
+
+/*
+ * Clone length bytes at offset in ifd to the current position of ofd,
+ * and move that position past them.  Cloning shares the source extents
+ * with the destination, which only works for block aligned ranges on
+ * the same CoW filesystem; -1 is returned for everything else.
+ */
+int
+mpkg_clone_range(int ifd, off_t offset, int ofd, off_t length)
+{
+#if defined(__linux__) && defined(FICLONERANGE)
+	struct file_clone_range fcr;
+	off_t dst_offset;
+
+	if ((dst_offset = lseek(ofd, 0, SEEK_CUR)) == -1)
+		return (-1);
+
+	bzero(&fcr, sizeof(fcr));
+	fcr.src_fd = ifd;
+	fcr.src_offset = (uint64_t)offset;
+	fcr.src_length = (uint64_t)length;
+	fcr.dest_offset = (uint64_t)dst_offset;
+	if (ioctl(ofd, FICLONERANGE, &fcr) == -1)
+		return (-1);
+
+	/* unlike a copy, cloning leaves the file offset alone */
+	return (lseek(ofd, length, SEEK_CUR) == -1 ? -1 : 0);
+#else
+	(void)ifd;
+	(void)offset;
+	(void)ofd;
+	(void)length;
+	return (-1);
+#endif
+}
+
 void
 mpkg_copy_tmp(char *dst, const char *src)
 {
@@ -96,3 +213,180 @@ mpkg_mkdirs(const char *path)
 	}
 	free(p1);
 }
+
+void
+mpkg_parallel(int jobs, size_t count, void (*func)(void *, size_t), void *arg)
+{
+	int error, idx;
+	pthread_t *threads;
+	struct parallel pl;
+
+	if (jobs < 1)
+		jobs = 1;
+	if ((size_t)jobs > count)
+		jobs = (int)count;
+	if (jobs < 2) {
+		for (pl.next = 0; pl.next < count; ++pl.next)
+			func(arg, pl.next);
+		return;
+	}
+
+	if ((error = pthread_mutex_init(&pl.lock, NULL))) {
+		errno = error;
+		err(1, "pthread_mutex_init");
+	}
+	pl.next = 0;
+	pl.count = count;
+	pl.func = func;
+	pl.arg = arg;
+
+	threads = xcalloc(jobs, sizeof(pthread_t));
+	for (idx = 0; idx < jobs; ++idx) {
+		if ((error = pthread_create(&threads[idx], NULL,
+					    parallel_main, &pl))) {
+			errno = error;
+			err(1, "pthread_create");
+		}
+	}
+	for (idx = 0; idx < jobs; ++idx) {
+		if ((error = pthread_join(threads[idx], NULL))) {
+			errno = error;
+			err(1, "pthread_join");
+		}
+	}
+	free(threads);
+	pthread_mutex_destroy(&pl.lock);
+}
+
+static int
+copy_file_range_method(struct copy *cp)
+{
+#if defined(__linux__) || defined(__FreeBSD__)
+	off_t *offp;
+	ssize_t nbytes;
+
+	offp = cp->offset == -1 ? NULL : &cp->offset;
+	while (cp->length > 0) {
+		nbytes = copy_file_range(cp->ifd, offp, cp->ofd, NULL,
+					 (size_t)cp->length, 0);
+		if (nbytes == -1) {
+			if (copy_unsupported(errno))
+				return (-1);
+			err(1, "copy_file_range: %s: %s", cp->src, cp->dst);
+		}
+		if (nbytes == 0)
+			errx(1, "read: %s: truncated read", cp->src);
+		cp->length -= nbytes;
+	}
+	return (0);
+#else
+	(void)cp;
+	return (-1);
+#endif
+}
+
+static int
+copy_reflink(struct copy *cp)
+{
+	if (cp->offset == -1 ||
+	    mpkg_clone_range(cp->ifd, cp->offset, cp->ofd, cp->length) == -1)
+		return (-1);
+
+	cp->offset += cp->length;
+	cp->length = 0;
+	return (0);
+}
+
+static int
+copy_rw(struct copy *cp)
+{
+	char *buf;
+	size_t nbytes;
+	ssize_t length, written;
+
+	buf = xmalloc(COPY_BUFSIZ);
+	while (cp->length > 0) {
+		nbytes = cp->length < COPY_BUFSIZ ?
+			(size_t)cp->length : COPY_BUFSIZ;
+		if (cp->offset == -1)
+			length = read(cp->ifd, buf, nbytes);
+		else
+			length = pread(cp->ifd, buf, nbytes, cp->offset);
+		if (length == -1)
+			err(1, "read: %s", cp->src);
+		if (length == 0)
+			errx(1, "read: %s: truncated read", cp->src);
+
+		if ((written = write(cp->ofd, buf, length)) == -1)
+			err(1, "write: %s", cp->dst);
+		if (written < length)
+			errx(1, "write: %s: truncated write", cp->dst);
+
+		if (cp->offset != -1)
+			cp->offset += length;
+		cp->length -= length;
+	}
+	free(buf);
+	return (0);
+}
+
+static int
+copy_sendfile(struct copy *cp)
+{
+#if defined(__linux__)
+	off_t *offp;
+	ssize_t nbytes;
+
+	offp = cp->offset == -1 ? NULL : &cp->offset;
+	while (cp->length > 0) {
+		nbytes = sendfile(cp->ofd, cp->ifd, offp, (size_t)cp->length);
+		if (nbytes == -1) {
+			if (copy_unsupported(errno))
+				return (-1);
+			err(1, "sendfile: %s: %s", cp->src, cp->dst);
+		}
+		if (nbytes == 0)
+			errx(1, "read: %s: truncated read", cp->src);
+		cp->length -= nbytes;
+	}
+	return (0);
+#else
+	(void)cp;
+	return (-1);
+#endif
+}
+
+static int
+copy_unsupported(int error)
+{
+	switch (error) {
+	case EBADF:
+	case EINVAL:
+	case ENOSYS:
+	case EOPNOTSUPP:
+	case EXDEV:
+		return (1);
+	default:
+		return (0);
+	}
+}
+
+static void *
+parallel_main(void *arg)
+{
+	struct parallel *pl = arg;
+	size_t idx;
+
+	for (;;) {
+		pthread_mutex_lock(&pl->lock);
+		idx = pl->next;
+		if (idx < pl->count)
+			++pl->next;
+		pthread_mutex_unlock(&pl->lock);
+
+		if (idx >= pl->count)
+			break;
+		pl->func(pl->arg, idx);
+	}
+	return (NULL);
+}
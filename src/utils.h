@@ -28,8 +28,16 @@
 #ifndef __UTILS_H
 #define __UTILS_H
 
+#include <sys/types.h>
+
+int	mpkg_clone(int ifd, int ofd);
+int	mpkg_clone_range(int ifd, off_t offset, int ofd, off_t length);
 void	mpkg_copy(const char *src, const char *dst);
+void	mpkg_copy_data(int ifd, const char *src, off_t offset,
+		       int ofd, const char *dst, off_t length);
 void	mpkg_copy_tmp(char *dst, const char *src);
 void	mpkg_mkdirs(const char *path);
+void	mpkg_parallel(int jobs, size_t count,
+		      void (*func)(void *, size_t), void *arg);
 
 #endif	/* __UTILS_H */
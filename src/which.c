@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2015, Quentin Schwerkolt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif	/* HAVE_CONFIG_H */
+
+#include <err.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "db.h"
+#include "mpkg.h"
+
+static void usage(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+void
+which_func(config_t *config, int argc, char **argv)
+{
+	char dbpath[PATH_MAX], path[PATH_MAX];
+	db_t *db;
+	dbnode_t **owners;
+	int ch, idx, owned, status;
+	size_t len;
+
+	optreset = 1; optind = 1; opterr = 0;
+	while ((ch = getopt(argc, argv, "")) != -1) {
+		switch (ch) {
+		default:
+			usage("%c -- unknown option", ch);
+			break;
+		}
+	}
+	if ((argc - optind) < 1)
+		usage("no path specified");
+
+	bzero(dbpath, sizeof(char) * PATH_MAX);
+	snprintf(dbpath, PATH_MAX, "%s/var/db/mpkg", config->rootdir);
+	db = db_init(dbpath);
+	db_load(db);
+
+	status = 0;
+	for (idx = optind; idx < argc; ++idx) {
+		/* manifests know of usr/bin, not of /usr/bin/ */
+		snprintf(path, PATH_MAX, "%s", argv[idx]);
+		for (len = strlen(path); len > 1 && path[len-1] == '/'; --len)
+			path[len-1] = '\0';
+
+		owners = db_owners(db, path);
+		for (owned = 0; owners[owned]; ++owned)
+			printf("%s: %s-%d\n", argv[idx], owners[owned]->name,
+			       owners[owned]->release);
+		if (!owned) {
+			warnx("%s: not owned by any package", argv[idx]);
+			status = 1;
+		}
+		free(owners);
+	}
+	db_free(db);
+
+	if (status)
+		exit(status);
+}
+
+static void
+usage(const char *fmt, ...)
+{
+	const char *progname;
+	va_list ap;
+
+	if (fmt) {
+		va_start(ap, fmt);
+		vwarnx(fmt, ap);
+		va_end(ap);
+	}
+
+	progname = getprogname();
+	fprintf(stdout,
+		"usage:\n"
+		"\t%s which path [...]\n",
+		progname);
+
+	exit(2);
+}
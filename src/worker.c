@@ -29,10 +29,12 @@
 #include "config.h"
 #endif	/* HAVE_CONFIG_H */
 
+#include <sys/stat.h>
 #include <sys/types.h>
 
-#include <dirent.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -45,11 +47,18 @@
 #include "db.h"
 #include "manifest.h"
 #include "mpkg.h"
+#include "store.h"
 #include "utils.h"
 #include "worker.h"
 #include "xalloc.h"
 
+static void worker_closure(worker_t *worker, catalog_t **closure);
+static void worker_conflicts(worker_t *worker, manifest_t *pkg);
 static inline void worker_install(worker_t *worker);
+static void worker_register(worker_t *worker, const char *manifest,
+			    manifest_t *pkg);
+static void worker_store(worker_t *worker, ar_t *ar, store_t *store,
+			 manifest_t *pkg);
 static inline void worker_uninstall(worker_t *worker);
 static void worker_script(worker_t *worker, const char *arg);
 
@@ -100,7 +109,7 @@ worker_depends(worker_t *worker, char **depends)
 		node = db_find(worker->db, depends[idx]);
 
 		printf("%s depends on: %s - ", worker->package, depends[idx]);
-		if (node && node->pkg->release >= obj->release) {
+		if (node && node->release >= obj->release) {
 			printf("found\n");
 		}
 		else {
@@ -109,58 +118,118 @@ worker_depends(worker_t *worker, char **depends)
 			depw = worker_new(worker->config,
 					  depends[idx],
 					  worker->action, true);
+			worker_set_catalog(depw, worker->catalog);
+			worker_set_db(depw, worker->db);
 			worker_exec(depw);
 			worker_free(depw);
-
-			db_reload(worker->db);
-			idx = -1;
 		}
 	}
 }
 
-static bool
-worker_has_rdepends(worker_t *worker)
+/*
+ * Install the packages planned by the catalog, each after its own depends,
+ * so none of them has to look for its depends again.
+ */
+static void
+worker_closure(worker_t *worker, catalog_t **closure)
 {
 	dbnode_t *node;
-	manifest_depend_t *depend;
+	int idx;
+	worker_t *depw;
+
+	for (idx = 0; closure[idx]; ++idx) {
+		node = db_find(worker->db, closure[idx]->package);
 
-	for (node = worker->db->nodes; node; /* void */) {
-		if (!strcmp(node->pkg->name, worker->package)) {
-			node = node->next;
+		printf("%s depends on: %s - ",
+		       worker->package, closure[idx]->package);
+		if (node && node->release >= closure[idx]->release) {
+			printf("found\n");
 			continue;
 		}
+		printf("not found\n");
+
+		depw = worker_new(worker->config, closure[idx]->package,
+				  worker->action, true);
+		worker_set_catalog(depw, worker->catalog);
+		worker_set_db(depw, worker->db);
+		depw->resolved = true;
+		worker_exec(depw);
+		worker_free(depw);
+	}
+}
 
-		for (depend = node->pkg->depends; depend; /* void */) {
-			if (!strcmp(depend->name, worker->package))
-				return (true);
-			depend = depend->next;
+/*
+ * Refuse to install pkg over files that another package owns.  Directories
+ * are meant to be shared.
+ */
+static void
+worker_conflicts(worker_t *worker, manifest_t *pkg)
+{
+	dbnode_t **owners;
+	int conflicts, idx;
+	manifest_iter_t iter;
+	manifest_node_t *node;
+
+	conflicts = 0;
+	manifest_iter_init(&iter, pkg);
+	while ((node = manifest_iter_next(&iter))) {
+		if (node->kind == MF_NODE_DIR)
+			continue;
+
+		owners = db_owners(worker->db, node->path);
+		for (idx = 0; owners[idx]; ++idx) {
+			if (!strcmp(owners[idx]->name, worker->package))
+				continue;
+			warnx("%s: %s is owned by %s", worker->package,
+			      node->path, owners[idx]->name);
+			++conflicts;
 		}
+		free(owners);
 	}
-	return (false);
+	if (conflicts)
+		errx(1, "%s: conflicts with installed packages",
+		     worker->package);
+}
+
+static bool
+worker_has_rdepends(worker_t *worker)
+{
+	return (db_rdepends(worker->db, worker->package) > 0);
 }
 
 void
 worker_exec(worker_t *worker)
 {
-	catalog_t *obj;
+	catalog_t **closure, *obj;
 	dbnode_t *node;
 
 	if (worker->action & (WORKER_ACTION_INSTALL|WORKER_ACTION_UPDATE)) {
 		if (!(obj = catalog_find(worker->catalog, worker->package)))
 			errx(1, "%s: not found in catalog", worker->package);
 
-		if (obj->depends && *(obj->depends))
-			worker_depends(worker, obj->depends);
+		if (!worker->resolved && obj->depends && *(obj->depends)) {
+			closure = catalog_closure(worker->catalog,
+						  worker->package);
+			if (closure)
+				worker_closure(worker, closure);
+			else
+				worker_depends(worker, obj->depends);
+			free(closure);
+		}
 
 		if (!(node = db_find(worker->db, worker->package)))
 			worker->action = WORKER_ACTION_INSTALL;
-		else if (node->pkg->release < obj->release)
+		else if (node->release < obj->release)
 			worker->action = WORKER_ACTION_UPDATE;
 		else
 			worker->action = WORKER_ACTION_NONE;
+
+		/* being needed again does not undo being asked for */
+		if (node && !node->automatic)
+			worker->automatic = false;
 	}
 	else if (worker->action == WORKER_ACTION_UNINSTALL) {
-		if (worker_has_rdepends(worker))
+		if (!worker->orphan && worker_has_rdepends(worker))
 			worker->action = WORKER_ACTION_NONE;
 	}
 
@@ -245,59 +314,168 @@ static inline void
 worker_install(worker_t *worker)
 {
 	ar_t *ar;
-	char arfile[PATH_MAX];
+	char arfile[PATH_MAX], manifest[PATH_MAX];
+	manifest_t *pkg;
+	store_t *store;
 
 	snprintf(arfile, PATH_MAX, "%s/%s/data.a",
 		 worker->config->repodir, worker->package);
+	snprintf(manifest, PATH_MAX, "%s/%s/manifest",
+		 worker->config->repodir, worker->package);
+
+	pkg = manifest_parse(manifest);
+	worker_conflicts(worker, pkg);
 
 	ar = ar_open_read(arfile);
 	ar_set_wrkdir(ar, worker->config->rootdir);
-	ar_extract_all(ar);
+	ar_set_jobs(ar, worker->config->jobs);
+	if ((store = store_open(worker->config->rootdir,
+				worker->config->store))) {
+		worker_store(worker, ar, store, pkg);
+		store_close(store);
+	}
+	else
+		ar_extract_all(ar);
 	ar_close(ar);
+
+	worker_register(worker, manifest, pkg);
+}
+
+/*
+ * Record an installed package in the database, which takes pkg over, and
+ * export it to its own directory: its manifest and whether it was only
+ * pulled in as a dependency.
+ */
+static void
+worker_register(worker_t *worker, const char *manifest, manifest_t *pkg)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	snprintf(path, PATH_MAX, "%s/%s", worker->db->path, worker->package);
+	mpkg_mkdirs(path);
+
+	snprintf(path, PATH_MAX, "%s/%s/manifest",
+		 worker->db->path, worker->package);
+	mpkg_copy(manifest, path);
+
+	snprintf(path, PATH_MAX, "%s/%s/automatic",
+		 worker->db->path, worker->package);
+	if (worker->automatic) {
+		if ((fd = open(path, O_WRONLY|O_CREAT|O_CLOEXEC, 0644)) == -1)
+			err(1, "cannot open file: %s", path);
+		close(fd);
+	}
+	else if (unlink(path) == -1 && errno != ENOENT)
+		err(1, "unlink: %s", path);
+
+	db_commit(worker->db, worker->package, pkg, worker->automatic);
+	db_replace(worker->db, pkg, worker->automatic);
+}
+
+/*
+ * Install regular files through the blob store, and keep the list of
+ * blobs the package uses next to its manifest so the store can be
+ * garbage collected.  Configuration files are always extracted, they
+ * are meant to be edited in place.
+ */
+static void
+worker_store(worker_t *worker, ar_t *ar, store_t *store, manifest_t *pkg)
+{
+	FILE *fp;
+	ar_info_t *info;
+	char key[STORE_KEYMAX], path[PATH_MAX];
+	char **configs;
+	manifest_iter_t iter;
+	manifest_node_t *node;
+	size_t idx, nconfigs;
+
+	configs = NULL;
+	nconfigs = 0;
+	manifest_iter_init(&iter, pkg);
+	while ((node = manifest_iter_next(&iter))) {
+		if (node->kind != MF_NODE_CONFIG)
+			continue;
+		configs = xrealloc(configs, (nconfigs+1) * sizeof(char *));
+		configs[nconfigs++] = xstrdup(node->path);
+	}
+
+	snprintf(path, PATH_MAX, "%s/%s", worker->db->path, worker->package);
+	mpkg_mkdirs(path);
+	snprintf(path, PATH_MAX, "%s/%s/blobs",
+		 worker->db->path, worker->package);
+	if (!(fp = fopen(path, "w")))
+		err(1, "cannot open file: %s", path);
+
+	while ((info = ar_next(ar))) {
+		for (idx = 0; idx < nconfigs; ++idx) {
+			if (!strcmp(configs[idx], info->name))
+				break;
+		}
+
+		if (S_ISREG(info->mode) && idx == nconfigs) {
+			store_extract(store, ar, info, key);
+			fprintf(fp, "%s\n", key);
+		}
+		else
+			ar_extract(ar, info);
+		free(info);
+	}
+
+	if (fclose(fp) == EOF)
+		err(1, "write: %s", path);
+	for (idx = 0; idx < nconfigs; ++idx)
+		free(configs[idx]);
+	free(configs);
 }
 
 static inline void
 worker_uninstall(worker_t *worker)
 {
-	DIR *dirp;
-	bool empty;
 	char path[PATH_MAX];
 	dbnode_t *dnode;
+	int idx;
+	manifest_iter_t iter;
 	manifest_node_t *node;
-	struct dirent *dirent;
+	manifest_t *pkg;
+	static const char *dbfiles[] = {
+		"automatic", "blobs", "manifest", "manifest.bin", NULL
+	};
 
 	dnode = db_find(worker->db, worker->package);
-	for (node = dnode->pkg->nodes; node; /* void */) {
+	pkg = db_manifest(worker->db, dnode);
+	manifest_iter_init(&iter, pkg);
+	while ((node = manifest_iter_next(&iter))) {
 		if (node->kind == MF_NODE_FILE) {
 			snprintf(path, PATH_MAX, "%s/%s",
 				 worker->config->rootdir, node->path);
 			if (unlink(path) == -1)
 				warn("unlink: %s", path);
 		}
-		node = node->next;
 	}
 
-	for (node = dnode->pkg->nodes; node; /* void */) {
+	/* rmdir tells a directory still in use without reading it */
+	manifest_iter_init(&iter, pkg);
+	while ((node = manifest_iter_next(&iter))) {
 		if (node->kind == MF_NODE_DIR) {
 			snprintf(path, PATH_MAX, "%s/%s",
 				 worker->config->rootdir, node->path);
-
-			empty = true;
-			if (!(dirp = opendir(path)))
-				err(1, "opendir: %s", path);
-			while ((dirent = readdir(dirp))) {
-				if (!strcmp(dirent->d_name, ".") ||
-				    !strcmp(dirent->d_name, ".."))
-					continue;
-				empty = false;
-			}
-			closedir(dirp);
-
-			if (empty) {
-				if (rmdir(path) == -1)
-					err(1, "rmdir: %s", path);
-			}
+			if (rmdir(path) == -1 && errno != ENOTEMPTY &&
+			    errno != EEXIST && errno != EBUSY)
+				err(1, "rmdir: %s", path);
 		}
-		node = node->next;
 	}
+
+	for (idx = 0; dbfiles[idx]; ++idx) {
+		snprintf(path, PATH_MAX, "%s/%s/%s", worker->db->path,
+			 worker->package, dbfiles[idx]);
+		if (unlink(path) == -1 && errno != ENOENT)
+			err(1, "unlink: %s", path);
+	}
+	snprintf(path, PATH_MAX, "%s/%s", worker->db->path, worker->package);
+	if (rmdir(path) == -1 && errno != ENOENT)
+		warn("rmdir: %s", path);
+
+	db_commit(worker->db, worker->package, NULL, 0);
+	db_remove(worker->db, worker->package);
 }
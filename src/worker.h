@@ -44,6 +44,8 @@ struct worker {
 	char		*package;
 	int		action;
 	bool		automatic;
+	bool		resolved;	/* depends already installed */
+	bool		orphan;		/* found by db_orphans() */
 };
 
 worker_t *worker_new(config_t *config, const char *package, int action, bool automatic);